@@ -0,0 +1,8 @@
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "ALTER EXTENSION vector UPDATE TO '0.8.0'" to load this file. \quit
+
+CREATE FUNCTION ivfflat_rebalance(regclass) RETURNS integer
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+CREATE FUNCTION hnsw_compact(regclass) RETURNS integer
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
@@ -261,6 +261,14 @@ CREATE ACCESS METHOD hnsw TYPE INDEX HANDLER hnswhandler;
 
 COMMENT ON ACCESS METHOD hnsw IS 'hnsw index access method';
 
+-- access method functions
+
+CREATE FUNCTION ivfflat_rebalance(regclass) RETURNS integer
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+CREATE FUNCTION hnsw_compact(regclass) RETURNS integer
+	AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
 
 
 -- access method private functions
@@ -18,6 +18,10 @@
 #endif
 
 int			hnsw_ef_search;
+int			hnsw_rerank_k;
+bool		hnsw_quantized_build;
+bool		hnsw_sharded_build;
+int			hnsw_insert_batch_size;
 int			hnsw_lock_tranche_id;
 static relopt_kind hnsw_relopt_kind;
 
@@ -49,6 +53,16 @@ HnswInitLockTranche(void)
 	LWLockRegisterTranche(hnsw_lock_tranche_id, "HnswBuild");
 }
 
+/*
+ * Validate the quantizer option
+ */
+static void
+HnswValidateQuantizer(const char *value)
+{
+	if (value != NULL)
+		HnswParseQuantizer(value);
+}
+
 /*
  * Initialize index options and variables
  */
@@ -90,6 +104,20 @@ HnswInit(void)
 #endif
 		);
 
+	add_int_reloption(hnsw_relopt_kind, "split_vectors", "Whether to store vectors on separate pages",
+					  HNSW_DEFAULT_SPLIT_VECTORS, HNSW_MIN_SPLIT_VECTORS, HNSW_MAX_SPLIT_VECTORS
+#if PG_VERSION_NUM >= 130000
+					  ,AccessExclusiveLock
+#endif
+		);
+
+	add_string_reloption(hnsw_relopt_kind, "quantizer", "Quantizer for element storage",
+						 NULL, HnswValidateQuantizer
+#if PG_VERSION_NUM >= 130000
+						 ,AccessExclusiveLock
+#endif
+		);
+
 	add_string_reloption(hnsw_relopt_kind, "pq_dist_file_name", "File name for Product Quantization distance",
 					  "/root/python_gist/encoded_data_120_4", NULL);
 	
@@ -99,6 +127,22 @@ HnswInit(void)
 							"Valid range is 1..1000.", &hnsw_ef_search,
 							HNSW_DEFAULT_EF_SEARCH, HNSW_MIN_EF_SEARCH, HNSW_MAX_EF_SEARCH, PGC_USERSET, 0, NULL, NULL, NULL);
 
+	DefineCustomIntVariable("hnsw.rerank_k", "Sets the number of candidates to re-rank with exact distances for quantized indexes",
+							"-1 re-ranks all candidates and 0 disables re-ranking.", &hnsw_rerank_k,
+							HNSW_DEFAULT_RERANK_K, HNSW_MIN_RERANK_K, HNSW_MAX_RERANK_K, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("hnsw.quantized_build", "Builds the graph for sq8 and sq4 indexes with quantized distances",
+							 "Only codes are kept in memory, so much larger graphs fit in maintenance_work_mem.", &hnsw_quantized_build,
+							 false, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("hnsw.sharded_build", "Builds graphs that exceed maintenance_work_mem in shards",
+							 "Each shard is built in memory and then merged into the graph on disk.", &hnsw_sharded_build,
+							 false, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("hnsw.insert_batch_size", "Sets the number of inserted tuples to add to the graph at once",
+							"0 adds each tuple on insert. Batches are only used with Postgres 17+.", &hnsw_insert_batch_size,
+							HNSW_DEFAULT_INSERT_BATCH_SIZE, HNSW_MIN_INSERT_BATCH_SIZE, HNSW_MAX_INSERT_BATCH_SIZE, PGC_USERSET, 0, NULL, NULL, NULL);
+
 	MarkGUCPrefixReserved("hnsw");
 }
 
@@ -167,6 +211,19 @@ hnswcostestimate(PlannerInfo *root, IndexPath *path, double loop_count,
 	*indexPages = costs.numIndexPages;
 }
 
+/*
+ * Check if the index can return the indexed value for index-only scans
+ */
+static bool
+hnswcanreturn(Relation index, int attno)
+{
+	/* Quantized and normalized values are not the original value */
+	if (HnswGetQuantizerParams(index) != NULL)
+		return false;
+
+	return HnswOptionalProcInfo(index, HNSW_NORM_PROC) == NULL;
+}
+
 /*
  * Parse and validate the reloptions
  */
@@ -179,6 +236,8 @@ hnswoptions(Datum reloptions, bool validate)
 		{"use_pq", RELOPT_TYPE_INT, offsetof(HnswOptions, use_pq)},
 		{"pq_m", RELOPT_TYPE_INT, offsetof(HnswOptions, pq_m)},
 		{"nbits", RELOPT_TYPE_INT, offsetof(HnswOptions, nbits)},
+		{"split_vectors", RELOPT_TYPE_INT, offsetof(HnswOptions, split_vectors)},
+		{"quantizer", RELOPT_TYPE_STRING, offsetof(HnswOptions, quantizer)},
 		{"pq_dist_file_name", RELOPT_TYPE_STRING, offsetof(HnswOptions, pq_dist_file_name)},
 	};
 
@@ -258,11 +317,11 @@ hnswhandler(PG_FUNCTION_ARGS)
 	amroutine->ambuildempty = hnswbuildempty;
 	amroutine->aminsert = hnswinsert;
 #if PG_VERSION_NUM >= 170000
-	amroutine->aminsertcleanup = NULL;
+	amroutine->aminsertcleanup = hnswinsertcleanup;
 #endif
 	amroutine->ambulkdelete = hnswbulkdelete;
 	amroutine->amvacuumcleanup = hnswvacuumcleanup;
-	amroutine->amcanreturn = NULL;
+	amroutine->amcanreturn = hnswcanreturn;
 	amroutine->amcostestimate = hnswcostestimate;
 	amroutine->amoptions = hnswoptions;
 	amroutine->amproperty = NULL;	/* TODO AMPROP_DISTANCE_ORDERABLE */
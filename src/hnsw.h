@@ -13,6 +13,9 @@
 #include "vector.h"
 #include "pq_dist.h"
 #define HNSW_MAX_DIM 2000
+#define HNSW_MAX_SQ8_DIM 4000
+#define HNSW_MAX_SQ4_DIM 8000
+#define HNSW_MAX_BIT_DIM VECTOR_MAX_DIM
 #define HNSW_MAX_NNZ 1000
 
 /* Support functions */
@@ -31,6 +34,7 @@
 /* Must correspond to page numbers since page lock is used */
 #define HNSW_UPDATE_LOCK 	0
 #define HNSW_SCAN_LOCK		1
+#define HNSW_ENTRY_LOCK		2
 
 /* HNSW parameters */
 #define HNSW_DEFAULT_M	16
@@ -52,9 +56,39 @@
 #define HNSW_MIN_PQ_M			1
 #define HNSW_MAX_PQ_M			2000
 #define HNSW_DEFAULT_PQ_M       4
+#define HNSW_DEFAULT_SPLIT_VECTORS	0
+#define HNSW_MIN_SPLIT_VECTORS		0
+#define HNSW_MAX_SPLIT_VECTORS		1
+#define HNSW_DEFAULT_RERANK_K	-1
+#define HNSW_MIN_RERANK_K		-1
+#define HNSW_MAX_RERANK_K		1000
+#define HNSW_DEFAULT_INSERT_BATCH_SIZE	0
+#define HNSW_MIN_INSERT_BATCH_SIZE	0
+#define HNSW_MAX_INSERT_BATCH_SIZE	10000
+
+/* Quantizers */
+#define HNSW_QUANTIZER_NONE	0
+#define HNSW_QUANTIZER_SQ8	1
+#define HNSW_QUANTIZER_SQ4	2
+#define HNSW_QUANTIZER_BIT	3
+
+/* Blocks to sample for quantized builds */
+#define HNSW_QUANTIZER_SAMPLE_BLOCKS	10000
+
+/* Pages claimed at once by parallel vacuum workers */
+#define HNSW_VACUUM_CHUNK_PAGES	64
+
+/* Times to select neighbors again when a neighbor page changes */
+#define HNSW_MAX_UPDATE_RETRIES	3
+
 /* Tuple types */
 #define HNSW_ELEMENT_TUPLE_TYPE  1
 #define HNSW_NEIGHBOR_TUPLE_TYPE 2
+#define HNSW_VECTOR_TUPLE_TYPE   3
+
+/* Element tuple flags */
+#define HNSW_ELEMENT_SPLIT_VECTOR	0x01
+#define HNSW_ELEMENT_QUANTIZED		0x02
 
 /* Make graph robust against non-HOT updates */
 #define HNSW_HEAPTIDS 10
@@ -70,8 +104,11 @@
 #define HNSW_TUPLE_ALLOC_SIZE BLCKSZ
 
 #define HNSW_ELEMENT_TUPLE_SIZE(size)	MAXALIGN(offsetof(HnswElementTupleData, data) + (size))
+#define HNSW_SPLIT_ELEMENT_TUPLE_SIZE	HNSW_ELEMENT_TUPLE_SIZE(sizeof(ItemPointerData))
+#define HNSW_VECTOR_TUPLE_SIZE(size)	MAXALIGN(offsetof(HnswVectorTupleData, data) + (size))
 #define HNSW_NEIGHBOR_TUPLE_SIZE(level, m)	MAXALIGN(offsetof(HnswNeighborTupleData, indextids) + ((level) + 2) * (m) * sizeof(ItemPointerData))
 #define HNSW_NEIGHBOR_PQ_TUPLE_SIZE(level, m, pqsize) MAXALIGN(offsetof(HnswNeighborTupleData, indextids) + ((level) + 2) * (m) * sizeof(ItemPointerData) + (1 + 2 * m) * pqsize)
+#define HNSW_QUANTIZER_PAGE_FLOATS	((int) ((BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(HnswPageOpaqueData))) / sizeof(float)))
 #define HNSW_NEIGHBOR_ARRAY_SIZE(lm)	(offsetof(HnswNeighborArray, items) + sizeof(HnswCandidate) * (lm))
 
 #define HnswPageGetOpaque(page)	((HnswPageOpaque) PageGetSpecialPointer(page))
@@ -79,9 +116,11 @@
 
 #if PG_VERSION_NUM >= 150000
 #define RandomDouble() pg_prng_double(&pg_global_prng_state)
+#define RandomInt() pg_prng_uint32(&pg_global_prng_state)
 #define SeedRandom(seed) pg_prng_seed(&pg_global_prng_state, seed)
 #else
 #define RandomDouble() (((double) random()) / MAX_RANDOM_VALUE)
+#define RandomInt() random()
 #define SeedRandom(seed) srandom(seed)
 #endif
 
@@ -92,6 +131,15 @@
 
 #define HnswIsElementTuple(tup) ((tup)->type == HNSW_ELEMENT_TUPLE_TYPE)
 #define HnswIsNeighborTuple(tup) ((tup)->type == HNSW_NEIGHBOR_TUPLE_TYPE)
+#define HnswIsVectorTuple(tup) ((tup)->type == HNSW_VECTOR_TUPLE_TYPE)
+
+/* Split elements store the TID of their vector tuple in place of the value */
+#define HnswElementTupleIsSplit(etup) (((etup)->flags & HNSW_ELEMENT_SPLIT_VECTOR) != 0)
+#define HnswElementTupleGetVectorTid(etup) ((ItemPointer) &(etup)->data)
+
+/* Quantized elements store codes in place of the value */
+#define HnswElementTupleIsQuantized(etup) (((etup)->flags & HNSW_ELEMENT_QUANTIZED) != 0)
+#define HnswElementTupleGetCodes(etup) ((uint8 *) &(etup)->data)
 
 /* 2 * M connections for ground layer */
 #define HnswGetLayerM(m, layer) (layer == 0 ? (m) * 2 : (m))
@@ -120,6 +168,10 @@
 
 /* Variables */
 extern int	hnsw_ef_search;
+extern int	hnsw_rerank_k;
+extern bool hnsw_quantized_build;
+extern bool hnsw_sharded_build;
+extern int	hnsw_insert_batch_size;
 extern int	hnsw_lock_tranche_id;
 
 typedef struct HnswElementData HnswElementData;
@@ -165,8 +217,11 @@ struct HnswElementData
 	OffsetNumber offno;
 	OffsetNumber neighborOffno;
 	BlockNumber neighborPage;
+	BlockNumber vectorPage;
+	OffsetNumber vectorOffno;
 	Encode_DataPtr    encode_data;
 	DatumPtr	value;
+	DatumPtr	codes;			/* product quantization codes for builds */
 	
 	LWLock		lock;
 };
@@ -205,10 +260,26 @@ typedef struct HnswOptions
 	int         use_pq;         /*whether to use Product Quantization*/
 	int 		pq_m;
 	int 		nbits;
+	int			split_vectors;	/* store vectors on separate pages */
+	int			quantizer;		/* offset of quantizer string */
 	const char* pq_dist_file_name;
 	PQDist* pqdist;
 }			HnswOptions;
 
+typedef struct HnswQuantizerData
+{
+	int			type;
+	int			dimensions;
+	int64		samples;
+	int			nparams;		/* number of floats in min and scale */
+	float	   *min;
+	float	   *scale;
+	Pointer		query;			/* query for queryCodes */
+	uint8	   *queryCodes;
+}			HnswQuantizerData;
+
+typedef HnswQuantizerData * HnswQuantizer;
+
 typedef struct HnswGraph
 {
 	/* Graph state */
@@ -229,6 +300,7 @@ typedef struct HnswGraph
 	/* Flushed state */
 	LWLock		flushLock;
 	bool		flushed;
+	int			shards;
 }			HnswGraph;
 
 typedef struct HnswShared
@@ -291,6 +363,10 @@ typedef struct HnswBuildState
 	int         use_pq;
 	int         pq_m;
 	int         nbits;
+	bool		splitVectors;
+	HnswQuantizer quantizer;
+	bool		quantizedBuild; /* graph stores codes */
+	bool		shardedBuild;	/* merge graphs that exceed memory */
 	const char *pq_dist_file_name;
 	PQDist* pqdist;
 
@@ -335,6 +411,9 @@ typedef struct HnswMetaPageData
 	OffsetNumber entryOffno;
 	int16		entryLevel;
 	BlockNumber insertPage;
+	BlockNumber vectorInsertPage;
+	uint16		quantizer;
+	BlockNumber quantizerPage;
 	const char* pq_dist_file_name;
 	PQDist* pqdist;
 }			HnswMetaPageData;
@@ -355,7 +434,7 @@ typedef struct HnswElementTupleData
 	uint8		type;
 	uint8		level;
 	uint8		deleted;
-	uint8		unused;
+	uint8		flags;
 	uint32      id;
 	ItemPointerData heaptids[HNSW_HEAPTIDS];
 	ItemPointerData neighbortid;
@@ -365,6 +444,16 @@ typedef struct HnswElementTupleData
 
 typedef HnswElementTupleData * HnswElementTuple;
 
+typedef struct HnswVectorTupleData
+{
+	uint8		type;
+	uint8		unused;
+	uint16		unused2;
+	Vector		data;
+}			HnswVectorTupleData;
+
+typedef HnswVectorTupleData * HnswVectorTuple;
+
 typedef struct HnswNeighborTupleData
 {
 	uint8		type;
@@ -383,6 +472,7 @@ typedef struct HnswScanOpaqueData
 {
 	const		HnswTypeInfo *typeInfo;
 	bool		first;
+	bool		quantized;
 	List	   *w;
 	MemoryContext tmpCtx;
 
@@ -394,6 +484,28 @@ typedef struct HnswScanOpaqueData
 
 typedef HnswScanOpaqueData * HnswScanOpaque;
 
+typedef struct HnswVacuumRange
+{
+	BlockNumber start;
+	BlockNumber count;
+}			HnswVacuumRange;
+
+typedef struct HnswVacuumShared
+{
+	/* Immutable state */
+	Oid			indexrelid;
+	int			nchunks;
+	int			ndeleted;
+
+	/* Mutex for mutable state */
+	slock_t		mutex;
+
+	/* Mutable state */
+	int			nextChunk;
+	int64		localRepairs;
+	int64		searchRepairs;
+}			HnswVacuumShared;
+
 typedef struct HnswVacuumState
 {
 	/* Info */
@@ -415,6 +527,13 @@ typedef struct HnswVacuumState
 	BufferAccessStrategy bas;
 	HnswNeighborTuple ntup;
 	HnswElementData highestPoint;
+	int64		localRepairs;
+	int64		searchRepairs;
+
+	/* Element pages */
+	HnswVacuumRange *ranges;
+	int			nranges;
+	int			maxranges;
 
 	/* Memory */
 	MemoryContext tmpCtx;
@@ -426,6 +545,8 @@ int			HnswGetEfConstruction(Relation index);
 int         HnswGetUsePQ(Relation index);
 int 	    HnswGetPqM(Relation index);
 int 	    HnswGetNbits(Relation index);
+bool		HnswGetSplitVectors(Relation index);
+int			HnswGetQuantizer(Relation index);
 const char* HnswGetPQDistFileName(Relation index);
 PQDist*     HnswGetPQDist(Relation index);
 void        HnswSetPQDist(Relation index, const char* pq_dist_file_name);
@@ -434,6 +555,7 @@ Datum		HnswNormValue(const HnswTypeInfo * typeInfo, Oid collation, Datum value);
 bool		HnswCheckNorm(FmgrInfo *procinfo, Oid collation, Datum value);
 Buffer		HnswNewBuffer(Relation index, ForkNumber forkNum);
 void		HnswInitPage(Buffer buf, Page page);
+Size		HnswGetReusableSpace(Page page, BlockNumber blkno);
 void		HnswInit(void);
 List	   *HnswSearchLayer(char *base, Datum q, List *ep, int ef, int lc, Relation index, FmgrInfo *procinfo, Oid collation, int m, bool inserting, HnswElement skipElement, int use_pq, PQDist* pqdist, bool is_search_knn);
 HnswElement HnswGetEntryPoint(Relation index);
@@ -442,6 +564,8 @@ void	   *HnswAlloc(HnswAllocator * allocator, Size size);
 HnswElement HnswInitElement(char *base, ItemPointer tid, int m, double ml, int maxLevel, int use_pq, HnswAllocator * alloc, PQDist* pqdist);
 HnswElement HnswInitElementFromBlock(BlockNumber blkno, OffsetNumber offno);
 void		HnswFindElementNeighbors(char *base, HnswElement element, HnswElement entryPoint, Relation index, FmgrInfo *procinfo, Oid collation, int m, int efConstruction, int use_pq, PQDist* pqdist, bool existing);
+void		HnswMergeElementNeighbors(HnswElement element, HnswElement entryPoint, List **seeds, Relation index, FmgrInfo *procinfo, Oid collation, int m, int ef);
+void		HnswSelectElementNeighbors(HnswElement element, List **candidates, FmgrInfo *procinfo, Oid collation, int m);
 HnswCandidate *HnswEntryCandidate(char *base, HnswElement em, Datum q, Relation rel, FmgrInfo *procinfo, Oid collation, bool loadVec, int use_pq, PQDist* pqdist);
 void		HnswUpdateMetaPage(Relation index, int updateEntry, HnswElement entryPoint, BlockNumber insertPage, ForkNumber forkNum, bool building);
 void		HnswSetNeighborTuple(char *base, HnswNeighborTuple ntup, HnswElement e, int m, int use_pq, PQDist* pqdist);
@@ -451,12 +575,32 @@ bool		HnswInsertTupleOnDisk(Relation index, Datum value, Datum *values, bool *is
 void		HnswUpdateNeighborsOnDisk(Relation index, FmgrInfo *procinfo, Oid collation, HnswElement e, int m, bool checkExisting, bool building);
 void		HnswLoadElementFromTuple(HnswElement element, HnswElementTuple etup, bool loadHeaptids, bool loadVec);
 void		HnswLoadElement(HnswElement element, float *distance, Datum *q, Relation index, FmgrInfo *procinfo, Oid collation, bool loadVec, float *maxDistance, int use_pq, PQDist* pqdist);
-void		HnswSetElementTuple(char *base, HnswElementTuple etup, HnswElement element);
+void		HnswSetElementTuple(char *base, HnswElementTuple etup, HnswElement element, bool splitVectors, HnswQuantizer quantizer, bool encoded);
+void		HnswSetVectorTuple(char *base, HnswVectorTuple vtup, HnswElement element);
+void		HnswLoadElementValue(HnswElement element, Relation index);
+void		HnswUpdateVectorInsertPage(Relation index, BlockNumber vectorInsertPage, ForkNumber forkNum, bool building);
 void		HnswUpdateConnection(char *base, HnswElement element, HnswCandidate * hc, int lm, int lc, int *updateIdx, Relation index, FmgrInfo *procinfo, Oid collation);
-void		HnswLoadNeighbors(HnswElement element, Relation index, int m);
+XLogRecPtr	HnswLoadNeighbors(HnswElement element, Relation index, int m);
 void		HnswInitLockTranche(void);
 const		HnswTypeInfo *HnswGetTypeInfo(Relation index);
 PGDLLEXPORT void HnswParallelBuildMain(dsm_segment *seg, shm_toc *toc);
+PGDLLEXPORT void HnswParallelVacuumMain(dsm_segment *seg, shm_toc *toc);
+
+/* Quantization */
+int			HnswParseQuantizer(const char *value);
+int			HnswQuantizerMaxDimensions(int type);
+HnswQuantizer HnswInitQuantizer(int type, int dimensions);
+void		HnswQuantizerAddSample(HnswQuantizer quantizer, Datum value);
+void		HnswQuantizerFinish(HnswQuantizer quantizer);
+Size		HnswQuantizerCodeSize(HnswQuantizer quantizer);
+void		HnswQuantizerEncode(HnswQuantizer quantizer, Datum value, uint8 *codes);
+Datum		HnswQuantizerDecode(HnswQuantizer quantizer, uint8 *codes);
+float		HnswQuantizerDistance(HnswQuantizer quantizer, FmgrInfo *procinfo, Oid collation, Datum q, uint8 *codes);
+float		HnswQuantizerValueDistance(HnswQuantizer quantizer, FmgrInfo *procinfo, Oid collation, Datum q, Datum value);
+Datum		HnswQuantizerEncodeValue(HnswQuantizer quantizer, Datum value);
+FmgrInfo   *HnswQuantizerCodesProcInfo(HnswQuantizer quantizer, FmgrInfo *procinfo);
+void		HnswQuantizerSetQuery(HnswQuantizer quantizer, Datum q);
+HnswQuantizer HnswGetQuantizerParams(Relation index);
 
 /* Index access methods */
 IndexBuildResult *hnswbuild(Relation heap, Relation index, IndexInfo *indexInfo);
@@ -467,6 +611,9 @@ bool		hnswinsert(Relation index, Datum *values, bool *isnull, ItemPointer heap_t
 #endif
 					   ,IndexInfo *indexInfo
 );
+#if PG_VERSION_NUM >= 170000
+void		hnswinsertcleanup(Relation index, IndexInfo *indexInfo);
+#endif
 IndexBulkDeleteResult *hnswbulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats, IndexBulkDeleteCallback callback, void *callback_state);
 IndexBulkDeleteResult *hnswvacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats);
 IndexScanDesc hnswbeginscan(Relation index, int nkeys, int norderbys);
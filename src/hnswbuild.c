@@ -31,6 +31,11 @@
  * WAL-log the individual inserts. If the graph fit completely in memory and
  * was fully built in the in-memory phase, the on-disk phase is skipped.
  *
+ * With hnsw.sharded_build, the on-disk phase is replaced by shards. When the
+ * graph no longer fits, it's written to disk and the in-memory graph is reset
+ * to build the next tuples as a new shard. Each shard is appended to the
+ * pages and cross-linked with the graph on disk (see MergeShard()).
+ *
  * After we have finished building the graph, we perform one more scan through
  * the index and write all the pages to the WAL.
  */
@@ -74,6 +79,8 @@
 #define PARALLEL_KEY_HNSW_SHARED UINT64CONST(0xA000000000000001)
 #define PARALLEL_KEY_HNSW_AREA UINT64CONST(0xA000000000000002)
 #define PARALLEL_KEY_QUERY_TEXT UINT64CONST(0xA000000000000003)
+#define PARALLEL_KEY_HNSW_PQ UINT64CONST(0xA000000000000004)
+#define PARALLEL_KEY_HNSW_QUANTIZER UINT64CONST(0xA000000000000005)
 
 #if PG_VERSION_NUM < 130000
 #define GENERATIONCHUNK_RAWSIZE (SIZEOF_SIZE_T + SIZEOF_VOID_P * 2)
@@ -106,6 +113,9 @@ CreateMetaPage(HnswBuildState *buildstate)
 	metap->entryOffno = InvalidOffsetNumber;
 	metap->entryLevel = -1;
 	metap->insertPage = InvalidBlockNumber;
+	metap->vectorInsertPage = InvalidBlockNumber;
+	metap->quantizer = buildstate->quantizer != NULL ? buildstate->quantizer->type : HNSW_QUANTIZER_NONE;
+	metap->quantizerPage = InvalidBlockNumber;
 	((PageHeader)page)->pd_lower =
 		((char *)metap + sizeof(HnswMetaPageData)) - (char *)page;
 
@@ -141,11 +151,38 @@ HnswBuildAppendPage(Relation index, Buffer *buf, Page *page, ForkNumber forkNum)
 	HnswInitPage(*buf, *page);
 }
 
+/*
+ * Link new graph pages after the last graph page
+ */
+static void
+LinkGraphPages(Relation index, ForkNumber forkNum, BlockNumber firstPage)
+{
+	Buffer buf;
+	Page page;
+	BlockNumber lastPage;
+
+	buf = ReadBufferExtended(index, forkNum, HNSW_METAPAGE_BLKNO, RBM_NORMAL, NULL);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	lastPage = HnswPageGetMeta(page)->insertPage;
+	UnlockReleaseBuffer(buf);
+
+	buf = ReadBufferExtended(index, forkNum, lastPage, RBM_NORMAL, NULL);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	page = BufferGetPage(buf);
+	HnswPageGetOpaque(page)->nextblkno = firstPage;
+	MarkBufferDirty(buf);
+	UnlockReleaseBuffer(buf);
+}
+
 /*
  * Create graph pages
+ *
+ * When appending a shard, pages are linked after the existing graph pages
+ * and the entry point is updated after merging
  */
 static void
-CreateGraphPages(HnswBuildState *buildstate)
+CreateGraphPages(HnswBuildState *buildstate, bool append)
 {
 	//elog(INFO, "CreateGraphPages");
 	Relation index = buildstate->index;
@@ -155,6 +192,7 @@ CreateGraphPages(HnswBuildState *buildstate)
 	HnswElementTuple etup;
 	HnswNeighborTuple ntup;
 	BlockNumber insertPage;
+	BlockNumber firstPage;
 	HnswElement entryPoint;
 	Buffer buf;
 	Page page;
@@ -172,6 +210,7 @@ CreateGraphPages(HnswBuildState *buildstate)
 	buf = HnswNewBuffer(index, forkNum);
 	page = BufferGetPage(buf);
 	HnswInitPage(buf, page);
+	firstPage = BufferGetBlockNumber(buf);
 
 	while (!HnswPtrIsNull(base, iter))
 	{
@@ -188,7 +227,12 @@ CreateGraphPages(HnswBuildState *buildstate)
 		MemSet(etup, 0, HNSW_TUPLE_ALLOC_SIZE);
 
 		/* Calculate sizes */
-		etupSize = HNSW_ELEMENT_TUPLE_SIZE(VARSIZE_ANY(valuePtr));
+		if (buildstate->quantizer != NULL)
+			etupSize = HNSW_ELEMENT_TUPLE_SIZE(HnswQuantizerCodeSize(buildstate->quantizer));
+		else if (buildstate->splitVectors)
+			etupSize = HNSW_SPLIT_ELEMENT_TUPLE_SIZE;
+		else
+			etupSize = HNSW_ELEMENT_TUPLE_SIZE(VARSIZE_ANY(valuePtr));
 		Size neighborCount = 2 * buildstate->m;
 		
 
@@ -205,7 +249,7 @@ CreateGraphPages(HnswBuildState *buildstate)
 		if (etupSize > HNSW_TUPLE_ALLOC_SIZE)
 			elog(ERROR, "index tuple too large");
 
-		HnswSetElementTuple(base, etup, element);
+		HnswSetElementTuple(base, etup, element, buildstate->splitVectors, buildstate->quantizer, buildstate->quantizedBuild);
 
 		/* Keep element and neighbors on the same page if possible */
 		if (PageGetFreeSpace(page) < etupSize || (combinedSize <= maxSize && PageGetFreeSpace(page) < combinedSize))
@@ -245,13 +289,180 @@ CreateGraphPages(HnswBuildState *buildstate)
 	MarkBufferDirty(buf);
 	UnlockReleaseBuffer(buf);
 
-	entryPoint = HnswPtrAccess(base, buildstate->graph->entryPoint);
-	HnswUpdateMetaPage(index, HNSW_UPDATE_ENTRY_ALWAYS, entryPoint, insertPage, forkNum, true);
+	if (append)
+	{
+		LinkGraphPages(index, forkNum, firstPage);
+		HnswUpdateMetaPage(index, 0, NULL, insertPage, forkNum, true);
+	}
+	else
+	{
+		entryPoint = HnswPtrAccess(base, buildstate->graph->entryPoint);
+		HnswUpdateMetaPage(index, HNSW_UPDATE_ENTRY_ALWAYS, entryPoint, insertPage, forkNum, true);
+	}
 
 	pfree(etup);
 	pfree(ntup);
 }
 
+/*
+ * Create vector pages
+ *
+ * Vector pages form a separate chain after the graph pages, so the element
+ * tuples are patched with the location of their vector tuple. Elements are
+ * in graph page order, so each element page is only read once.
+ */
+static void
+CreateVectorPages(HnswBuildState *buildstate)
+{
+	Relation index = buildstate->index;
+	ForkNumber forkNum = buildstate->forkNum;
+	HnswVectorTuple vtup;
+	BlockNumber vectorInsertPage;
+	Buffer buf;
+	Page page;
+	Buffer ebuf = InvalidBuffer;
+	Page epage = NULL;
+	HnswElementPtr iter = buildstate->graph->head;
+	char *base = buildstate->hnswarea;
+
+	/* Allocate once */
+	vtup = palloc0(HNSW_TUPLE_ALLOC_SIZE);
+
+	/* Prepare first page */
+	buf = HnswNewBuffer(index, forkNum);
+	page = BufferGetPage(buf);
+	HnswInitPage(buf, page);
+
+	while (!HnswPtrIsNull(base, iter))
+	{
+		HnswElement element = HnswPtrAccess(base, iter);
+		Pointer valuePtr = HnswPtrAccess(base, element->value);
+		Size vtupSize = HNSW_VECTOR_TUPLE_SIZE(VARSIZE_ANY(valuePtr));
+		HnswElementTuple etup;
+
+		/* Update iterator */
+		iter = element->next;
+
+		if (vtupSize > HNSW_TUPLE_ALLOC_SIZE)
+			elog(ERROR, "index tuple too large");
+
+		/* Zero memory for each element */
+		MemSet(vtup, 0, HNSW_TUPLE_ALLOC_SIZE);
+		HnswSetVectorTuple(base, vtup, element);
+
+		if (PageGetFreeSpace(page) < vtupSize)
+			HnswBuildAppendPage(index, &buf, &page, forkNum);
+
+		/* Add vector */
+		element->vectorPage = BufferGetBlockNumber(buf);
+		element->vectorOffno = PageAddItem(page, (Item)vtup, vtupSize, InvalidOffsetNumber, false, false);
+		if (element->vectorOffno == InvalidOffsetNumber)
+			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+		/* Move to the page of the element */
+		if (!BufferIsValid(ebuf) || BufferGetBlockNumber(ebuf) != element->blkno)
+		{
+			if (BufferIsValid(ebuf))
+			{
+				MarkBufferDirty(ebuf);
+				UnlockReleaseBuffer(ebuf);
+			}
+
+			ebuf = ReadBufferExtended(index, forkNum, element->blkno, RBM_NORMAL, NULL);
+			LockBuffer(ebuf, BUFFER_LOCK_EXCLUSIVE);
+			epage = BufferGetPage(ebuf);
+		}
+
+		/* Point element to vector */
+		etup = (HnswElementTuple)PageGetItem(epage, PageGetItemId(epage, element->offno));
+		ItemPointerSet(HnswElementTupleGetVectorTid(etup), element->vectorPage, element->vectorOffno);
+	}
+
+	vectorInsertPage = BufferGetBlockNumber(buf);
+
+	/* Commit */
+	if (BufferIsValid(ebuf))
+	{
+		MarkBufferDirty(ebuf);
+		UnlockReleaseBuffer(ebuf);
+	}
+	MarkBufferDirty(buf);
+	UnlockReleaseBuffer(buf);
+
+	HnswUpdateVectorInsertPage(index, vectorInsertPage, forkNum, true);
+
+	pfree(vtup);
+}
+
+/*
+ * Learn quantizer params from the elements in memory
+ */
+static void
+LearnQuantizer(HnswBuildState *buildstate)
+{
+	HnswElementPtr iter = buildstate->graph->head;
+	char *base = buildstate->hnswarea;
+
+	while (!HnswPtrIsNull(base, iter))
+	{
+		HnswElement element = HnswPtrAccess(base, iter);
+
+		HnswQuantizerAddSample(buildstate->quantizer, HnswGetValue(base, element));
+		iter = element->next;
+	}
+
+	HnswQuantizerFinish(buildstate->quantizer);
+}
+
+/*
+ * Create quantizer pages
+ */
+static void
+CreateQuantizerPages(HnswBuildState *buildstate)
+{
+	Relation index = buildstate->index;
+	ForkNumber forkNum = buildstate->forkNum;
+	HnswQuantizer quantizer = buildstate->quantizer;
+	float *params = quantizer->min;
+	int nparams = quantizer->nparams;
+	BlockNumber quantizerPage;
+	Buffer buf;
+	Page page;
+
+	/* Prepare first page */
+	buf = HnswNewBuffer(index, forkNum);
+	page = BufferGetPage(buf);
+	HnswInitPage(buf, page);
+	quantizerPage = BufferGetBlockNumber(buf);
+
+	for (;;)
+	{
+		int count = Min(nparams, HNSW_QUANTIZER_PAGE_FLOATS);
+
+		memcpy(PageGetContents(page), params, count * sizeof(float));
+		((PageHeader)page)->pd_lower = (PageGetContents(page) + count * sizeof(float)) - (char *)page;
+		params += count;
+		nparams -= count;
+
+		if (nparams == 0)
+			break;
+
+		HnswBuildAppendPage(index, &buf, &page, forkNum);
+	}
+
+	/* Commit */
+	MarkBufferDirty(buf);
+	UnlockReleaseBuffer(buf);
+
+	/* Update metapage */
+	buf = ReadBufferExtended(index, forkNum, HNSW_METAPAGE_BLKNO, RBM_NORMAL, NULL);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	page = BufferGetPage(buf);
+	HnswPageGetMeta(page)->quantizerPage = quantizerPage;
+	MarkBufferDirty(buf);
+	UnlockReleaseBuffer(buf);
+}
+
 /*
  * Write neighbor tuples
  */
@@ -315,24 +526,218 @@ WriteNeighborTuples(HnswBuildState *buildstate)
 }
 
 /*
- * Flush pages
+ * Write the graph in memory to pages
  */
 static void
-FlushPages(HnswBuildState *buildstate)
+WriteGraph(HnswBuildState *buildstate)
 {
 #ifdef HNSW_MEMORY
 	elog(INFO, "memory: %zu MB", buildstate->graph->memoryUsed / (1024 * 1024));
 #endif
 
+	/* Quantized builds learn params before building the graph */
+	if (buildstate->quantizer != NULL && buildstate->quantizer->nparams > 0 && !buildstate->quantizedBuild)
+		LearnQuantizer(buildstate);
 
 	CreateMetaPage(buildstate);
-	CreateGraphPages(buildstate);
+	CreateGraphPages(buildstate, false);
+	if (buildstate->splitVectors)
+		CreateVectorPages(buildstate);
+	if (buildstate->quantizer != NULL && buildstate->quantizer->nparams > 0)
+		CreateQuantizerPages(buildstate);
 	WriteNeighborTuples(buildstate);
+}
+
+/*
+ * Flush pages
+ */
+static void
+FlushPages(HnswBuildState *buildstate)
+{
+	WriteGraph(buildstate);
 
 	buildstate->graph->flushed = true;
 	MemoryContextReset(buildstate->graphCtx);
 }
 
+/*
+ * Cross-link an element of a shard with the graph on disk
+ *
+ * The element is loaded from its page so distances match the rest of the
+ * graph for quantized indexes
+ */
+static void
+MergeElement(HnswBuildState *buildstate, HnswElement element, HnswElement entryPoint, FmgrInfo *procinfo, int ef, HnswNeighborTuple ntup)
+{
+	Relation index = buildstate->index;
+	ForkNumber forkNum = buildstate->forkNum;
+	Oid collation = buildstate->collation;
+	int m = buildstate->m;
+	char *base = buildstate->hnswarea;
+	HnswElement e = HnswInitElementFromBlock(element->blkno, element->offno);
+	HnswElement ep = HnswInitElementFromBlock(entryPoint->blkno, entryPoint->offno);
+	List **seeds = palloc(sizeof(List *) * (element->level + 1));
+	Datum q;
+	Size ntupSize;
+	Buffer buf;
+	Page page;
+
+	HnswLoadElement(e, NULL, NULL, index, procinfo, collation, true, NULL, 0, NULL);
+	q = HnswGetValue((char *)NULL, e);
+
+	/* Seed the search with the neighbors in the shard */
+	for (int lc = element->level; lc >= 0; lc--)
+	{
+		HnswNeighborArray *neighbors = HnswGetNeighbors(base, element, lc);
+
+		seeds[lc] = NIL;
+		for (int i = 0; i < neighbors->length; i++)
+		{
+			HnswElement ne = HnswPtrAccess(base, neighbors->items[i].element);
+			HnswElement seed = HnswInitElementFromBlock(ne->blkno, ne->offno);
+
+			seeds[lc] = lappend(seeds[lc], HnswEntryCandidate(NULL, seed, q, index, procinfo, collation, true, 0, NULL));
+		}
+	}
+
+	HnswInitNeighbors(NULL, e, m, NULL);
+	HnswMergeElementNeighbors(e, ep, seeds, index, procinfo, collation, m, ef);
+
+	/* Replace the neighbors from the shard */
+	if (buildstate->use_pq)
+		ntupSize = HNSW_NEIGHBOR_PQ_TUPLE_SIZE(e->level, m, buildstate->pq_m * buildstate->nbits / 8);
+	else
+		ntupSize = HNSW_NEIGHBOR_TUPLE_SIZE(e->level, m);
+
+	MemSet(ntup, 0, HNSW_TUPLE_ALLOC_SIZE);
+	HnswSetNeighborTuple(NULL, ntup, e, m, buildstate->use_pq, buildstate->pqdist);
+
+	buf = ReadBufferExtended(index, forkNum, e->neighborPage, RBM_NORMAL, NULL);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	page = BufferGetPage(buf);
+
+	if (!PageIndexTupleOverwrite(page, e->neighborOffno, (Item)ntup, ntupSize))
+		elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+	MarkBufferDirty(buf);
+	UnlockReleaseBuffer(buf);
+
+	/* Add links from the graph */
+	HnswUpdateNeighborsOnDisk(index, procinfo, collation, e, m, true, true);
+}
+
+/*
+ * Merge the shard in memory into the graph on disk
+ *
+ * Shard pages are appended with the links within the shard, and then each
+ * element is cross-linked with a search of the graph that starts from its
+ * shard neighbors
+ */
+static void
+MergeShard(HnswBuildState *buildstate)
+{
+	Relation index = buildstate->index;
+	ForkNumber forkNum = buildstate->forkNum;
+	HnswQuantizer quantizer = buildstate->quantizer;
+	HnswElementPtr iter = buildstate->graph->head;
+	char *base = buildstate->hnswarea;
+	FmgrInfo *procinfo;
+	HnswElement entryPoint;
+	HnswNeighborTuple ntup;
+	MemoryContext mergeCtx;
+	MemoryContext oldCtx;
+
+	/* Shard neighbors are seeds, so a smaller ef is enough */
+	int ef = Max(2 * buildstate->m, buildstate->efConstruction / 2);
+
+	/* Graph on disk uses the support function for quantized builds */
+	procinfo = index_getprocinfo(index, 1, HNSW_DISTANCE_PROC);
+
+	/* Params may have been learned by another process */
+	if (quantizer != NULL && quantizer->nparams > 0 && !buildstate->quantizedBuild)
+		memcpy(quantizer->min, HnswGetQuantizerParams(index)->min, quantizer->nparams * sizeof(float));
+
+	entryPoint = HnswGetEntryPoint(index);
+
+	CreateGraphPages(buildstate, true);
+	if (buildstate->splitVectors)
+		CreateVectorPages(buildstate);
+	WriteNeighborTuples(buildstate);
+
+	/* Allocate once */
+	ntup = palloc0(HNSW_TUPLE_ALLOC_SIZE);
+
+	mergeCtx = AllocSetContextCreate(CurrentMemoryContext,
+									 "Hnsw merge temporary context",
+									 ALLOCSET_DEFAULT_SIZES);
+	oldCtx = MemoryContextSwitchTo(mergeCtx);
+
+	while (entryPoint != NULL && !HnswPtrIsNull(base, iter))
+	{
+		HnswElement element = HnswPtrAccess(base, iter);
+
+		/* Update iterator */
+		iter = element->next;
+
+		/* Can take a while, so ensure we can interrupt */
+		CHECK_FOR_INTERRUPTS();
+
+		MergeElement(buildstate, element, entryPoint, procinfo, ef, ntup);
+		MemoryContextReset(mergeCtx);
+	}
+
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextDelete(mergeCtx);
+	pfree(ntup);
+
+	/* Shard may have a higher level than the graph */
+	entryPoint = HnswPtrAccess(base, buildstate->graph->entryPoint);
+	HnswUpdateMetaPage(index, HNSW_UPDATE_ENTRY_GREATER, entryPoint, InvalidBlockNumber, forkNum, true);
+}
+
+/*
+ * Reset the graph in memory for the next shard
+ */
+static void
+ResetGraph(HnswBuildState *buildstate)
+{
+	HnswGraph *graph = buildstate->graph;
+	char *base = buildstate->hnswarea;
+
+	HnswPtrStore(base, graph->head, (HnswElement)NULL);
+	HnswPtrStore(base, graph->entryPoint, (HnswElement)NULL);
+
+	if (base == NULL)
+		MemoryContextReset(buildstate->graphCtx);
+
+	graph->memoryUsed = 0;
+
+#if PG_VERSION_NUM < 140005
+	/* Avoid base address for relptr */
+	if (base != NULL)
+		graph->memoryUsed += MAXALIGN(1);
+#endif
+
+	graph->shards++;
+}
+
+/*
+ * Write the graph in memory as a shard
+ *
+ * The first shard is written like a graph that fits in memory, and later
+ * shards are merged into it
+ */
+static void
+FlushShard(HnswBuildState *buildstate)
+{
+	if (buildstate->graph->shards == 0)
+		WriteGraph(buildstate);
+	else
+		MergeShard(buildstate);
+
+	ResetGraph(buildstate);
+}
+
 /*
  * Add a heap TID to an existing element
  */
@@ -437,8 +842,11 @@ UpdateGraphInMemory(FmgrInfo *procinfo, Oid collation, HnswElement element, int
 	HnswGraph *graph = buildstate->graph;
 	char *base = buildstate->hnswarea;
 
-	/* Look for duplicate */
-	if (FindDuplicateInMemory(base, element))
+	/*
+	 * Look for duplicate (distinct values can share codes, and re-ranking
+	 * uses a single heap TID per element)
+	 */
+	if (!buildstate->quantizedBuild && FindDuplicateInMemory(base, element))
 		return;
 
 	/* Add element */
@@ -516,8 +924,10 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heaptid, Hn
 	HnswGraph *graph = buildstate->graph;
 	HnswElement element;
 	HnswAllocator *allocator = &buildstate->allocator;
+	Datum graphValue;
 	Size valueSize;
 	Pointer valuePtr;
+	Pointer codesPtr = NULL;
 	LWLock *flushLock = &graph->flushLock;
 	char *base = buildstate->hnswarea;
 
@@ -537,8 +947,14 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heaptid, Hn
 		value = HnswNormValue(typeInfo, buildstate->collation, value);
 	}
 
+	/* Only keep codes in the graph for quantized builds */
+	if (buildstate->quantizedBuild)
+		graphValue = HnswQuantizerEncodeValue(buildstate->quantizer, value);
+	else
+		graphValue = value;
+
 	/* Get datum size */
-	valueSize = VARSIZE_ANY(DatumGetPointer(value));
+	valueSize = VARSIZE_ANY(DatumGetPointer(graphValue));
 
 	/* Ensure graph not flushed when inserting */
 	LWLockAcquire(flushLock, LW_SHARED);
@@ -568,6 +984,25 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heaptid, Hn
 		LWLockRelease(flushLock);
 		LWLockAcquire(flushLock, LW_EXCLUSIVE);
 
+		if (buildstate->shardedBuild)
+		{
+			/* Another process may have already started a new shard */
+			if (graph->memoryUsed >= graph->memoryTotal)
+			{
+				if (graph->shards == 0)
+					ereport(NOTICE,
+							(errmsg("hnsw graph no longer fits into maintenance_work_mem after " INT64_FORMAT " tuples", (int64)graph->indtuples),
+							 errdetail("Remaining tuples will be built in shards and merged into the graph."),
+							 errhint("Increase maintenance_work_mem to speed up builds.")));
+
+				FlushShard(buildstate);
+			}
+
+			LWLockRelease(flushLock);
+
+			return InsertTuple(index, values, isnull, heaptid, buildstate);
+		}
+
 		if (!graph->flushed)
 		{
 			ereport(NOTICE,
@@ -584,10 +1019,10 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heaptid, Hn
 	}
 
 	/* Ok, we can proceed to allocate the element */
-	//elog(INFO, "pqdist loaded\n");
-	//elog(INFO, "begin to insert element\n");
 	element = HnswInitElement(base, heaptid, buildstate->m, buildstate->ml, buildstate->maxLevel, buildstate->use_pq, allocator, buildstate->pqdist);
 	valuePtr = HnswAlloc(allocator, valueSize);
+	if (buildstate->use_pq)
+		codesPtr = HnswAlloc(allocator, buildstate->pqdist->m * buildstate->pqdist->nbits / 8);
 
 	/*
 	 * We have now allocated the space needed for the element, so we don't
@@ -597,9 +1032,16 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heaptid, Hn
 	LWLockRelease(&graph->allocatorLock);
 
 	/* Copy the datum */
-	memcpy(valuePtr, DatumGetPointer(value), valueSize);
+	memcpy(valuePtr, DatumGetPointer(graphValue), valueSize);
 	HnswPtrStore(base, element->value, valuePtr);
 
+	/* Encode once here so each process encodes its own elements */
+	if (codesPtr != NULL)
+	{
+		PQCaculate_Codes(buildstate->pqdist, ((Vector *)DatumGetPointer(value))->x, (uint8_t *)codesPtr);
+		HnswPtrStore(base, element->codes, codesPtr);
+	}
+
 	/* Create a lock for the element */
 	LWLockInitialize(&element->lock, hnsw_lock_tranche_id);
 
@@ -662,6 +1104,7 @@ InitGraph(HnswGraph *graph, char *base, long memoryTotal)
 	graph->memoryUsed = 0;
 	graph->memoryTotal = memoryTotal;
 	graph->flushed = false;
+	graph->shards = 0;
 	graph->indtuples = 0;
 	SpinLockInit(&graph->lock);
 	LWLockInitialize(&graph->entryLock, hnsw_lock_tranche_id);
@@ -717,6 +1160,7 @@ HnswSharedMemoryAlloc(Size size, void *state)
 static void
 InitBuildState(HnswBuildState *buildstate, Relation heap, Relation index, IndexInfo *indexInfo, ForkNumber forkNum)
 {
+	int maxDimensions;
 
 	buildstate->heap = heap;
 	buildstate->index = index;
@@ -726,18 +1170,14 @@ InitBuildState(HnswBuildState *buildstate, Relation heap, Relation index, IndexI
 
 	buildstate->m = HnswGetM(index);
 	buildstate->efConstruction = HnswGetEfConstruction(index);
+	buildstate->splitVectors = HnswGetSplitVectors(index);
 	buildstate->use_pq = HnswGetUsePQ(index);
+	buildstate->pqdist = NULL;
 	if (buildstate->use_pq)
 	{
 		buildstate->pq_m = HnswGetPqM(index);
 		buildstate->nbits = HnswGetNbits(index);
-		elog(INFO, "pq_m: %d", buildstate->pq_m);
-		elog(INFO, "nbits: %d", buildstate->nbits);
 		buildstate->pq_dist_file_name = HnswGetPQDistFileName(index);
-		elog(INFO, "pq_dist_file_name: %s", buildstate->pq_dist_file_name);
-		buildstate->pqdist = (PQDist*)palloc(sizeof(PQDist));
-		PQDist_load(buildstate->pqdist, buildstate->pq_dist_file_name);
-		elog(INFO, "pqdist loaded");
 	};
 	buildstate->dimensions = TupleDescAttr(index->rd_att, 0)->atttypmod;
 
@@ -749,12 +1189,31 @@ InitBuildState(HnswBuildState *buildstate, Relation heap, Relation index, IndexI
 	if (buildstate->dimensions < 0)
 		elog(ERROR, "column does not have dimensions");
 
-	if (buildstate->dimensions > buildstate->typeInfo->maxDimensions)
-		elog(ERROR, "column cannot have more than %d dimensions for hnsw index", buildstate->typeInfo->maxDimensions);
-
 	if (buildstate->efConstruction < 2 * buildstate->m)
 		elog(ERROR, "ef_construction must be greater than or equal to 2 * m");
 
+	/* Quantizers are trained on vectors */
+	buildstate->quantizer = NULL;
+	maxDimensions = buildstate->typeInfo->maxDimensions;
+	if (HnswGetQuantizer(index) != HNSW_QUANTIZER_NONE)
+	{
+		if (HnswOptionalProcInfo(index, HNSW_TYPE_INFO_PROC) != NULL)
+			elog(ERROR, "quantizer requires vector type for hnsw index");
+
+		if (buildstate->splitVectors)
+			elog(ERROR, "split_vectors is not supported with quantizer");
+
+		maxDimensions = HnswQuantizerMaxDimensions(HnswGetQuantizer(index));
+	}
+
+	if (buildstate->dimensions > maxDimensions)
+		elog(ERROR, "column cannot have more than %d dimensions for hnsw index", maxDimensions);
+
+	if (HnswGetQuantizer(index) != HNSW_QUANTIZER_NONE)
+		buildstate->quantizer = HnswInitQuantizer(HnswGetQuantizer(index), buildstate->dimensions);
+	buildstate->quantizedBuild = false;
+	buildstate->shardedBuild = hnsw_sharded_build;
+
 	buildstate->reltuples = 0;
 	buildstate->indtuples = 0;
 
@@ -788,6 +1247,159 @@ InitBuildState(HnswBuildState *buildstate, Relation heap, Relation index, IndexI
 
 }
 
+/*
+ * Callback for sampling
+ */
+static void
+SampleCallback(Relation index, CALLBACK_ITEM_POINTER, Datum *values,
+			   bool *isnull, bool tupleIsAlive, void *state)
+{
+	HnswBuildState *buildstate = (HnswBuildState *)state;
+	MemoryContext oldCtx;
+	Datum value;
+
+	/* Skip nulls */
+	if (isnull[0])
+		return;
+
+	/* Use memory context since detoast can allocate */
+	oldCtx = MemoryContextSwitchTo(buildstate->tmpCtx);
+
+	/* Detoast once for all calls */
+	value = PointerGetDatum(PG_DETOAST_DATUM(values[0]));
+
+	/* Use the same values as the graph */
+	if (buildstate->normprocinfo == NULL)
+		HnswQuantizerAddSample(buildstate->quantizer, value);
+	else if (HnswCheckNorm(buildstate->normprocinfo, buildstate->collation, value))
+		HnswQuantizerAddSample(buildstate->quantizer, HnswNormValue(buildstate->typeInfo, buildstate->collation, value));
+
+	/* Reset memory context */
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextReset(buildstate->tmpCtx);
+}
+
+/*
+ * Use codes for the graph
+ *
+ * Distances in the graph are computed on the codes, which are what is
+ * stored in element tuples
+ */
+static void
+SetQuantizedGraph(HnswBuildState *buildstate)
+{
+	buildstate->quantizedBuild = true;
+	buildstate->procinfo = HnswQuantizerCodesProcInfo(buildstate->quantizer, buildstate->procinfo);
+}
+
+/*
+ * Learn quantizer params from a sample of rows before building the graph
+ *
+ * Values outside the sample range are clamped, like values inserted after
+ * the build
+ */
+static void
+SampleQuantizer(HnswBuildState *buildstate)
+{
+	BlockNumber totalblocks = RelationGetNumberOfBlocks(buildstate->heap);
+	BlockSamplerData bs;
+
+	BlockSampler_Init(&bs, totalblocks, HNSW_QUANTIZER_SAMPLE_BLOCKS, RandomInt());
+
+	while (BlockSampler_HasMore(&bs))
+	{
+		BlockNumber targblock = BlockSampler_Next(&bs);
+
+		table_index_build_range_scan(buildstate->heap, buildstate->index, buildstate->indexInfo,
+									 false, true, false, targblock, 1, SampleCallback, (void *)buildstate, NULL);
+	}
+
+	HnswQuantizerFinish(buildstate->quantizer);
+
+	ereport(DEBUG1, (errmsg("using " INT64_FORMAT " samples for quantized build", buildstate->quantizer->samples)));
+
+	SetQuantizedGraph(buildstate);
+}
+
+/*
+ * Check if the graph can store codes
+ *
+ * Binary quantization loses too much to build the graph on, and product
+ * quantization codes are computed from the stored values
+ */
+static bool
+UseQuantizedBuild(HnswBuildState *buildstate)
+{
+	if (!hnsw_quantized_build || buildstate->heap == NULL || buildstate->use_pq)
+		return false;
+
+	if (buildstate->quantizer == NULL)
+		return false;
+
+	return buildstate->quantizer->type == HNSW_QUANTIZER_SQ8 || buildstate->quantizer->type == HNSW_QUANTIZER_SQ4;
+}
+
+/*
+ * Load the product quantization codebook
+ *
+ * Only the leader reads the file, and parallel workers get the codebook from
+ * shared memory
+ */
+static void
+LoadPQDist(HnswBuildState *buildstate)
+{
+	buildstate->pqdist = (PQDist *)palloc(sizeof(PQDist));
+	PQDist_load(buildstate->pqdist, buildstate->pq_dist_file_name);
+
+	/* Pages are laid out with the options, and codes are copied with the file */
+	if (buildstate->pqdist->m != buildstate->pq_m || buildstate->pqdist->nbits != buildstate->nbits)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("product quantization file does not match index options"),
+				 errdetail("File has pq_m = %d and nbits = %d, but index has pq_m = %d and nbits = %d.",
+						   buildstate->pqdist->m, buildstate->pqdist->nbits, buildstate->pq_m, buildstate->nbits)));
+
+	ereport(DEBUG1, (errmsg("loaded product quantization file \"%s\"", buildstate->pq_dist_file_name)));
+}
+
+/*
+ * Get the size of the product quantization codebook in shared memory
+ */
+static Size
+PQDistSharedSize(PQDist *pqdist)
+{
+	return add_size(MAXALIGN(sizeof(PQDist)), mul_size(sizeof(float), mul_size(pqdist->code_nums, pqdist->d)));
+}
+
+/*
+ * Copy the product quantization codebook to shared memory
+ */
+static void
+StorePQDist(PQDist *pqdist, char *pqarea)
+{
+	memcpy(pqarea, pqdist, sizeof(PQDist));
+	memcpy(pqarea + MAXALIGN(sizeof(PQDist)), pqdist->centroids, sizeof(float) * pqdist->code_nums * pqdist->d);
+}
+
+/*
+ * Attach to the product quantization codebook in shared memory
+ *
+ * Centroids are used in place, and the query buffers are private
+ */
+static PQDist *
+AttachPQDist(char *pqarea)
+{
+	PQDist *pqdist = (PQDist *)palloc(sizeof(PQDist));
+
+	memcpy(pqdist, pqarea, sizeof(PQDist));
+	pqdist->tuple_id = 0;
+	pqdist->codes = NULL;
+	pqdist->centroids = (float *)(pqarea + MAXALIGN(sizeof(PQDist)));
+	pqdist->pq_dist_cache_data = (float *)palloc(sizeof(float) * pqdist->table_size);
+	pqdist->qdata = (float *)palloc(sizeof(float) * pqdist->d);
+	return pqdist;
+}
+
 /*
  * Free resources
  */
@@ -836,7 +1448,7 @@ ParallelHeapScan(HnswBuildState *buildstate)
  * Perform a worker's portion of a parallel insert
  */
 static void
-HnswParallelScanAndInsert(Relation heapRel, Relation indexRel, HnswShared *hnswshared, char *hnswarea, bool progress)
+HnswParallelScanAndInsert(Relation heapRel, Relation indexRel, HnswShared *hnswshared, char *hnswarea, PQDist *pqdist, float *quantizerParams, bool progress)
 {
 	HnswBuildState buildstate;
 	TableScanDesc scan;
@@ -849,6 +1461,12 @@ HnswParallelScanAndInsert(Relation heapRel, Relation indexRel, HnswShared *hnsws
 	InitBuildState(&buildstate, heapRel, indexRel, indexInfo, MAIN_FORKNUM);
 	buildstate.graph = &hnswshared->graphData;
 	buildstate.hnswarea = hnswarea;
+	buildstate.pqdist = pqdist;
+	if (quantizerParams != NULL)
+	{
+		memcpy(buildstate.quantizer->min, quantizerParams, sizeof(float) * buildstate.quantizer->nparams);
+		SetQuantizedGraph(&buildstate);
+	}
 	InitAllocator(&buildstate.allocator, &HnswSharedMemoryAlloc, &buildstate);
 	scan = table_beginscan_parallel(heapRel,
 									ParallelTableScanFromHnswShared(hnswshared));
@@ -882,6 +1500,9 @@ void HnswParallelBuildMain(dsm_segment *seg, shm_toc *toc)
 	char *sharedquery;
 	HnswShared *hnswshared;
 	char *hnswarea;
+	char *pqarea;
+	PQDist *pqdist = NULL;
+	float *quantizerParams;
 	Relation heapRel;
 	Relation indexRel;
 	LOCKMODE heapLockmode;
@@ -915,8 +1536,16 @@ void HnswParallelBuildMain(dsm_segment *seg, shm_toc *toc)
 
 	hnswarea = shm_toc_lookup(toc, PARALLEL_KEY_HNSW_AREA, false);
 
+	/* Look up product quantization codebook */
+	pqarea = shm_toc_lookup(toc, PARALLEL_KEY_HNSW_PQ, true);
+	if (pqarea != NULL)
+		pqdist = AttachPQDist(pqarea);
+
+	/* Look up quantizer params for quantized builds */
+	quantizerParams = shm_toc_lookup(toc, PARALLEL_KEY_HNSW_QUANTIZER, true);
+
 	/* Perform inserts */
-	HnswParallelScanAndInsert(heapRel, indexRel, hnswshared, hnswarea, false);
+	HnswParallelScanAndInsert(heapRel, indexRel, hnswshared, hnswarea, pqdist, quantizerParams, false);
 
 	/* Close relations within worker */
 	index_close(indexRel, indexLockmode);
@@ -955,9 +1584,10 @@ static void
 HnswLeaderParticipateAsWorker(HnswBuildState *buildstate)
 {
 	HnswLeader *hnswleader = buildstate->hnswleader;
+	float *quantizerParams = buildstate->quantizedBuild ? buildstate->quantizer->min : NULL;
 
 	/* Perform work common to all participants */
-	HnswParallelScanAndInsert(buildstate->heap, buildstate->index, hnswleader->hnswshared, hnswleader->hnswarea, true);
+	HnswParallelScanAndInsert(buildstate->heap, buildstate->index, hnswleader->hnswshared, hnswleader->hnswarea, buildstate->pqdist, quantizerParams, true);
 }
 
 /*
@@ -970,6 +1600,8 @@ HnswBeginParallel(HnswBuildState *buildstate, bool isconcurrent, int request)
 	Snapshot snapshot;
 	Size esthnswshared;
 	Size esthnswarea;
+	Size estpq = 0;
+	Size estquantizer = 0;
 	Size estother;
 	HnswShared *hnswshared;
 	char *hnswarea;
@@ -1007,6 +1639,22 @@ HnswBeginParallel(HnswBuildState *buildstate, bool isconcurrent, int request)
 	shm_toc_estimate_chunk(&pcxt->estimator, esthnswarea);
 	shm_toc_estimate_keys(&pcxt->estimator, 2);
 
+	/* Estimate product quantization codebook space */
+	if (buildstate->pqdist != NULL)
+	{
+		estpq = PQDistSharedSize(buildstate->pqdist);
+		shm_toc_estimate_chunk(&pcxt->estimator, estpq);
+		shm_toc_estimate_keys(&pcxt->estimator, 1);
+	}
+
+	/* Estimate quantizer params space */
+	if (buildstate->quantizedBuild)
+	{
+		estquantizer = sizeof(float) * buildstate->quantizer->nparams;
+		shm_toc_estimate_chunk(&pcxt->estimator, estquantizer);
+		shm_toc_estimate_keys(&pcxt->estimator, 1);
+	}
+
 	/* Finally, estimate PARALLEL_KEY_QUERY_TEXT space */
 	if (debug_query_string)
 	{
@@ -1060,6 +1708,26 @@ HnswBeginParallel(HnswBuildState *buildstate, bool isconcurrent, int request)
 	shm_toc_insert(pcxt->toc, PARALLEL_KEY_HNSW_SHARED, hnswshared);
 	shm_toc_insert(pcxt->toc, PARALLEL_KEY_HNSW_AREA, hnswarea);
 
+	/* Store product quantization codebook for workers */
+	if (buildstate->pqdist != NULL)
+	{
+		char *pqarea;
+
+		pqarea = (char *)shm_toc_allocate(pcxt->toc, estpq);
+		StorePQDist(buildstate->pqdist, pqarea);
+		shm_toc_insert(pcxt->toc, PARALLEL_KEY_HNSW_PQ, pqarea);
+	}
+
+	/* Store quantizer params for workers */
+	if (buildstate->quantizedBuild)
+	{
+		float *quantizerParams;
+
+		quantizerParams = (float *)shm_toc_allocate(pcxt->toc, estquantizer);
+		memcpy(quantizerParams, buildstate->quantizer->min, estquantizer);
+		shm_toc_insert(pcxt->toc, PARALLEL_KEY_HNSW_QUANTIZER, quantizerParams);
+	}
+
 	/* Store query string for workers */
 	if (debug_query_string)
 	{
@@ -1153,7 +1821,13 @@ BuildGraph(HnswBuildState *buildstate, ForkNumber forkNum)
 	}
 
 	/* Flush pages */
-	if (!buildstate->graph->flushed)
+	if (buildstate->graph->shards > 0)
+	{
+		/* Merge the last shard */
+		if (!HnswPtrIsNull(buildstate->hnswarea, buildstate->graph->head))
+			MergeShard(buildstate);
+	}
+	else if (!buildstate->graph->flushed)
 		FlushPages(buildstate);
 
 	/* End parallel build */
@@ -1174,6 +1848,12 @@ BuildIndex(Relation heap, Relation index, IndexInfo *indexInfo,
 
 	InitBuildState(buildstate, heap, index, indexInfo, forkNum);
 
+	if (buildstate->use_pq)
+		LoadPQDist(buildstate);
+
+	if (UseQuantizedBuild(buildstate))
+		SampleQuantizer(buildstate);
+
 	BuildGraph(buildstate, forkNum);
 
 	if (RelationNeedsWAL(index) || forkNum == INIT_FORKNUM)
@@ -0,0 +1,1363 @@
+#include "postgres.h"
+
+#include "access/generic_xlog.h"
+#include "access/table.h"
+#include "catalog/index.h"
+#include "catalog/pg_class.h"
+#include "catalog/storage.h"
+#include "commands/defrem.h"
+#include "fmgr.h"
+#include "hnsw.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "storage/freespace.h"
+#include "storage/lmgr.h"
+#include "utils/acl.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "vector.h"
+
+/* Levels are stored in a uint8 */
+#define COMPACT_LEVELS 256
+
+/* Element page info, indexed by block number */
+typedef struct CompactPage
+{
+	int			position;		/* position in element page chain, or -1 */
+	int			nlive;
+	int			nfree;
+}			CompactPage;
+
+/* Deleted element whose tuples can be overwritten */
+typedef struct CompactSlot
+{
+	ItemPointerData tid;
+	int			position;
+	uint8		level;
+	bool		split;
+	bool		used;
+	Size		etupSize;
+}			CompactSlot;
+
+/* Live element moved to the slot of a deleted element */
+typedef struct CompactMove
+{
+	ItemPointerData from;
+	ItemPointerData to;
+}			CompactMove;
+
+/* Vector tuple and the element that points to it */
+typedef struct CompactVector
+{
+	ItemPointerData vectortid;
+	ItemPointerData owner;
+}			CompactVector;
+
+/* Page kinds for truncating */
+#define COMPACT_OTHER_PAGE		0
+#define COMPACT_ELEMENT_PAGE	1
+#define COMPACT_VECTOR_PAGE		2
+
+typedef struct CompactState
+{
+	Relation	index;
+	BlockNumber nblocks;
+	CompactPage *pages;
+
+	/* Element pages in chain order */
+	BlockNumber *chain;
+	int			nchain;
+
+	CompactSlot *slots;
+	int			nslots;
+	int			levelStart[COMPACT_LEVELS + 1];
+	int			levelCursor[COMPACT_LEVELS];
+
+	CompactMove *moves;
+	int			nmoves;
+
+	MemoryContext tmpCtx;
+}			CompactState;
+
+/*
+ * Compare slots by level, then chain position
+ */
+static int
+CompareSlots(const void *a, const void *b)
+{
+	const CompactSlot *sa = (const CompactSlot *) a;
+	const CompactSlot *sb = (const CompactSlot *) b;
+
+	if (sa->level != sb->level)
+		return sa->level < sb->level ? -1 : 1;
+
+	if (sa->position != sb->position)
+		return sa->position < sb->position ? -1 : 1;
+
+	return ItemPointerCompare((ItemPointer) &sa->tid, (ItemPointer) &sb->tid);
+}
+
+/*
+ * Compare moves by source TID
+ */
+static int
+CompareMoves(const void *a, const void *b)
+{
+	return ItemPointerCompare((ItemPointer) &((const CompactMove *) a)->from, (ItemPointer) &((const CompactMove *) b)->from);
+}
+
+/*
+ * Compare vectors by TID
+ */
+static int
+CompareVectors(const void *a, const void *b)
+{
+	return ItemPointerCompare((ItemPointer) &((const CompactVector *) a)->vectortid, (ItemPointer) &((const CompactVector *) b)->vectortid);
+}
+
+/*
+ * Find the move for an element
+ */
+static CompactMove *
+FindMove(CompactState * cstate, ItemPointer tid)
+{
+	CompactMove key;
+
+	if (cstate->nmoves == 0)
+		return NULL;
+
+	key.from = *tid;
+	return bsearch(&key, cstate->moves, cstate->nmoves, sizeof(CompactMove), CompareMoves);
+}
+
+/*
+ * Get the element pages and deleted elements
+ */
+static void
+GetElementPages(CompactState * cstate)
+{
+	Relation	index = cstate->index;
+	BlockNumber blkno = HNSW_HEAD_BLKNO;
+	int			maxchain = 64;
+	int			maxslots = 64;
+
+	cstate->chain = palloc(sizeof(BlockNumber) * maxchain);
+	cstate->slots = palloc(sizeof(CompactSlot) * maxslots);
+
+	while (BlockNumberIsValid(blkno))
+	{
+		Buffer		buf;
+		Page		page;
+		CompactPage *info = &cstate->pages[blkno];
+		OffsetNumber maxoffno;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		if (cstate->nchain == maxchain)
+		{
+			maxchain *= 2;
+			cstate->chain = repalloc(cstate->chain, sizeof(BlockNumber) * maxchain);
+		}
+
+		info->position = cstate->nchain;
+		cstate->chain[cstate->nchain++] = blkno;
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			ItemId		itemid = PageGetItemId(page, offno);
+			HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, itemid);
+			CompactSlot *slot;
+
+			/* Skip neighbor tuples */
+			if (!HnswIsElementTuple(etup))
+				continue;
+
+			if (!etup->deleted)
+			{
+				info->nlive++;
+				continue;
+			}
+
+			if (cstate->nslots == maxslots)
+			{
+				maxslots *= 2;
+				cstate->slots = repalloc(cstate->slots, sizeof(CompactSlot) * maxslots);
+			}
+
+			slot = &cstate->slots[cstate->nslots++];
+			ItemPointerSet(&slot->tid, blkno, offno);
+			slot->position = info->position;
+			slot->level = etup->level;
+			slot->split = HnswElementTupleIsSplit(etup);
+			slot->used = false;
+			slot->etupSize = ItemIdGetLength(itemid);
+			info->nfree++;
+		}
+
+		blkno = HnswPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+	}
+}
+
+/*
+ * Get the first chain position to move elements from
+ *
+ * Elements are only moved to earlier pages, so stop once the live elements
+ * after a position outnumber the deleted elements before it.
+ */
+static int
+GetFirstSourcePosition(CompactState * cstate)
+{
+	int64		nlive = 0;
+	int64		nfree = cstate->nslots;
+	int			position = cstate->nchain;
+
+	while (position > 1)
+	{
+		CompactPage *info = &cstate->pages[cstate->chain[position - 1]];
+
+		nlive += info->nlive;
+		nfree -= info->nfree;
+
+		if (nlive > nfree)
+			break;
+
+		position--;
+	}
+
+	return position;
+}
+
+/*
+ * Find a slot on an earlier page for an element
+ *
+ * Neighbor tuples grow with the level, so a slot at the same or a higher
+ * level has space for the neighbors. Prefer the same level and the earliest
+ * pages.
+ */
+static CompactSlot *
+FindSlot(CompactState * cstate, HnswElementTuple etup, Size etupSize, int position)
+{
+	bool		split = HnswElementTupleIsSplit(etup);
+
+	for (int level = etup->level; level < COMPACT_LEVELS; level++)
+	{
+		for (int i = cstate->levelCursor[level]; i < cstate->levelStart[level + 1]; i++)
+		{
+			CompactSlot *slot = &cstate->slots[i];
+
+			if (slot->used)
+			{
+				if (i == cstate->levelCursor[level])
+					cstate->levelCursor[level]++;
+
+				continue;
+			}
+
+			/* Slots are ordered by position */
+			if (slot->position >= position)
+				break;
+
+			if (slot->split != split || slot->etupSize < etupSize)
+				continue;
+
+			slot->used = true;
+			return slot;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Choose the elements to move, starting from the end of the chain
+ */
+static void
+PlanMoves(CompactState * cstate)
+{
+	Relation	index = cstate->index;
+	int			firstPosition = GetFirstSourcePosition(cstate);
+	int			maxmoves = 64;
+	int			start = 0;
+
+	if (firstPosition >= cstate->nchain)
+		return;
+
+	/* Group slots by level */
+	qsort(cstate->slots, cstate->nslots, sizeof(CompactSlot), CompareSlots);
+	for (int i = 0; i <= COMPACT_LEVELS; i++)
+	{
+		while (start < cstate->nslots && cstate->slots[start].level < i)
+			start++;
+
+		cstate->levelStart[i] = start;
+		if (i < COMPACT_LEVELS)
+			cstate->levelCursor[i] = start;
+	}
+
+	cstate->moves = palloc(sizeof(CompactMove) * maxmoves);
+
+	for (int position = cstate->nchain - 1; position >= firstPosition; position--)
+	{
+		BlockNumber blkno = cstate->chain[position];
+		Buffer		buf;
+		Page		page;
+		OffsetNumber maxoffno;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			ItemId		itemid = PageGetItemId(page, offno);
+			HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, itemid);
+			CompactSlot *slot;
+			CompactMove *move;
+
+			/* Skip neighbor tuples */
+			if (!HnswIsElementTuple(etup))
+				continue;
+
+			/* Skip deleted elements and elements being deleted */
+			if (etup->deleted || !ItemPointerIsValid(&etup->heaptids[0]))
+				continue;
+
+			slot = FindSlot(cstate, etup, ItemIdGetLength(itemid), position);
+			if (slot == NULL)
+				continue;
+
+			if (cstate->nmoves == maxmoves)
+			{
+				maxmoves *= 2;
+				cstate->moves = repalloc(cstate->moves, sizeof(CompactMove) * maxmoves);
+			}
+
+			move = &cstate->moves[cstate->nmoves++];
+			ItemPointerSet(&move->from, blkno, offno);
+			move->to = slot->tid;
+		}
+
+		UnlockReleaseBuffer(buf);
+	}
+}
+
+/*
+ * Copy a tuple
+ */
+static Item
+CopyTuple(Relation index, ItemPointer tid, Size *size)
+{
+	Buffer		buf;
+	Page		page;
+	ItemId		itemid;
+	Item		item;
+
+	buf = ReadBuffer(index, ItemPointerGetBlockNumber(tid));
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	itemid = PageGetItemId(page, ItemPointerGetOffsetNumber(tid));
+
+	*size = ItemIdGetLength(itemid);
+	item = palloc(*size);
+	memcpy(item, PageGetItem(page, itemid), *size);
+
+	UnlockReleaseBuffer(buf);
+
+	return item;
+}
+
+/*
+ * Copy an element to the tuples of a deleted element
+ *
+ * The copy has no heap TIDs until the element forwards to it, so scans and
+ * crash recovery never see the same heap TID twice.
+ */
+static bool
+CopyElement(Relation index, CompactMove * move)
+{
+	HnswElementTuple etup;
+	HnswNeighborTuple ntup;
+	Item		vtup = NULL;
+	Size		etupSize;
+	Size		ntupSize;
+	Size		vtupSize = 0;
+	Buffer		buf;
+	Page		page;
+	Buffer		nbuf;
+	Page		npage;
+	Buffer		vbuf = InvalidBuffer;
+	Page		vpage = NULL;
+	GenericXLogState *state;
+	BlockNumber blkno = ItemPointerGetBlockNumber(&move->to);
+	OffsetNumber offno = ItemPointerGetOffsetNumber(&move->to);
+	HnswElementTuple dtup;
+	ItemPointerData neighbortid;
+	ItemPointerData vectortid;
+	ItemId		eitemid;
+	ItemId		nitemid;
+	Size		pageFree;
+	Size		npageFree;
+	bool		fits;
+
+	/* Copy source tuples first, since pages can overlap */
+	etup = (HnswElementTuple) CopyTuple(index, &move->from, &etupSize);
+	ntup = (HnswNeighborTuple) CopyTuple(index, &etup->neighbortid, &ntupSize);
+	if (HnswElementTupleIsSplit(etup))
+		vtup = CopyTuple(index, HnswElementTupleGetVectorTid(etup), &vtupSize);
+
+	buf = ReadBuffer(index, blkno);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+
+	eitemid = PageGetItemId(page, offno);
+	dtup = (HnswElementTuple) PageGetItem(page, eitemid);
+	Assert(dtup->deleted);
+	neighbortid = dtup->neighbortid;
+	ItemPointerSetInvalid(&vectortid);
+	if (HnswElementTupleIsSplit(dtup))
+		vectortid = *HnswElementTupleGetVectorTid(dtup);
+
+	if (ItemPointerGetBlockNumber(&neighbortid) == blkno)
+	{
+		nbuf = buf;
+		npage = page;
+	}
+	else
+	{
+		nbuf = ReadBuffer(index, ItemPointerGetBlockNumber(&neighbortid));
+		LockBuffer(nbuf, BUFFER_LOCK_EXCLUSIVE);
+		npage = GenericXLogRegisterBuffer(state, nbuf, 0);
+	}
+
+	nitemid = PageGetItemId(npage, ItemPointerGetOffsetNumber(&neighbortid));
+
+	/* Check for space, like HnswFreeOffset */
+	pageFree = ItemIdGetLength(eitemid) + PageGetExactFreeSpace(page);
+	npageFree = ItemIdGetLength(nitemid);
+	if (nbuf != buf)
+		npageFree += PageGetExactFreeSpace(npage);
+	else if (pageFree >= etupSize)
+		npageFree += pageFree - etupSize;
+
+	fits = pageFree >= etupSize && npageFree >= ntupSize;
+
+	/* Reuse the vector tuple of the deleted element */
+	if (fits && vtup != NULL)
+	{
+		if (ItemPointerIsValid(&vectortid))
+		{
+			vbuf = ReadBuffer(index, ItemPointerGetBlockNumber(&vectortid));
+			LockBuffer(vbuf, BUFFER_LOCK_EXCLUSIVE);
+			vpage = GenericXLogRegisterBuffer(state, vbuf, 0);
+			fits = ItemIdGetLength(PageGetItemId(vpage, ItemPointerGetOffsetNumber(&vectortid))) + PageGetExactFreeSpace(vpage) >= vtupSize;
+		}
+		else
+			fits = false;
+	}
+
+	if (fits)
+	{
+		if (vtup != NULL)
+		{
+			if (!PageIndexTupleOverwrite(vpage, ItemPointerGetOffsetNumber(&vectortid), vtup, vtupSize))
+				elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+			*HnswElementTupleGetVectorTid(etup) = vectortid;
+		}
+
+		/* Heap TIDs are moved once neighbors are updated */
+		for (int i = 0; i < HNSW_HEAPTIDS; i++)
+			ItemPointerSetInvalid(&etup->heaptids[i]);
+		etup->neighbortid = neighbortid;
+
+		if (!PageIndexTupleOverwrite(page, offno, (Item) etup, etupSize))
+			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+		if (!PageIndexTupleOverwrite(npage, ItemPointerGetOffsetNumber(&neighbortid), (Item) ntup, ntupSize))
+			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+		/* Commit */
+		GenericXLogFinish(state);
+	}
+	else
+		GenericXLogAbort(state);
+
+	if (BufferIsValid(vbuf))
+		UnlockReleaseBuffer(vbuf);
+	if (nbuf != buf)
+		UnlockReleaseBuffer(nbuf);
+	UnlockReleaseBuffer(buf);
+
+	return fits;
+}
+
+/*
+ * Copy elements to their new slots
+ */
+static void
+CopyElements(CompactState * cstate)
+{
+	MemoryContext oldCtx = MemoryContextSwitchTo(cstate->tmpCtx);
+	int			nmoves = 0;
+
+	for (int i = 0; i < cstate->nmoves; i++)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		/* Keep element in place if tuples do not fit */
+		if (CopyElement(cstate->index, &cstate->moves[i]))
+			cstate->moves[nmoves++] = cstate->moves[i];
+
+		MemoryContextReset(cstate->tmpCtx);
+	}
+
+	MemoryContextSwitchTo(oldCtx);
+
+	cstate->nmoves = nmoves;
+
+	/* Sort for lookups */
+	qsort(cstate->moves, cstate->nmoves, sizeof(CompactMove), CompareMoves);
+}
+
+/*
+ * Move heap TIDs to the copy and point the neighbors of the element to it
+ *
+ * Until all neighbors point to the copy, graph traversal that reaches the
+ * element continues to the copy on every level. This is a single WAL
+ * record, so a crash in any later step leaves all elements reachable, and
+ * vacuum removes elements that are left without heap TIDs.
+ */
+static void
+ForwardElement(Relation index, CompactMove * move, int m, Size pqSize)
+{
+	BlockNumber blkno = ItemPointerGetBlockNumber(&move->from);
+	BlockNumber newblkno = ItemPointerGetBlockNumber(&move->to);
+	BlockNumber neighborPage;
+	Buffer		buf;
+	Page		page;
+	Buffer		newbuf;
+	Page		newpage;
+	Buffer		nbuf;
+	Page		npage;
+	GenericXLogState *state;
+	HnswElementTuple etup;
+	HnswElementTuple newtup;
+	HnswNeighborTuple ntup;
+
+	/* Elements are only moved to earlier pages */
+	Assert(blkno != newblkno);
+
+	newbuf = ReadBuffer(index, newblkno);
+	LockBuffer(newbuf, BUFFER_LOCK_EXCLUSIVE);
+	buf = ReadBuffer(index, blkno);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+
+	state = GenericXLogStart(index);
+	newpage = GenericXLogRegisterBuffer(state, newbuf, 0);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+
+	etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, ItemPointerGetOffsetNumber(&move->from)));
+	newtup = (HnswElementTuple) PageGetItem(newpage, PageGetItemId(newpage, ItemPointerGetOffsetNumber(&move->to)));
+
+	neighborPage = ItemPointerGetBlockNumber(&etup->neighbortid);
+	if (neighborPage == blkno)
+	{
+		nbuf = buf;
+		npage = page;
+	}
+	else if (neighborPage == newblkno)
+	{
+		nbuf = newbuf;
+		npage = newpage;
+	}
+	else
+	{
+		nbuf = ReadBuffer(index, neighborPage);
+		LockBuffer(nbuf, BUFFER_LOCK_EXCLUSIVE);
+		npage = GenericXLogRegisterBuffer(state, nbuf, 0);
+	}
+
+	ntup = (HnswNeighborTuple) PageGetItem(npage, PageGetItemId(npage, ItemPointerGetOffsetNumber(&etup->neighbortid)));
+
+	/* Move heap TIDs */
+	memcpy(newtup->heaptids, etup->heaptids, sizeof(etup->heaptids));
+	for (int i = 0; i < HNSW_HEAPTIDS; i++)
+		ItemPointerSetInvalid(&etup->heaptids[i]);
+
+	/* Make the copy the only neighbor on each level */
+	for (int i = 0; i < ntup->count; i++)
+		ItemPointerSetInvalid(&ntup->indextids[i]);
+	for (int lc = etup->level; lc >= 0; lc--)
+		ntup->indextids[(etup->level - lc) * m] = move->to;
+
+	/* The copy has the same code as the element */
+	if (pqSize > 0)
+	{
+		uint8	   *codes = (uint8 *) (ntup->indextids + ntup->count);
+
+		memcpy(codes + pqSize, codes, pqSize);
+		ntup->layer0_count = 1;
+	}
+
+	/* Commit */
+	GenericXLogFinish(state);
+	if (nbuf != buf && nbuf != newbuf)
+		UnlockReleaseBuffer(nbuf);
+	UnlockReleaseBuffer(buf);
+	UnlockReleaseBuffer(newbuf);
+}
+
+/*
+ * Forward elements to their copies
+ *
+ * Scans are blocked so none can return the same heap TID from both the
+ * element and its copy.
+ */
+static void
+ForwardElements(CompactState * cstate)
+{
+	Relation	index = cstate->index;
+	int			m = HnswGetM(index);
+	Size		pqSize = 0;
+
+	if (HnswGetUsePQ(index))
+		pqSize = HnswGetPqM(index) * HnswGetNbits(index) / 8;
+
+	LockPage(index, HNSW_SCAN_LOCK, ExclusiveLock);
+
+	for (int i = 0; i < cstate->nmoves; i++)
+		ForwardElement(index, &cstate->moves[i], m, pqSize);
+
+	UnlockPage(index, HNSW_SCAN_LOCK, ExclusiveLock);
+}
+
+/*
+ * Point neighbors and the entry point to the new slots
+ *
+ * Pages are updated separately, which is safe since moved elements forward
+ * to their copies.
+ */
+static void
+UpdateNeighbors(CompactState * cstate)
+{
+	Relation	index = cstate->index;
+	HnswElement entryPoint = HnswGetEntryPoint(index);
+
+	if (entryPoint != NULL)
+	{
+		ItemPointerData entrytid;
+		CompactMove *move;
+
+		ItemPointerSet(&entrytid, entryPoint->blkno, entryPoint->offno);
+		move = FindMove(cstate, &entrytid);
+
+		if (move != NULL)
+		{
+			HnswElement element = HnswInitElementFromBlock(ItemPointerGetBlockNumber(&move->to), ItemPointerGetOffsetNumber(&move->to));
+
+			element->level = entryPoint->level;
+			HnswUpdateMetaPage(index, HNSW_UPDATE_ENTRY_ALWAYS, element, InvalidBlockNumber, MAIN_FORKNUM, false);
+		}
+	}
+
+	for (int position = 0; position < cstate->nchain; position++)
+	{
+		BlockNumber blkno = cstate->chain[position];
+		Buffer		buf;
+		Page		page;
+		GenericXLogState *state;
+		OffsetNumber maxoffno;
+		bool		updated = false;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			HnswNeighborTuple ntup = (HnswNeighborTuple) PageGetItem(page, PageGetItemId(page, offno));
+
+			/* Skip element tuples */
+			if (!HnswIsNeighborTuple(ntup))
+				continue;
+
+			for (int i = 0; i < ntup->count; i++)
+			{
+				CompactMove *move;
+
+				if (!ItemPointerIsValid(&ntup->indextids[i]))
+					continue;
+
+				move = FindMove(cstate, &ntup->indextids[i]);
+				if (move != NULL)
+				{
+					ntup->indextids[i] = move->to;
+					updated = true;
+				}
+			}
+		}
+
+		/* We modified the tuples in place */
+		if (updated)
+			GenericXLogFinish(state);
+		else
+			GenericXLogAbort(state);
+
+		UnlockReleaseBuffer(buf);
+	}
+}
+
+/*
+ * Mark moved elements as deleted
+ */
+static void
+MarkMovesDeleted(CompactState * cstate)
+{
+	Relation	index = cstate->index;
+
+	/*
+	 * Wait for index scans to complete. Scans before this point may have
+	 * reached moved elements through neighbors that were not updated yet.
+	 */
+	LockPage(index, HNSW_SCAN_LOCK, ExclusiveLock);
+	UnlockPage(index, HNSW_SCAN_LOCK, ExclusiveLock);
+
+	for (int i = 0; i < cstate->nmoves; i++)
+	{
+		CompactMove *move = &cstate->moves[i];
+		BlockNumber blkno = ItemPointerGetBlockNumber(&move->from);
+		BlockNumber neighborPage;
+		Buffer		buf;
+		Page		page;
+		Buffer		nbuf;
+		Page		npage;
+		GenericXLogState *state;
+		ItemId		itemid;
+		HnswElementTuple etup;
+		HnswNeighborTuple ntup;
+
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+
+		itemid = PageGetItemId(page, ItemPointerGetOffsetNumber(&move->from));
+		etup = (HnswElementTuple) PageGetItem(page, itemid);
+
+		neighborPage = ItemPointerGetBlockNumber(&etup->neighbortid);
+		if (neighborPage == blkno)
+		{
+			nbuf = buf;
+			npage = page;
+		}
+		else
+		{
+			nbuf = ReadBuffer(index, neighborPage);
+			LockBuffer(nbuf, BUFFER_LOCK_EXCLUSIVE);
+			npage = GenericXLogRegisterBuffer(state, nbuf, 0);
+		}
+
+		ntup = (HnswNeighborTuple) PageGetItem(npage, PageGetItemId(npage, ItemPointerGetOffsetNumber(&etup->neighbortid)));
+
+		/* Overwrite element, like MarkDeleted */
+		/* Keep vector TID so vector tuple can be reused */
+		etup->deleted = 1;
+		if (HnswElementTupleIsQuantized(etup))
+			MemSet(HnswElementTupleGetCodes(etup), 0, ItemIdGetLength(itemid) - offsetof(HnswElementTupleData, data));
+		else if (!HnswElementTupleIsSplit(etup))
+			MemSet(&etup->data, 0, VARSIZE_ANY(&etup->data));
+
+		/* Overwrite neighbors */
+		for (int j = 0; j < ntup->count; j++)
+			ItemPointerSetInvalid(&ntup->indextids[j]);
+
+		/* Commit */
+		GenericXLogFinish(state);
+		if (nbuf != buf)
+			UnlockReleaseBuffer(nbuf);
+		UnlockReleaseBuffer(buf);
+	}
+}
+
+/*
+ * Get the vector tuples of live and deleted elements
+ */
+static void
+GetVectors(CompactState * cstate, CompactVector * *live, int *nlive, CompactVector * *deleted, int *ndeleted)
+{
+	Relation	index = cstate->index;
+	int			maxlive = 64;
+	int			maxdeleted = 64;
+
+	*live = palloc(sizeof(CompactVector) * maxlive);
+	*deleted = palloc(sizeof(CompactVector) * maxdeleted);
+	*nlive = 0;
+	*ndeleted = 0;
+
+	for (int position = 0; position < cstate->nchain; position++)
+	{
+		BlockNumber blkno = cstate->chain[position];
+		Buffer		buf;
+		Page		page;
+		OffsetNumber maxoffno;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+			CompactVector *vec;
+
+			if (!HnswIsElementTuple(etup) || !HnswElementTupleIsSplit(etup))
+				continue;
+
+			if (!ItemPointerIsValid(HnswElementTupleGetVectorTid(etup)))
+				continue;
+
+			if (etup->deleted)
+			{
+				if (*ndeleted == maxdeleted)
+				{
+					maxdeleted *= 2;
+					*deleted = repalloc(*deleted, sizeof(CompactVector) * maxdeleted);
+				}
+
+				vec = &(*deleted)[(*ndeleted)++];
+			}
+			else
+			{
+				if (*nlive == maxlive)
+				{
+					maxlive *= 2;
+					*live = repalloc(*live, sizeof(CompactVector) * maxlive);
+				}
+
+				vec = &(*live)[(*nlive)++];
+			}
+
+			vec->vectortid = *HnswElementTupleGetVectorTid(etup);
+			ItemPointerSet(&vec->owner, blkno, offno);
+		}
+
+		UnlockReleaseBuffer(buf);
+	}
+}
+
+/*
+ * Swap the vector tuples of a live and a deleted element
+ *
+ * The vector is copied to the tuple of the deleted element, which takes the
+ * old tuple. Both elements are updated in the same WAL record.
+ */
+static bool
+SwapVector(Relation index, CompactVector * live, CompactVector * deleted)
+{
+	Item		vtup;
+	Size		vtupSize;
+	Buffer		vbuf;
+	Page		vpage;
+	Buffer		buf;
+	Page		page;
+	Buffer		dbuf;
+	Page		dpage;
+	GenericXLogState *state;
+	HnswElementTuple etup;
+	HnswElementTuple dtup;
+	OffsetNumber voffno = ItemPointerGetOffsetNumber(&deleted->vectortid);
+	bool		fits;
+
+	vtup = CopyTuple(index, &live->vectortid, &vtupSize);
+
+	vbuf = ReadBuffer(index, ItemPointerGetBlockNumber(&deleted->vectortid));
+	LockBuffer(vbuf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	vpage = GenericXLogRegisterBuffer(state, vbuf, 0);
+
+	fits = ItemIdGetLength(PageGetItemId(vpage, voffno)) + PageGetExactFreeSpace(vpage) >= vtupSize;
+	if (!fits)
+	{
+		GenericXLogAbort(state);
+		UnlockReleaseBuffer(vbuf);
+		return false;
+	}
+
+	buf = ReadBuffer(index, ItemPointerGetBlockNumber(&live->owner));
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+
+	if (ItemPointerGetBlockNumber(&deleted->owner) == ItemPointerGetBlockNumber(&live->owner))
+	{
+		dbuf = buf;
+		dpage = page;
+	}
+	else
+	{
+		dbuf = ReadBuffer(index, ItemPointerGetBlockNumber(&deleted->owner));
+		LockBuffer(dbuf, BUFFER_LOCK_EXCLUSIVE);
+		dpage = GenericXLogRegisterBuffer(state, dbuf, 0);
+	}
+
+	if (!PageIndexTupleOverwrite(vpage, voffno, vtup, vtupSize))
+		elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+	etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, ItemPointerGetOffsetNumber(&live->owner)));
+	dtup = (HnswElementTuple) PageGetItem(dpage, PageGetItemId(dpage, ItemPointerGetOffsetNumber(&deleted->owner)));
+	*HnswElementTupleGetVectorTid(etup) = deleted->vectortid;
+	*HnswElementTupleGetVectorTid(dtup) = live->vectortid;
+
+	/* Commit */
+	GenericXLogFinish(state);
+	if (dbuf != buf)
+		UnlockReleaseBuffer(dbuf);
+	UnlockReleaseBuffer(buf);
+	UnlockReleaseBuffer(vbuf);
+
+	return true;
+}
+
+/*
+ * Move vectors from the end of the index into the vector tuples of deleted
+ * elements
+ *
+ * Vector pages are a separate chain, so they need to be compacted for the
+ * end of the relation to be empty.
+ */
+static void
+CompactVectors(CompactState * cstate)
+{
+	Relation	index = cstate->index;
+	MemoryContext oldCtx = MemoryContextSwitchTo(cstate->tmpCtx);
+	CompactVector *live;
+	CompactVector *deleted;
+	int			nlive;
+	int			ndeleted;
+	int			j = 0;
+
+	GetVectors(cstate, &live, &nlive, &deleted, &ndeleted);
+
+	/* Move the last vectors to the first deleted tuples */
+	qsort(live, nlive, sizeof(CompactVector), CompareVectors);
+	qsort(deleted, ndeleted, sizeof(CompactVector), CompareVectors);
+
+	for (int i = nlive - 1; i >= 0; i--)
+	{
+		BlockNumber blkno = ItemPointerGetBlockNumber(&live[i].vectortid);
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* Try the next tuple if this one is too small */
+		while (j < ndeleted && ItemPointerGetBlockNumber(&deleted[j].vectortid) < blkno)
+		{
+			if (SwapVector(index, &live[i], &deleted[j++]))
+				break;
+		}
+
+		/* Vectors are only moved to earlier pages */
+		if (j == ndeleted || ItemPointerGetBlockNumber(&deleted[j].vectortid) >= blkno)
+			break;
+	}
+
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextReset(cstate->tmpCtx);
+
+	/*
+	 * Wait for index scans to complete. Scans before this point may read
+	 * vectors from tuples that inserts can now reuse.
+	 */
+	LockPage(index, HNSW_SCAN_LOCK, ExclusiveLock);
+	UnlockPage(index, HNSW_SCAN_LOCK, ExclusiveLock);
+}
+
+/*
+ * Clear the vector TID of deleted elements that point to removed pages
+ */
+static void
+ClearVectorTids(CompactState * cstate, BlockNumber newnblocks)
+{
+	Relation	index = cstate->index;
+
+	for (int position = 0; position < cstate->nchain; position++)
+	{
+		BlockNumber blkno = cstate->chain[position];
+		Buffer		buf;
+		Page		page;
+		GenericXLogState *state;
+		OffsetNumber maxoffno;
+		bool		updated = false;
+
+		if (blkno >= newnblocks)
+			continue;
+
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+			ItemPointer vectortid;
+
+			if (!HnswIsElementTuple(etup) || !etup->deleted || !HnswElementTupleIsSplit(etup))
+				continue;
+
+			/* Inserts add a new vector tuple for invalid TIDs */
+			vectortid = HnswElementTupleGetVectorTid(etup);
+			if (ItemPointerIsValid(vectortid) && ItemPointerGetBlockNumber(vectortid) >= newnblocks)
+			{
+				ItemPointerSetInvalid(vectortid);
+				updated = true;
+			}
+		}
+
+		/* We modified the tuples in place */
+		if (updated)
+			GenericXLogFinish(state);
+		else
+			GenericXLogAbort(state);
+
+		UnlockReleaseBuffer(buf);
+	}
+}
+
+/*
+ * End chains at the first removed page
+ */
+static void
+EndChains(Relation index, uint8 *kinds, BlockNumber *nextblknos, BlockNumber newnblocks)
+{
+	for (BlockNumber blkno = HNSW_HEAD_BLKNO; blkno < newnblocks; blkno++)
+	{
+		Buffer		buf;
+		Page		page;
+		GenericXLogState *state;
+
+		if (kinds[blkno] == COMPACT_OTHER_PAGE || !BlockNumberIsValid(nextblknos[blkno]) || nextblknos[blkno] < newnblocks)
+			continue;
+
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+		HnswPageGetOpaque(page)->nextblkno = InvalidBlockNumber;
+		GenericXLogFinish(state);
+		UnlockReleaseBuffer(buf);
+	}
+}
+
+/*
+ * Truncate empty pages at the end of the index
+ *
+ * Element and vector pages form separate chains, and removed pages can be
+ * from either. No live element can have tuples on them, and no remaining
+ * element tuple can point to neighbor tuples on them. The relation is only
+ * truncated if no other backend has the index open, like VACUUM does for
+ * tables.
+ */
+static BlockNumber
+TruncatePages(CompactState * cstate)
+{
+	Relation	index = cstate->index;
+	BlockNumber nblocks = cstate->nblocks;
+	BlockNumber newnblocks = nblocks;
+	BlockNumber insertPage = InvalidBlockNumber;
+	BlockNumber vectorInsertPage = InvalidBlockNumber;
+	BlockNumber maxNeighborPage = HNSW_HEAD_BLKNO;
+	BlockNumber *nextblknos;
+	BlockNumber *maxNeighborPages;
+	uint8	   *kinds;
+	bool	   *live;
+
+	kinds = palloc_extended(sizeof(uint8) * nblocks, MCXT_ALLOC_HUGE | MCXT_ALLOC_ZERO);
+	live = palloc_extended(sizeof(bool) * nblocks, MCXT_ALLOC_HUGE | MCXT_ALLOC_ZERO);
+	nextblknos = palloc_extended(sizeof(BlockNumber) * nblocks, MCXT_ALLOC_HUGE);
+	maxNeighborPages = palloc_extended(sizeof(BlockNumber) * nblocks, MCXT_ALLOC_HUGE);
+
+	for (BlockNumber blkno = 0; blkno < nblocks; blkno++)
+	{
+		nextblknos[blkno] = InvalidBlockNumber;
+		maxNeighborPages[blkno] = InvalidBlockNumber;
+	}
+
+	/* Find pages with tuples of live elements */
+	for (int position = 0; position < cstate->nchain; position++)
+	{
+		BlockNumber blkno = cstate->chain[position];
+		Buffer		buf;
+		Page		page;
+		OffsetNumber maxoffno;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		kinds[blkno] = COMPACT_ELEMENT_PAGE;
+		nextblknos[blkno] = HnswPageGetOpaque(page)->nextblkno;
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+			BlockNumber neighborPage;
+
+			if (!HnswIsElementTuple(etup))
+				continue;
+
+			neighborPage = ItemPointerGetBlockNumber(&etup->neighbortid);
+			if (!BlockNumberIsValid(maxNeighborPages[blkno]) || neighborPage > maxNeighborPages[blkno])
+				maxNeighborPages[blkno] = neighborPage;
+
+			if (etup->deleted)
+			{
+				/* Set to first free page */
+				if (!BlockNumberIsValid(insertPage))
+					insertPage = blkno;
+
+				continue;
+			}
+
+			live[blkno] = true;
+			live[neighborPage] = true;
+			if (HnswElementTupleIsSplit(etup) && ItemPointerIsValid(HnswElementTupleGetVectorTid(etup)))
+				live[ItemPointerGetBlockNumber(HnswElementTupleGetVectorTid(etup))] = true;
+		}
+
+		UnlockReleaseBuffer(buf);
+	}
+
+	/* Find vector pages */
+	for (BlockNumber blkno = HNSW_HEAD_BLKNO; blkno < nblocks; blkno++)
+	{
+		Buffer		buf;
+		Page		page;
+
+		if (kinds[blkno] != COMPACT_OTHER_PAGE || !HnswGetSplitVectors(index))
+			continue;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+
+		if (!PageIsNew(page) && PageGetMaxOffsetNumber(page) >= FirstOffsetNumber &&
+			HnswIsVectorTuple((HnswVectorTuple) PageGetItem(page, PageGetItemId(page, FirstOffsetNumber))))
+		{
+			kinds[blkno] = COMPACT_VECTOR_PAGE;
+			nextblknos[blkno] = HnswPageGetOpaque(page)->nextblkno;
+		}
+
+		UnlockReleaseBuffer(buf);
+	}
+
+	/* Always keep the first element page */
+	while (newnblocks - 1 > HNSW_HEAD_BLKNO && kinds[newnblocks - 1] != COMPACT_OTHER_PAGE && !live[newnblocks - 1])
+		newnblocks--;
+
+	/* Keep pages with neighbor tuples of remaining elements */
+	for (BlockNumber blkno = HNSW_HEAD_BLKNO; blkno < nblocks; blkno++)
+	{
+		if (blkno >= newnblocks && maxNeighborPage < blkno)
+			break;
+
+		if (blkno >= newnblocks)
+			newnblocks = blkno + 1;
+
+		if (BlockNumberIsValid(maxNeighborPages[blkno]) && maxNeighborPages[blkno] > maxNeighborPage)
+			maxNeighborPage = maxNeighborPages[blkno];
+	}
+
+	/* Chains only grow at the end, but skip if a removed page links back */
+	for (BlockNumber blkno = newnblocks; blkno < nblocks; blkno++)
+	{
+		if (BlockNumberIsValid(nextblknos[blkno]) && nextblknos[blkno] < newnblocks)
+			newnblocks = nblocks;
+	}
+
+	for (BlockNumber blkno = HNSW_HEAD_BLKNO; blkno < newnblocks; blkno++)
+	{
+		if (kinds[blkno] == COMPACT_VECTOR_PAGE)
+			vectorInsertPage = blkno;
+	}
+
+	/* Truncate if no other backend has the index open */
+	if (newnblocks < nblocks && !ConditionalLockRelation(index, AccessExclusiveLock))
+		newnblocks = nblocks;
+
+	if (newnblocks < nblocks)
+	{
+		EndChains(index, kinds, nextblknos, newnblocks);
+		ClearVectorTids(cstate, newnblocks);
+		HnswUpdateVectorInsertPage(index, vectorInsertPage, MAIN_FORKNUM, false);
+	}
+
+	/* Set to first free page or last page */
+	if (!BlockNumberIsValid(insertPage) || insertPage >= newnblocks)
+	{
+		insertPage = HNSW_HEAD_BLKNO;
+		for (int position = 0; position < cstate->nchain; position++)
+		{
+			if (cstate->chain[position] < newnblocks)
+				insertPage = cstate->chain[position];
+		}
+	}
+	HnswUpdateMetaPage(index, 0, NULL, insertPage, MAIN_FORKNUM, false);
+
+	if (newnblocks < nblocks)
+	{
+		RelationTruncate(index, newnblocks);
+		UnlockRelation(index, AccessExclusiveLock);
+	}
+
+	return nblocks - newnblocks;
+}
+
+/*
+ * Record the space inserts can use on element pages
+ */
+static void
+RecordFreeSpace(Relation index)
+{
+	BlockNumber blkno = HNSW_HEAD_BLKNO;
+
+	while (BlockNumberIsValid(blkno))
+	{
+		Buffer		buf;
+		Page		page;
+		Size		freeSpace;
+		BlockNumber nextblkno;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		freeSpace = HnswGetReusableSpace(page, blkno);
+		nextblkno = HnswPageGetOpaque(page)->nextblkno;
+		UnlockReleaseBuffer(buf);
+
+		RecordPageWithFreeSpace(index, blkno, freeSpace);
+
+		blkno = nextblkno;
+	}
+
+	FreeSpaceMapVacuum(index);
+}
+
+/*
+ * Compact the element and vector pages of an index
+ */
+static BlockNumber
+CompactIndex(Relation index)
+{
+	CompactState cstate;
+	BlockNumber removed;
+
+	cstate.index = index;
+	cstate.pages = NULL;
+	cstate.chain = NULL;
+	cstate.nchain = 0;
+	cstate.slots = NULL;
+	cstate.nslots = 0;
+	cstate.moves = NULL;
+	cstate.nmoves = 0;
+	cstate.tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+										  "Hnsw compact temporary context",
+										  ALLOCSET_DEFAULT_SIZES);
+
+	/*
+	 * Block inserts, since they reuse the slots of deleted elements and
+	 * connect to elements being moved. Scans are only blocked briefly.
+	 */
+	LockPage(index, HNSW_UPDATE_LOCK, ExclusiveLock);
+
+	cstate.nblocks = RelationGetNumberOfBlocks(index);
+	cstate.pages = palloc_extended(sizeof(CompactPage) * cstate.nblocks, MCXT_ALLOC_HUGE | MCXT_ALLOC_ZERO);
+	for (BlockNumber blkno = 0; blkno < cstate.nblocks; blkno++)
+		cstate.pages[blkno].position = -1;
+
+	GetElementPages(&cstate);
+	PlanMoves(&cstate);
+	CopyElements(&cstate);
+	ForwardElements(&cstate);
+	UpdateNeighbors(&cstate);
+	MarkMovesDeleted(&cstate);
+	if (HnswGetSplitVectors(index))
+		CompactVectors(&cstate);
+	removed = TruncatePages(&cstate);
+
+	UnlockPage(index, HNSW_UPDATE_LOCK, ExclusiveLock);
+
+	RecordFreeSpace(index);
+
+	MemoryContextDelete(cstate.tmpCtx);
+
+	return removed;
+}
+
+/*
+ * Compact an hnsw index
+ */
+FUNCTION_PREFIX PG_FUNCTION_INFO_V1(hnsw_compact);
+Datum
+hnsw_compact(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Relation	heap;
+	Relation	index;
+	BlockNumber removed;
+
+	if (get_rel_relkind(relid) != RELKIND_INDEX)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an index", get_rel_name(relid))));
+
+#if PG_VERSION_NUM >= 160000
+	if (!object_ownercheck(RelationRelationId, relid, GetUserId()))
+#else
+	if (!pg_class_ownercheck(relid, GetUserId()))
+#endif
+		aclcheck_error(ACLCHECK_NOT_OWNER, OBJECT_INDEX, get_rel_name(relid));
+
+	/* Lock the table first, like VACUUM */
+	/* Scans and inserts continue, and page locks order the moves with them */
+	heap = table_open(IndexGetRelation(relid, false), ShareUpdateExclusiveLock);
+	index = index_open(relid, RowExclusiveLock);
+
+	if (index->rd_rel->relam != get_index_am_oid("hnsw", false))
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an hnsw index", RelationGetRelationName(index))));
+
+	removed = CompactIndex(index);
+
+	/* Keep locks until end of transaction */
+	index_close(index, NoLock);
+	table_close(heap, NoLock);
+
+	PG_RETURN_INT32(removed);
+}
@@ -5,6 +5,7 @@
 #include "access/generic_xlog.h"
 #include "hnsw.h"
 #include "storage/bufmgr.h"
+#include "storage/freespace.h"
 #include "storage/lmgr.h"
 #include "utils/datum.h"
 #include "utils/memutils.h"
@@ -32,6 +33,67 @@ GetInsertPage(Relation index)
 	return insertPage;
 }
 
+/*
+ * Get the vector insert page
+ */
+static BlockNumber
+GetVectorInsertPage(Relation index)
+{
+	Buffer		buf;
+	Page		page;
+	HnswMetaPage metap;
+	BlockNumber vectorInsertPage;
+
+	buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	metap = HnswPageGetMeta(page);
+
+	vectorInsertPage = metap->vectorInsertPage;
+
+	UnlockReleaseBuffer(buf);
+
+	/* Zero for indexes created without vector pages */
+	if (vectorInsertPage == HNSW_METAPAGE_BLKNO)
+		return InvalidBlockNumber;
+
+	return vectorInsertPage;
+}
+
+/*
+ * Get an element page with space from the free space map
+ *
+ * Vacuum and compaction record the space of element pages. The map can be
+ * outdated, so check the page is still an element page.
+ */
+static BlockNumber
+GetFreeSpacePage(Relation index, Size size)
+{
+	BlockNumber blkno = GetPageWithFreeSpace(index, size);
+	Buffer		buf;
+	Page		page;
+	bool		elementPage;
+
+	if (!BlockNumberIsValid(blkno) || blkno == HNSW_METAPAGE_BLKNO || blkno >= RelationGetNumberOfBlocks(index))
+		return InvalidBlockNumber;
+
+	buf = ReadBuffer(index, blkno);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+
+	elementPage = !PageIsNew(page) && PageGetMaxOffsetNumber(page) >= FirstOffsetNumber;
+	if (elementPage)
+	{
+		HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, FirstOffsetNumber));
+
+		elementPage = HnswIsElementTuple(etup) || HnswIsNeighborTuple(etup);
+	}
+
+	UnlockReleaseBuffer(buf);
+
+	return elementPage ? blkno : InvalidBlockNumber;
+}
+
 /*
  * Check for a free offset
  */
@@ -132,13 +194,137 @@ HnswInsertAppendPage(Relation index, Buffer *nbuf, Page *npage, GenericXLogState
 }
 
 /*
- * Add to element and neighbor pages
+ * Add to vector pages
+ *
+ * Reuses the vector tuple of a deleted element when given one. Pages are
+ * registered with the element's WAL record, so the vector and the element
+ * that references it are logged together, and are left locked for the
+ * caller to release after committing.
  */
 static void
-AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, BlockNumber *updatedInsertPage, bool building)
+AddVectorOnDisk(Relation index, HnswElement e, ItemPointer freeVectorTid, GenericXLogState *state, Buffer *vbuf, Buffer *vnbuf, BlockNumber *updatedVectorInsertPage, bool building)
 {
-	elog(INFO, "AddElementOnDisk");
+	Buffer		buf;
+	Page		page;
+	Buffer		nbuf = InvalidBuffer;
+	Page		npage = NULL;
+	HnswVectorTuple vtup;
+	Size		vtupSize;
+	BlockNumber vectorInsertPage = GetVectorInsertPage(index);
+	BlockNumber currentPage = vectorInsertPage;
+	char	   *base = NULL;
+
+	/* Prepare vector tuple */
+	vtupSize = HNSW_VECTOR_TUPLE_SIZE(VARSIZE_ANY(HnswPtrAccess(base, e->value)));
+	vtup = palloc0(vtupSize);
+	HnswSetVectorTuple(base, vtup, e);
+
+	/* First, try the space of a deleted element */
+	if (ItemPointerIsValid(freeVectorTid))
+	{
+		buf = ReadBuffer(index, ItemPointerGetBlockNumber(freeVectorTid));
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		if (building)
+			page = BufferGetPage(buf);
+		else
+			page = GenericXLogRegisterBuffer(state, buf, 0);
+
+		/* Vectors have the same size, so this should always succeed */
+		if (!PageIndexTupleOverwrite(page, ItemPointerGetOffsetNumber(freeVectorTid), (Item) vtup, vtupSize))
+			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+		e->vectorPage = ItemPointerGetBlockNumber(freeVectorTid);
+		e->vectorOffno = ItemPointerGetOffsetNumber(freeVectorTid);
+
+		if (building)
+			MarkBufferDirty(buf);
+
+		*vbuf = buf;
+		*vnbuf = InvalidBuffer;
+		return;
+	}
+
+	/* Otherwise, find a page with space */
+	for (;;)
+	{
+		/* Create the first vector page if needed */
+		if (!BlockNumberIsValid(currentPage))
+		{
+			LockRelationForExtension(index, ExclusiveLock);
+			buf = HnswNewBuffer(index, MAIN_FORKNUM);
+			UnlockRelationForExtension(index, ExclusiveLock);
+
+			if (building)
+				page = BufferGetPage(buf);
+			else
+				page = GenericXLogRegisterBuffer(state, buf, GENERIC_XLOG_FULL_IMAGE);
+
+			HnswInitPage(buf, page);
+			break;
+		}
+
+		/* Only register the page once it is used */
+		buf = ReadBuffer(index, currentPage);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		page = BufferGetPage(buf);
+
+		if (PageGetFreeSpace(page) >= vtupSize)
+		{
+			if (!building)
+				page = GenericXLogRegisterBuffer(state, buf, 0);
+			break;
+		}
+
+		/* Add a new page after the last vector page */
+		if (!BlockNumberIsValid(HnswPageGetOpaque(page)->nextblkno))
+		{
+			if (!building)
+				page = GenericXLogRegisterBuffer(state, buf, 0);
+			HnswInsertAppendPage(index, &nbuf, &npage, state, page, building);
+			break;
+		}
+
+		/* Move to next page */
+		currentPage = HnswPageGetOpaque(page)->nextblkno;
+		UnlockReleaseBuffer(buf);
+	}
+
+	/* Add vector */
+	if (BufferIsValid(nbuf))
+	{
+		e->vectorPage = BufferGetBlockNumber(nbuf);
+		e->vectorOffno = PageAddItem(npage, (Item) vtup, vtupSize, InvalidOffsetNumber, false, false);
+	}
+	else
+	{
+		e->vectorPage = BufferGetBlockNumber(buf);
+		e->vectorOffno = PageAddItem(page, (Item) vtup, vtupSize, InvalidOffsetNumber, false, false);
+	}
+
+	if (e->vectorOffno == InvalidOffsetNumber)
+		elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+	if (building)
+	{
+		MarkBufferDirty(buf);
+		if (BufferIsValid(nbuf))
+			MarkBufferDirty(nbuf);
+	}
 
+	*vbuf = buf;
+	*vnbuf = nbuf;
+
+	/* Update the vector insert page */
+	if (e->vectorPage != vectorInsertPage)
+		*updatedVectorInsertPage = e->vectorPage;
+}
+
+/*
+ * Add to element and neighbor pages
+ */
+static void
+AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, BlockNumber *updatedInsertPage, BlockNumber *updatedVectorInsertPage, bool building)
+{
 	Buffer		buf;
 	Page		page;
 	GenericXLogState *state;
@@ -155,25 +341,51 @@ AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, B
 	OffsetNumber freeOffno = InvalidOffsetNumber;
 	OffsetNumber freeNeighborOffno = InvalidOffsetNumber;
 	BlockNumber newInsertPage = InvalidBlockNumber;
+	BlockNumber freePage = InvalidBlockNumber;
+	Size		freeSpace = 0;
+	Buffer		vbuf = InvalidBuffer;
+	Buffer		vnbuf = InvalidBuffer;
+	bool		splitVectors = HnswGetSplitVectors(index);
+	HnswQuantizer quantizer = HnswGetQuantizerParams(index);
+	int			use_pq = HnswGetUsePQ(index);
+	PQDist	   *pqdist = use_pq ? HnswGetPQDist(index) : NULL;
 	char	   *base = NULL;
 
+	/* Quantized indexes do not store vectors */
+	if (quantizer != NULL)
+		splitVectors = false;
+
 	/* Calculate sizes */
-	etupSize = HNSW_ELEMENT_TUPLE_SIZE(VARSIZE_ANY(HnswPtrAccess(base, e->value)));
-	ntupSize = HNSW_NEIGHBOR_TUPLE_SIZE(e->level, m) + (1 + (e->level + 2) * m) * HnswGetNbits(index) / 8;
+	if (quantizer != NULL)
+		etupSize = HNSW_ELEMENT_TUPLE_SIZE(HnswQuantizerCodeSize(quantizer));
+	else if (splitVectors)
+		etupSize = HNSW_SPLIT_ELEMENT_TUPLE_SIZE;
+	else
+		etupSize = HNSW_ELEMENT_TUPLE_SIZE(VARSIZE_ANY(HnswPtrAccess(base, e->value)));
+	if (use_pq)
+		ntupSize = HNSW_NEIGHBOR_PQ_TUPLE_SIZE(e->level, m, HnswGetPqM(index) * HnswGetNbits(index) / 8);
+	else
+		ntupSize = HNSW_NEIGHBOR_TUPLE_SIZE(e->level, m);
 	combinedSize = etupSize + ntupSize + sizeof(ItemIdData);
 	maxSize = HNSW_MAX_SIZE;
 	minCombinedSize = etupSize + HNSW_NEIGHBOR_TUPLE_SIZE(0, m) + sizeof(ItemIdData);
 
 	/* Prepare element tuple */
 	etup = palloc0(etupSize);
-	HnswSetElementTuple(base, etup, e);
+	HnswSetElementTuple(base, etup, e, splitVectors, quantizer, false);
 
 	/* Prepare neighbor tuple */
 	ntup = palloc0(ntupSize);
-	int use_pq = HnswGetUsePQ(index);
-	PQDist* pqdist = (PQDist*)palloc(sizeof(PQDist));
 	HnswSetNeighborTuple(base, ntup, e, m, use_pq, pqdist);
 
+	/* Skip full pages after the insert page */
+	if (!building && combinedSize <= maxSize)
+	{
+		freePage = GetFreeSpacePage(index, combinedSize);
+		if (BlockNumberIsValid(freePage))
+			currentPage = freePage;
+	}
+
 	/* Find a page (or two if needed) to insert the tuples */
 	for (;;)
 	{
@@ -227,6 +439,10 @@ AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, B
 			break;
 		}
 
+		/* Correct outdated space */
+		if (currentPage == freePage)
+			RecordPageWithFreeSpace(index, freePage, HnswGetReusableSpace(page, freePage));
+
 		currentPage = HnswPageGetOpaque(page)->nextblkno;
 
 		if (BlockNumberIsValid(currentPage))
@@ -302,6 +518,24 @@ AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, B
 
 	ItemPointerSet(&etup->neighbortid, e->neighborPage, e->neighborOffno);
 
+	/* Add vector before the element references it */
+	if (splitVectors)
+	{
+		ItemPointerData freeVectorTid;
+
+		ItemPointerSetInvalid(&freeVectorTid);
+		if (OffsetNumberIsValid(freeOffno))
+		{
+			HnswElementTuple freeTup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, freeOffno));
+
+			if (HnswElementTupleIsSplit(freeTup))
+				freeVectorTid = *HnswElementTupleGetVectorTid(freeTup);
+		}
+
+		AddVectorOnDisk(index, e, &freeVectorTid, state, &vbuf, &vnbuf, updatedVectorInsertPage, building);
+		ItemPointerSet(HnswElementTupleGetVectorTid(etup), e->vectorPage, e->vectorOffno);
+	}
+
 	/* Add element and neighbors */
 	if (OffsetNumberIsValid(freeOffno))
 	{
@@ -320,6 +554,10 @@ AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, B
 			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
 	}
 
+	/* Space left on a page from the free space map */
+	if (e->blkno == freePage)
+		freeSpace = HnswGetReusableSpace(page, freePage);
+
 	/* Commit */
 	if (building)
 	{
@@ -332,9 +570,17 @@ AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, B
 	UnlockReleaseBuffer(buf);
 	if (nbuf != buf)
 		UnlockReleaseBuffer(nbuf);
+	if (BufferIsValid(vbuf))
+		UnlockReleaseBuffer(vbuf);
+	if (BufferIsValid(vnbuf))
+		UnlockReleaseBuffer(vnbuf);
+
+	if (e->blkno == freePage)
+		RecordPageWithFreeSpace(index, freePage, freeSpace);
 
 	/* Update the insert page */
-	if (BlockNumberIsValid(newInsertPage) && newInsertPage != insertPage)
+	/* Pages from the free space map can be after pages with space */
+	if (!BlockNumberIsValid(freePage) && BlockNumberIsValid(newInsertPage) && newInsertPage != insertPage)
 		*updatedInsertPage = newInsertPage;
 }
 
@@ -378,36 +624,51 @@ HnswUpdateNeighborsOnDisk(Relation index, FmgrInfo *procinfo, Oid collation, Hns
 			Page		page;
 			GenericXLogState *state;
 			HnswNeighborTuple ntup;
-			int			idx = -1;
+			int			idx;
 			int			startIdx;
 			HnswElement neighborElement = HnswPtrAccess(base, hc->element);
 			OffsetNumber offno = neighborElement->neighborOffno;
 
 			/*
 			 * Get latest neighbors since they may have changed. Do not lock
-			 * yet since selecting neighbors can take time. Could use
-			 * optimistic locking to retry if another update occurs before
-			 * getting exclusive lock.
+			 * yet since selecting neighbors can take time. Instead, remember
+			 * the page LSN and select again if another update occurs before
+			 * getting exclusive lock. Unlogged indexes do not advance the
+			 * LSN, so they always use the first selection.
 			 */
-			HnswLoadNeighbors(neighborElement, index, m);
+			for (int retries = 0;; retries++)
+			{
+				XLogRecPtr	lsn = HnswLoadNeighbors(neighborElement, index, m);
 
-			/*
-			 * Could improve performance for vacuuming by checking neighbors
-			 * against list of elements being deleted to find index. It's
-			 * important to exclude already deleted elements for this since
-			 * they can be replaced at any time.
-			 */
+				/*
+				 * Could improve performance for vacuuming by checking
+				 * neighbors against list of elements being deleted to find
+				 * index. It's important to exclude already deleted elements
+				 * for this since they can be replaced at any time.
+				 */
+
+				/* Select neighbors */
+				idx = -1;
+				HnswUpdateConnection(NULL, e, hc, lm, lc, &idx, index, procinfo, collation);
 
-			/* Select neighbors */
-			HnswUpdateConnection(NULL, e, hc, lm, lc, &idx, index, procinfo, collation);
+				/* New element was not selected as a neighbor */
+				if (idx == -1)
+					break;
+
+				buf = ReadBuffer(index, neighborElement->neighborPage);
+				LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+
+				/* Page was not updated since neighbors were loaded */
+				if (building || PageGetLSN(BufferGetPage(buf)) == lsn || retries >= HNSW_MAX_UPDATE_RETRIES)
+					break;
+
+				UnlockReleaseBuffer(buf);
+			}
 
-			/* New element was not selected as a neighbor */
 			if (idx == -1)
 				continue;
 
 			/* Register page */
-			buf = ReadBuffer(index, neighborElement->neighborPage);
-			LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
 			if (building)
 			{
 				state = NULL;
@@ -531,6 +792,14 @@ FindDuplicateOnDisk(Relation index, HnswElement element, bool building)
 	char	   *base = NULL;
 	HnswNeighborArray *neighbors = HnswGetNeighbors(base, element, 0);
 	Datum		value = HnswGetValue(base, element);
+	HnswQuantizer quantizer = HnswGetQuantizerParams(index);
+
+	/*
+	 * Distinct values can share codes, and re-ranking computes the distance
+	 * of an element from a single heap TID, so do not merge them
+	 */
+	if (quantizer != NULL)
+		return false;
 
 	for (int i = 0; i < neighbors->length; i++)
 	{
@@ -556,18 +825,23 @@ static void
 UpdateGraphOnDisk(Relation index, FmgrInfo *procinfo, Oid collation, HnswElement element, int m, int efConstruction, HnswElement entryPoint, bool building)
 {
 	BlockNumber newInsertPage = InvalidBlockNumber;
+	BlockNumber newVectorInsertPage = InvalidBlockNumber;
 
 	/* Look for duplicate */
 	if (FindDuplicateOnDisk(index, element, building))
 		return;
 
 	/* Add element */
-	AddElementOnDisk(index, element, m, GetInsertPage(index), &newInsertPage, building);
+	AddElementOnDisk(index, element, m, GetInsertPage(index), &newInsertPage, &newVectorInsertPage, building);
 
 	/* Update insert page if needed */
 	if (BlockNumberIsValid(newInsertPage))
 		HnswUpdateMetaPage(index, 0, NULL, newInsertPage, MAIN_FORKNUM, building);
 
+	/* Update vector insert page if needed */
+	if (BlockNumberIsValid(newVectorInsertPage))
+		HnswUpdateVectorInsertPage(index, newVectorInsertPage, MAIN_FORKNUM, building);
+
 	/* Update neighbors */
 	HnswUpdateNeighborsOnDisk(index, procinfo, collation, element, m, false, building);
 
@@ -592,6 +866,7 @@ HnswInsertTupleOnDisk(Relation index, Datum value, Datum *values, bool *isnull,
 	FmgrInfo   *procinfo = index_getprocinfo(index, 1, HNSW_DISTANCE_PROC);
 	Oid			collation = index->rd_indcollation[0];
 	LOCKMODE	lockmode = ShareLock;
+	bool		entryLocked = false;
 	char	   *base = NULL;
 
 	/*
@@ -608,62 +883,294 @@ HnswInsertTupleOnDisk(Relation index, Datum value, Datum *values, bool *isnull,
 	element = HnswInitElement(base, heap_tid, m, HnswGetMl(m), HnswGetMaxLevel(m), use_pq, NULL, pqdist);
 	HnswPtrStore(base, element->value, DatumGetPointer(value));
 
-	/* Prevent concurrent inserts when likely updating entry point */
+	/*
+	 * Serialize inserts that are likely updating entry point. Use a separate
+	 * lock so inserts at lower levels can continue.
+	 */
 	if (entryPoint == NULL || element->level > entryPoint->level)
 	{
-		/* Release shared lock */
-		UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
-
-		/* Get exclusive lock */
-		lockmode = ExclusiveLock;
-		LockPage(index, HNSW_UPDATE_LOCK, lockmode);
+		LockPage(index, HNSW_ENTRY_LOCK, ExclusiveLock);
+		entryLocked = true;
 
 		/* Get latest entry point after lock is acquired */
 		entryPoint = HnswGetEntryPoint(index);
 	}
 
 	/* Find neighbors for element */
-	HnswFindElementNeighbors(base, element, entryPoint, index, procinfo, collation, m, efConstruction, false, use_pq, pqdist);
+	HnswFindElementNeighbors(base, element, entryPoint, index, procinfo, collation, m, efConstruction, use_pq, pqdist, false);
 
 	/* Update graph on disk */
 	UpdateGraphOnDisk(index, procinfo, collation, element, m, efConstruction, entryPoint, building);
 
-	/* Release lock */
+	/* Release locks */
+	if (entryLocked)
+		UnlockPage(index, HNSW_ENTRY_LOCK, ExclusiveLock);
 	UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
 
 	return true;
 }
 
 /*
- * Insert a tuple into the index
+ * Detoast, check, and normalize a value to insert
  */
-static void
-HnswInsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid)
+static bool
+GetInsertValue(Relation index, Datum *values, Datum *value)
 {
-	Datum		value;
 	const		HnswTypeInfo *typeInfo = HnswGetTypeInfo(index);
 	FmgrInfo   *normprocinfo;
 	Oid			collation = index->rd_indcollation[0];
 
 	/* Detoast once for all calls */
-	value = PointerGetDatum(PG_DETOAST_DATUM(values[0]));
+	*value = PointerGetDatum(PG_DETOAST_DATUM(values[0]));
 
 	/* Check value */
 	if (typeInfo->checkValue != NULL)
-		typeInfo->checkValue(DatumGetPointer(value));
+		typeInfo->checkValue(DatumGetPointer(*value));
 
 	/* Normalize if needed */
 	normprocinfo = HnswOptionalProcInfo(index, HNSW_NORM_PROC);
 	if (normprocinfo != NULL)
 	{
-		if (!HnswCheckNorm(normprocinfo, collation, value))
-			return;
+		if (!HnswCheckNorm(normprocinfo, collation, *value))
+			return false;
+
+		*value = HnswNormValue(typeInfo, collation, *value);
+	}
+
+	return true;
+}
+
+/*
+ * Insert a tuple into the index
+ */
+static void
+HnswInsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid)
+{
+	Datum		value;
+
+	if (GetInsertValue(index, values, &value))
+		HnswInsertTupleOnDisk(index, value, values, isnull, heap_tid, false);
+}
+
+#if PG_VERSION_NUM >= 170000
+/*
+ * Inserts buffered for a statement
+ *
+ * Elements are added to the graph when the batch is full or the statement
+ * ends (see hnswinsertcleanup())
+ */
+typedef struct HnswInsertBatchData
+{
+	MemoryContext ctx;
+	List	   *elements;
+}			HnswInsertBatchData;
+
+typedef HnswInsertBatchData * HnswInsertBatch;
+
+/*
+ * Add a tuple to the batch for the statement
+ */
+static HnswInsertBatch
+AddToInsertBatch(Relation index, Datum *values, ItemPointer heap_tid, IndexInfo *indexInfo)
+{
+	HnswInsertBatch batch = (HnswInsertBatch) indexInfo->ii_AmCache;
+	Datum		value;
+
+	if (batch == NULL)
+	{
+		/* Initialize the lock tranche if needed */
+		HnswInitLockTranche();
+
+		batch = MemoryContextAllocZero(indexInfo->ii_Context, sizeof(HnswInsertBatchData));
+		batch->ctx = AllocSetContextCreate(indexInfo->ii_Context,
+										   "Hnsw insert batch context",
+										   ALLOCSET_DEFAULT_SIZES);
+		indexInfo->ii_AmCache = batch;
+	}
+
+	if (GetInsertValue(index, values, &value))
+	{
+		MemoryContext oldCtx = MemoryContextSwitchTo(batch->ctx);
+		int			m = HnswGetM(index);
+		HnswElement element;
+
+		element = HnswInitElement(NULL, heap_tid, m, HnswGetMl(m), HnswGetMaxLevel(m), 0, NULL, NULL);
+		element->blkno = InvalidBlockNumber;
+		element->offno = InvalidOffsetNumber;
+		HnswPtrStore((char *) NULL, element->value, DatumGetPointer(datumCopy(value, false, -1)));
+		LWLockInitialize(&element->lock, hnsw_lock_tranche_id);
+
+		batch->elements = lappend(batch->elements, element);
+
+		MemoryContextSwitchTo(oldCtx);
+	}
+
+	return batch;
+}
+
+/*
+ * Update neighbors in the graph of a batch
+ */
+static void
+UpdateBatchNeighbors(HnswElement e, int m, FmgrInfo *procinfo, Oid collation)
+{
+	char	   *base = NULL;
+
+	for (int lc = e->level; lc >= 0; lc--)
+	{
+		int			lm = HnswGetLayerM(m, lc);
+		HnswNeighborArray *neighbors = HnswGetNeighbors(base, e, lc);
+
+		for (int i = 0; i < neighbors->length; i++)
+			HnswUpdateConnection(base, e, &neighbors->items[i], lm, lc, NULL, NULL, procinfo, collation);
+	}
+}
+
+/*
+ * Add an element of a batch to the graph on disk
+ *
+ * The search on disk starts from the neighbors of the element in the batch
+ * that were already added, in addition to the entry point
+ */
+static void
+AddBatchElementOnDisk(Relation index, HnswElement element, HnswElement entryPoint, FmgrInfo *procinfo, Oid collation, int m, int efConstruction)
+{
+	char	   *base = NULL;
+	HnswElement e = HnswInitElementFromBlock(InvalidBlockNumber, InvalidOffsetNumber);
+	Datum		q = HnswGetValue(base, element);
+
+	/* Copy element without its neighbors in memory */
+	e->level = element->level;
+	e->deleted = 0;
+	e->heaptidsLength = 0;
+	for (int i = 0; i < element->heaptidsLength; i++)
+		HnswAddHeapTid(e, &element->heaptids[i]);
+	HnswPtrStore(base, e->value, DatumGetPointer(q));
+	HnswInitNeighbors(base, e, m, NULL);
+
+	if (entryPoint != NULL)
+	{
+		HnswElement ep = HnswInitElementFromBlock(entryPoint->blkno, entryPoint->offno);
+		List	  **seeds = palloc(sizeof(List *) * (e->level + 1));
+
+		for (int lc = e->level; lc >= 0; lc--)
+		{
+			HnswNeighborArray *neighbors = HnswGetNeighbors(base, element, lc);
+
+			seeds[lc] = NIL;
+			for (int i = 0; i < neighbors->length; i++)
+			{
+				HnswElement neighborElement = HnswPtrAccess(base, neighbors->items[i].element);
+				HnswElement seed;
+
+				/* Not added yet or a duplicate */
+				if (!BlockNumberIsValid(neighborElement->blkno))
+					continue;
+
+				seed = HnswInitElementFromBlock(neighborElement->blkno, neighborElement->offno);
+				seeds[lc] = lappend(seeds[lc], HnswEntryCandidate(base, seed, q, index, procinfo, collation, true, 0, NULL));
+			}
+		}
+
+		HnswMergeElementNeighbors(e, ep, seeds, index, procinfo, collation, m, efConstruction);
+	}
+
+	/* Update graph on disk */
+	UpdateGraphOnDisk(index, procinfo, collation, e, m, efConstruction, entryPoint, false);
+
+	/* Location is still invalid for duplicates */
+	element->blkno = e->blkno;
+	element->offno = e->offno;
+}
+
+/*
+ * Add a batch of inserts to the graph
+ *
+ * A graph of the batch is built in memory first, and elements are then added
+ * to the graph on disk in one pass, seeded with their neighbors in the batch
+ */
+static void
+FlushInsertBatch(Relation index, HnswInsertBatch batch)
+{
+	FmgrInfo   *procinfo = index_getprocinfo(index, 1, HNSW_DISTANCE_PROC);
+	Oid			collation = index->rd_indcollation[0];
+	int			efConstruction = HnswGetEfConstruction(index);
+	int			m = HnswGetM(index);
+	HnswElement graphEntryPoint = NULL;
+	LOCKMODE	lockmode = ShareLock;
+	MemoryContext elementCtx;
+	MemoryContext oldCtx;
+	ListCell   *lc2;
+
+	if (batch->elements == NIL)
+		return;
+
+	elementCtx = AllocSetContextCreate(CurrentMemoryContext,
+									   "Hnsw insert batch temporary context",
+									   ALLOCSET_DEFAULT_SIZES);
+
+	/* Build the graph of the batch in memory */
+	foreach(lc2, batch->elements)
+	{
+		HnswElement element = lfirst(lc2);
+
+		oldCtx = MemoryContextSwitchTo(elementCtx);
+		HnswFindElementNeighbors(NULL, element, graphEntryPoint, NULL, procinfo, collation, m, efConstruction, 0, NULL, false);
+		UpdateBatchNeighbors(element, m, procinfo, collation);
+		MemoryContextSwitchTo(oldCtx);
+		MemoryContextReset(elementCtx);
 
-		value = HnswNormValue(typeInfo, collation, value);
+		if (graphEntryPoint == NULL || element->level > graphEntryPoint->level)
+			graphEntryPoint = element;
 	}
 
-	HnswInsertTupleOnDisk(index, value, values, isnull, heap_tid, false);
+	foreach(lc2, batch->elements)
+	{
+		HnswElement element = lfirst(lc2);
+		HnswElement entryPoint;
+		bool		entryLocked = false;
+
+		/* Can take a while, so ensure we can interrupt */
+		CHECK_FOR_INTERRUPTS();
+
+		/*
+		 * Get a shared lock for each element, like single inserts. This
+		 * allows vacuum to ensure no in-flight inserts before repairing
+		 * graph.
+		 */
+		LockPage(index, HNSW_UPDATE_LOCK, lockmode);
+
+		/* Get m and entry point */
+		HnswGetMetaPageInfo(index, &m, &entryPoint);
+
+		/* Serialize inserts that are likely updating entry point */
+		if (entryPoint == NULL || element->level > entryPoint->level)
+		{
+			LockPage(index, HNSW_ENTRY_LOCK, ExclusiveLock);
+			entryLocked = true;
+
+			/* Get latest entry point after lock is acquired */
+			entryPoint = HnswGetEntryPoint(index);
+		}
+
+		oldCtx = MemoryContextSwitchTo(elementCtx);
+		AddBatchElementOnDisk(index, element, entryPoint, procinfo, collation, m, efConstruction);
+		MemoryContextSwitchTo(oldCtx);
+		MemoryContextReset(elementCtx);
+
+		/* Release locks */
+		if (entryLocked)
+			UnlockPage(index, HNSW_ENTRY_LOCK, ExclusiveLock);
+		UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
+	}
+
+	MemoryContextDelete(elementCtx);
+
+	/* Reuse memory for the next batch */
+	MemoryContextReset(batch->ctx);
+	batch->elements = NIL;
 }
+#endif
 
 /*
  * Insert a tuple into the index
@@ -690,8 +1197,18 @@ hnswinsert(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid,
 									  ALLOCSET_DEFAULT_SIZES);
 	oldCtx = MemoryContextSwitchTo(insertCtx);
 
-	/* Insert tuple */
-	HnswInsertTuple(index, values, isnull, heap_tid);
+#if PG_VERSION_NUM >= 170000
+	/* Add tuples in batches when enabled */
+	if (hnsw_insert_batch_size > 0 && !HnswGetUsePQ(index))
+	{
+		HnswInsertBatch batch = AddToInsertBatch(index, values, heap_tid, indexInfo);
+
+		if (list_length(batch->elements) >= hnsw_insert_batch_size)
+			FlushInsertBatch(index, batch);
+	}
+	else
+#endif
+		HnswInsertTuple(index, values, isnull, heap_tid);
 
 	/* Delete memory context */
 	MemoryContextSwitchTo(oldCtx);
@@ -699,3 +1216,35 @@ hnswinsert(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid,
 
 	return false;
 }
+
+#if PG_VERSION_NUM >= 170000
+/*
+ * Add remaining tuples in the batch at the end of the statement
+ */
+void
+hnswinsertcleanup(Relation index, IndexInfo *indexInfo)
+{
+	HnswInsertBatch batch = (HnswInsertBatch) indexInfo->ii_AmCache;
+	MemoryContext oldCtx;
+	MemoryContext insertCtx;
+
+	if (batch == NULL)
+		return;
+
+	/* Create memory context */
+	insertCtx = AllocSetContextCreate(CurrentMemoryContext,
+									  "Hnsw insert temporary context",
+									  ALLOCSET_DEFAULT_SIZES);
+	oldCtx = MemoryContextSwitchTo(insertCtx);
+
+	FlushInsertBatch(index, batch);
+
+	/* Delete memory context */
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextDelete(insertCtx);
+
+	MemoryContextDelete(batch->ctx);
+	pfree(batch);
+	indexInfo->ii_AmCache = NULL;
+}
+#endif
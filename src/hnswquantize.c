@@ -0,0 +1,522 @@
+#include "postgres.h"
+
+#include <float.h>
+#include <math.h>
+
+#include "bitutils.h"
+#include "fmgr.h"
+#include "halfvec.h"			/* for USE_TARGET_CLONES */
+#include "hnsw.h"
+#include "storage/bufmgr.h"
+#include "utils/rel.h"
+#include "vector.h"
+
+#if defined(USE_TARGET_CLONES) && !defined(__FMA__)
+#define HNSW_TARGET_CLONES __attribute__((target_clones("default", "fma")))
+#else
+#define HNSW_TARGET_CLONES
+#endif
+
+PGDLLEXPORT Datum vector_l2_squared_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum vector_negative_inner_product(PG_FUNCTION_ARGS);
+
+/*
+ * Parse the quantizer option
+ */
+int
+HnswParseQuantizer(const char *value)
+{
+	if (value == NULL || strcmp(value, "none") == 0)
+		return HNSW_QUANTIZER_NONE;
+
+	if (strcmp(value, "sq8") == 0)
+		return HNSW_QUANTIZER_SQ8;
+
+	if (strcmp(value, "sq4") == 0)
+		return HNSW_QUANTIZER_SQ4;
+
+	if (strcmp(value, "bit") == 0)
+		return HNSW_QUANTIZER_BIT;
+
+	ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("invalid value for quantizer option: \"%s\"", value),
+			 errdetail("Valid values are \"none\", \"sq8\", \"sq4\", and \"bit\".")));
+
+	return HNSW_QUANTIZER_NONE;
+}
+
+/*
+ * Get the max dimensions for a quantizer
+ *
+ * Element tuples only store codes, so larger vectors fit on a page
+ */
+int
+HnswQuantizerMaxDimensions(int type)
+{
+	switch (type)
+	{
+		case HNSW_QUANTIZER_SQ8:
+			return HNSW_MAX_SQ8_DIM;
+		case HNSW_QUANTIZER_SQ4:
+			return HNSW_MAX_SQ4_DIM;
+		case HNSW_QUANTIZER_BIT:
+			return HNSW_MAX_BIT_DIM;
+		default:
+			return HNSW_MAX_DIM;
+	}
+}
+
+/*
+ * Get the max code for a quantizer
+ */
+static inline int
+HnswQuantizerLevels(HnswQuantizer quantizer)
+{
+	return quantizer->type == HNSW_QUANTIZER_SQ4 ? 15 : 255;
+}
+
+/*
+ * Allocate a quantizer
+ *
+ * Params are stored in a single chunk (min followed by scale) so they can be
+ * written to and read from pages as is. Binary quantization uses the sign of
+ * each dimension, so it has no params.
+ */
+static HnswQuantizer
+HnswAllocQuantizer(MemoryContext ctx, int type, int dimensions)
+{
+	Size		headerSize = MAXALIGN(sizeof(HnswQuantizerData));
+	int			nparams = 0;
+	Size		codeSize = 0;
+	HnswQuantizer quantizer;
+
+	if (type == HNSW_QUANTIZER_NONE)
+		dimensions = 0;
+	else if (type == HNSW_QUANTIZER_BIT)
+		codeSize = (dimensions + 7) / 8;
+	else
+		nparams = 2 * dimensions;
+
+	quantizer = MemoryContextAllocZero(ctx, headerSize + nparams * sizeof(float) + codeSize);
+	quantizer->type = type;
+	quantizer->dimensions = dimensions;
+	quantizer->samples = 0;
+	quantizer->nparams = nparams;
+	quantizer->min = (float *) ((char *) quantizer + headerSize);
+	quantizer->scale = quantizer->min + nparams / 2;
+	quantizer->query = NULL;
+	quantizer->queryCodes = (uint8 *) (quantizer->min + nparams);
+	return quantizer;
+}
+
+/*
+ * Initialize a quantizer for training
+ */
+HnswQuantizer
+HnswInitQuantizer(int type, int dimensions)
+{
+	HnswQuantizer quantizer = HnswAllocQuantizer(CurrentMemoryContext, type, dimensions);
+
+	/* Scale holds the max until finished */
+	for (int i = 0; i < quantizer->nparams / 2; i++)
+	{
+		quantizer->min[i] = FLT_MAX;
+		quantizer->scale[i] = -FLT_MAX;
+	}
+
+	return quantizer;
+}
+
+/*
+ * Add a sample to the quantizer
+ */
+void
+HnswQuantizerAddSample(HnswQuantizer quantizer, Datum value)
+{
+	Vector	   *vec = (Vector *) DatumGetPointer(value);
+
+	Assert(vec->dim == quantizer->dimensions);
+
+	for (int i = 0; i < quantizer->dimensions; i++)
+	{
+		if (vec->x[i] < quantizer->min[i])
+			quantizer->min[i] = vec->x[i];
+
+		if (vec->x[i] > quantizer->scale[i])
+			quantizer->scale[i] = vec->x[i];
+	}
+
+	quantizer->samples++;
+}
+
+/*
+ * Calculate the scale for each dimension
+ */
+void
+HnswQuantizerFinish(HnswQuantizer quantizer)
+{
+	int			levels = HnswQuantizerLevels(quantizer);
+
+	for (int i = 0; i < quantizer->dimensions; i++)
+	{
+		/* Use a reasonable range for embeddings if there are no samples */
+		if (quantizer->samples == 0)
+		{
+			quantizer->min[i] = -1;
+			quantizer->scale[i] = 1;
+		}
+
+		quantizer->scale[i] = (quantizer->scale[i] - quantizer->min[i]) / levels;
+	}
+}
+
+/*
+ * Get the size of the codes for a vector
+ */
+Size
+HnswQuantizerCodeSize(HnswQuantizer quantizer)
+{
+	if (quantizer->type == HNSW_QUANTIZER_BIT)
+		return (quantizer->dimensions + 7) / 8;
+
+	if (quantizer->type == HNSW_QUANTIZER_SQ4)
+		return (quantizer->dimensions + 1) / 2;
+
+	return quantizer->dimensions;
+}
+
+/*
+ * Encode a vector
+ */
+void
+HnswQuantizerEncode(HnswQuantizer quantizer, Datum value, uint8 *codes)
+{
+	Vector	   *vec = (Vector *) DatumGetPointer(value);
+	int			levels = HnswQuantizerLevels(quantizer);
+
+	MemSet(codes, 0, HnswQuantizerCodeSize(quantizer));
+
+	/* Same as binary_quantize */
+	if (quantizer->type == HNSW_QUANTIZER_BIT)
+	{
+		for (int i = 0; i < quantizer->dimensions; i++)
+			codes[i / 8] |= (vec->x[i] > 0) << (7 - (i % 8));
+
+		return;
+	}
+
+	for (int i = 0; i < quantizer->dimensions; i++)
+	{
+		int			code = 0;
+
+		if (quantizer->scale[i] > 0)
+		{
+			float		c = rintf((vec->x[i] - quantizer->min[i]) / quantizer->scale[i]);
+
+			/* Values outside the sample range are clamped */
+			if (c > levels)
+				code = levels;
+			else if (c > 0)
+				code = (int) c;
+		}
+
+		if (quantizer->type == HNSW_QUANTIZER_SQ4)
+			codes[i >> 1] |= code << ((i & 1) << 2);
+		else
+			codes[i] = code;
+	}
+}
+
+/*
+ * Get the code for a dimension
+ */
+static inline int
+HnswQuantizerCode(HnswQuantizer quantizer, uint8 *codes, int i)
+{
+	if (quantizer->type == HNSW_QUANTIZER_SQ4)
+		return (codes[i >> 1] >> ((i & 1) << 2)) & 0x0F;
+
+	return codes[i];
+}
+
+/*
+ * Decode a vector
+ */
+Datum
+HnswQuantizerDecode(HnswQuantizer quantizer, uint8 *codes)
+{
+	Vector	   *result = InitVector(quantizer->dimensions);
+
+	/* Signs encode back to the same codes */
+	if (quantizer->type == HNSW_QUANTIZER_BIT)
+	{
+		for (int i = 0; i < quantizer->dimensions; i++)
+			result->x[i] = (codes[i / 8] >> (7 - (i % 8))) & 1 ? 1 : -1;
+
+		return PointerGetDatum(result);
+	}
+
+	for (int i = 0; i < quantizer->dimensions; i++)
+		result->x[i] = quantizer->min[i] + HnswQuantizerCode(quantizer, codes, i) * quantizer->scale[i];
+
+	return PointerGetDatum(result);
+}
+
+HNSW_TARGET_CLONES static float
+Sq8L2SquaredDistance(int dim, float *qx, float *min, float *scale, uint8 *codes)
+{
+	float		distance = 0.0;
+
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+	{
+		float		diff = qx[i] - (min[i] + codes[i] * scale[i]);
+
+		distance += diff * diff;
+	}
+
+	return distance;
+}
+
+HNSW_TARGET_CLONES static float
+Sq8InnerProduct(int dim, float *qx, float *min, float *scale, uint8 *codes)
+{
+	float		distance = 0.0;
+
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+		distance += qx[i] * (min[i] + codes[i] * scale[i]);
+
+	return distance;
+}
+
+/*
+ * Set the query for binary quantization
+ *
+ * Codes for the query are kept so each distance only needs a popcount
+ */
+void
+HnswQuantizerSetQuery(HnswQuantizer quantizer, Datum q)
+{
+	if (quantizer->type != HNSW_QUANTIZER_BIT || DatumGetPointer(q) == NULL)
+		return;
+
+	HnswQuantizerEncode(quantizer, q, quantizer->queryCodes);
+	quantizer->query = DatumGetPointer(q);
+}
+
+/*
+ * Get the distance between a query and encoded vector
+ *
+ * L2 and inner product are calculated directly on the codes for SQ8, while
+ * other cases decode the vector and use the support function. Binary
+ * quantization uses the Hamming distance for all distance functions.
+ */
+float
+HnswQuantizerDistance(HnswQuantizer quantizer, FmgrInfo *procinfo, Oid collation, Datum q, uint8 *codes)
+{
+	Vector	   *query = (Vector *) DatumGetPointer(q);
+
+	if (quantizer->type == HNSW_QUANTIZER_BIT)
+	{
+		if (quantizer->query != DatumGetPointer(q))
+			HnswQuantizerSetQuery(quantizer, q);
+
+		return (float) BitHammingDistance(HnswQuantizerCodeSize(quantizer), quantizer->queryCodes, codes, 0);
+	}
+
+	if (quantizer->type == HNSW_QUANTIZER_SQ8 && query->dim == quantizer->dimensions)
+	{
+		if (procinfo->fn_addr == vector_l2_squared_distance)
+			return Sq8L2SquaredDistance(query->dim, query->x, quantizer->min, quantizer->scale, codes);
+
+		if (procinfo->fn_addr == vector_negative_inner_product)
+			return -Sq8InnerProduct(query->dim, query->x, quantizer->min, quantizer->scale, codes);
+	}
+
+	return (float) DatumGetFloat8(FunctionCall2Coll(procinfo, collation, q, HnswQuantizerDecode(quantizer, codes)));
+}
+
+/*
+ * Get the distance between a query and a value as stored
+ */
+float
+HnswQuantizerValueDistance(HnswQuantizer quantizer, FmgrInfo *procinfo, Oid collation, Datum q, Datum value)
+{
+	uint8	   *codes = palloc(HnswQuantizerCodeSize(quantizer));
+	float		distance;
+
+	HnswQuantizerEncode(quantizer, value, codes);
+	distance = HnswQuantizerDistance(quantizer, procinfo, collation, q, codes);
+	pfree(codes);
+
+	return distance;
+}
+
+/*
+ * Encode a value as a varlena to store in the graph
+ */
+Datum
+HnswQuantizerEncodeValue(HnswQuantizer quantizer, Datum value)
+{
+	Size		size = HnswQuantizerCodeSize(quantizer);
+	bytea	   *result = palloc(VARHDRSZ + size);
+
+	SET_VARSIZE(result, VARHDRSZ + size);
+	HnswQuantizerEncode(quantizer, value, (uint8 *) VARDATA(result));
+	return PointerGetDatum(result);
+}
+
+typedef struct HnswCodesDistanceState
+{
+	HnswQuantizer quantizer;
+	FmgrInfo   *procinfo;
+}			HnswCodesDistanceState;
+
+HNSW_TARGET_CLONES static float
+Sq8CodesL2SquaredDistance(int dim, float *scale, uint8 *a, uint8 *b)
+{
+	float		distance = 0.0;
+
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+	{
+		float		diff = ((int) a[i] - (int) b[i]) * scale[i];
+
+		distance += diff * diff;
+	}
+
+	return distance;
+}
+
+HNSW_TARGET_CLONES static float
+Sq8CodesInnerProduct(int dim, float *min, float *scale, uint8 *a, uint8 *b)
+{
+	float		distance = 0.0;
+
+	/* Auto-vectorized */
+	for (int i = 0; i < dim; i++)
+		distance += (min[i] + a[i] * scale[i]) * (min[i] + b[i] * scale[i]);
+
+	return distance;
+}
+
+/*
+ * Get the distance between two encoded values
+ *
+ * Matches the support function on the decoded vectors
+ */
+static Datum
+HnswQuantizerCodesDistance(PG_FUNCTION_ARGS)
+{
+	HnswCodesDistanceState *state = (HnswCodesDistanceState *) fcinfo->flinfo->fn_extra;
+	HnswQuantizer quantizer = state->quantizer;
+	uint8	   *a = (uint8 *) VARDATA(PG_GETARG_POINTER(0));
+	uint8	   *b = (uint8 *) VARDATA(PG_GETARG_POINTER(1));
+
+	if (quantizer->type == HNSW_QUANTIZER_SQ8)
+	{
+		if (state->procinfo->fn_addr == vector_l2_squared_distance)
+			PG_RETURN_FLOAT8((double) Sq8CodesL2SquaredDistance(quantizer->dimensions, quantizer->scale, a, b));
+
+		if (state->procinfo->fn_addr == vector_negative_inner_product)
+			PG_RETURN_FLOAT8((double) -Sq8CodesInnerProduct(quantizer->dimensions, quantizer->min, quantizer->scale, a, b));
+	}
+
+	PG_RETURN_DATUM(FunctionCall2Coll(state->procinfo, PG_GET_COLLATION(), HnswQuantizerDecode(quantizer, a), HnswQuantizerDecode(quantizer, b)));
+}
+
+/*
+ * Get a support function for values encoded with HnswQuantizerEncodeValue
+ *
+ * Lets graph code compare encoded values like any other value
+ */
+FmgrInfo *
+HnswQuantizerCodesProcInfo(HnswQuantizer quantizer, FmgrInfo *procinfo)
+{
+	FmgrInfo   *codesprocinfo = palloc0(sizeof(FmgrInfo));
+	HnswCodesDistanceState *state = palloc(sizeof(HnswCodesDistanceState));
+
+	state->quantizer = quantizer;
+	state->procinfo = procinfo;
+
+	codesprocinfo->fn_addr = HnswQuantizerCodesDistance;
+	codesprocinfo->fn_oid = InvalidOid;
+	codesprocinfo->fn_nargs = 2;
+	codesprocinfo->fn_strict = true;
+	codesprocinfo->fn_retset = false;
+	codesprocinfo->fn_extra = state;
+	codesprocinfo->fn_mcxt = CurrentMemoryContext;
+	codesprocinfo->fn_expr = NULL;
+	return codesprocinfo;
+}
+
+/*
+ * Get the quantizer for an index, or NULL if not quantized
+ *
+ * Params are cached in rd_amcache, since they only change when the index is
+ * rebuilt
+ */
+HnswQuantizer
+HnswGetQuantizerParams(Relation index)
+{
+	HnswQuantizer quantizer = (HnswQuantizer) index->rd_amcache;
+
+	if (quantizer == NULL)
+	{
+		Buffer		buf;
+		Page		page;
+		HnswMetaPage metap;
+		BlockNumber blkno;
+		float	   *params;
+		int			nparams;
+
+		buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		metap = HnswPageGetMeta(page);
+
+		if (unlikely(metap->magicNumber != HNSW_MAGIC_NUMBER))
+			elog(ERROR, "hnsw index is not valid");
+
+		/* Zero for indexes created without quantizer pages */
+		blkno = metap->quantizerPage;
+		if (blkno == HNSW_METAPAGE_BLKNO)
+			blkno = InvalidBlockNumber;
+
+		quantizer = HnswAllocQuantizer(index->rd_indexcxt, metap->quantizer, metap->dimensions);
+
+		UnlockReleaseBuffer(buf);
+
+		params = quantizer->min;
+		nparams = quantizer->nparams;
+
+		/* Should not happen */
+		if (nparams > 0 && !BlockNumberIsValid(blkno))
+			elog(ERROR, "hnsw quantizer pages not found");
+
+		while (nparams > 0)
+		{
+			int			count = Min(nparams, HNSW_QUANTIZER_PAGE_FLOATS);
+
+			buf = ReadBuffer(index, blkno);
+			LockBuffer(buf, BUFFER_LOCK_SHARE);
+			page = BufferGetPage(buf);
+
+			memcpy(params, PageGetContents(page), count * sizeof(float));
+			params += count;
+			nparams -= count;
+
+			blkno = HnswPageGetOpaque(page)->nextblkno;
+			UnlockReleaseBuffer(buf);
+		}
+
+		index->rd_amcache = quantizer;
+	}
+
+	if (quantizer->type == HNSW_QUANTIZER_NONE)
+		return NULL;
+
+	return quantizer;
+}
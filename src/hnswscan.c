@@ -1,6 +1,9 @@
 #include "postgres.h"
 
+#include "access/itup.h"
 #include "access/relscan.h"
+#include "access/tableam.h"
+#include "executor/tuptable.h"
 #include "hnsw.h"
 #include "pgstat.h"
 #include "storage/bufmgr.h"
@@ -33,14 +36,14 @@ GetScanItems(IndexScanDesc scan, Datum q)
 		return NIL;
 
 	int use_pq = HnswGetUsePQ(index);
-	PQDist* pqdist;
+	PQDist* pqdist = NULL;
 	if (use_pq)
 	{
 		pqdist = HnswGetPQDist(index);
 		load_query_data_and_cache(pqdist, query);
 	}
 	int pq_m = HnswGetPqM(index);
-	ep = list_make1(HnswEntryCandidate(base, entryPoint, q, index, procinfo, collation, false, 0, NULL));
+	ep = list_make1(HnswEntryCandidate(base, entryPoint, q, index, procinfo, collation, false, use_pq, pqdist));
 
 	for (int lc = entryPoint->level; lc >= 1; lc--)
 	{
@@ -50,6 +53,119 @@ GetScanItems(IndexScanDesc scan, Datum q)
 	return HnswSearchLayer(base, q, ep, hnsw_ef_search, 0, index, procinfo, collation, m, false, NULL, use_pq, pqdist, true);
 }
 
+/*
+ * Compare candidate distances
+ */
+static int
+#if PG_VERSION_NUM >= 130000
+CompareRerankedCandidates(const ListCell *a, const ListCell *b)
+{
+	HnswCandidate *hca = lfirst(a);
+	HnswCandidate *hcb = lfirst(b);
+#else
+CompareRerankedCandidates(const void *a, const void *b)
+{
+	HnswCandidate *hca = lfirst(*(ListCell **) a);
+	HnswCandidate *hcb = lfirst(*(ListCell **) b);
+#endif
+
+	if (hca->distance < hcb->distance)
+		return 1;
+
+	if (hca->distance > hcb->distance)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Re-rank the nearest candidates with exact distances from the heap
+ */
+static List *
+RerankCandidates(IndexScanDesc scan, List *w, Datum q)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+	Relation	heap = scan->heapRelation;
+	AttrNumber	attno = scan->indexRelation->rd_index->indkey.values[0];
+	int			n = list_length(w);
+	int			k = hnsw_rerank_k < 0 ? n : Min(hnsw_rerank_k, n);
+	List	   *reranked = NIL;
+	TupleTableSlot *slot;
+	IndexFetchTableData *fetch;
+
+	/* Heap values are only available for columns */
+	if (heap == NULL || attno == InvalidAttrNumber || DatumGetPointer(q) == NULL || k == 0)
+		return w;
+
+	slot = table_slot_create(heap, NULL);
+	fetch = table_index_fetch_begin(heap);
+
+	/* Nearest candidates are at the end */
+	for (int i = n - k; i < n; i++)
+	{
+		HnswCandidate *hc = list_nth(w, i);
+		HnswElement element = HnswPtrAccess((char *) NULL, hc->element);
+
+		/* Heap TIDs share the same value, so use the first visible one */
+		for (int j = 0; j < element->heaptidsLength; j++)
+		{
+			ItemPointerData tid = element->heaptids[j];
+			bool		call_again = false;
+			bool		all_dead = false;
+			bool		isnull;
+			Datum		value;
+
+			if (!table_index_fetch_tuple(fetch, &tid, scan->xs_snapshot, slot, &call_again, &all_dead))
+				continue;
+
+			value = slot_getattr(slot, attno, &isnull);
+			if (!isnull)
+			{
+				value = PointerGetDatum(PG_DETOAST_DATUM(value));
+
+				if (so->normprocinfo != NULL)
+					value = HnswNormValue(so->typeInfo, so->collation, value);
+
+				hc->distance = DatumGetFloat8(FunctionCall2Coll(so->procinfo, so->collation, q, value));
+			}
+
+			ExecClearTuple(slot);
+			break;
+		}
+
+		reranked = lappend(reranked, hc);
+	}
+
+	table_index_fetch_end(fetch);
+	ExecDropSingleTupleTableSlot(slot);
+
+	list_sort(reranked, CompareRerankedCandidates);
+
+	return list_concat(list_truncate(w, n - k), reranked);
+}
+
+/*
+ * Load values for index-only scans
+ *
+ * Values are loaded while holding the scan lock, since elements can be
+ * replaced by inserts after vacuum
+ */
+static void
+LoadScanValues(IndexScanDesc scan, List *w)
+{
+	char	   *base = NULL;
+	ListCell   *lc;
+
+	foreach(lc, w)
+	{
+		HnswCandidate *hc = lfirst(lc);
+		HnswElement element = HnswPtrAccess(base, hc->element);
+
+		if (HnswPtrIsNull(base, element->value))
+			HnswLoadElementValue(element, scan->indexRelation);
+	}
+}
+
 /*
  * Get scan value
  */
@@ -84,15 +200,9 @@ GetScanValue(IndexScanDesc scan)
 IndexScanDesc
 hnswbeginscan(Relation index, int nkeys, int norderbys)
 {
-	int use_pq = HnswGetUsePQ(index);
-
-	PQDist *pqdist = (PQDist *)palloc(sizeof(PQDist));
-	if (use_pq)
-	{
-		const char *pq_dist_file_name = HnswGetPQDistFileName(index);
-		// PQDist_load(pqdist, pq_dist_file_name);
-		HnswSetPQDist(index, pq_dist_file_name);
-	}
+	/* Load the codebook before taking page locks */
+	if (HnswGetUsePQ(index))
+		HnswGetPQDist(index);
 
 	IndexScanDesc scan;
 	HnswScanOpaque so;
@@ -102,6 +212,7 @@ hnswbeginscan(Relation index, int nkeys, int norderbys)
 	so = (HnswScanOpaque)palloc(sizeof(HnswScanOpaqueData));
 	so->typeInfo = HnswGetTypeInfo(index);
 	so->first = true;
+	so->quantized = HnswGetQuantizerParams(index) != NULL;
 	so->tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
 									   "Hnsw scan temporary context",
 									   ALLOCSET_DEFAULT_SIZES);
@@ -125,6 +236,7 @@ void hnswrescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, i
 
 	so->first = true;
 	MemoryContextReset(so->tmpCtx);
+	scan->xs_itup = NULL;
 
 	if (keys && scan->numberOfKeys > 0)
 		memmove(scan->keyData, keys, scan->numberOfKeys * sizeof(ScanKeyData));
@@ -175,9 +287,17 @@ bool hnswgettuple(IndexScanDesc scan, ScanDirection dir)
 
 		so->w = GetScanItems(scan, value);
 
+		/* Index-only scans return the value from the index */
+		if (scan->xs_want_itup)
+			LoadScanValues(scan, so->w);
+
 		/* Release shared lock */
 		UnlockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
 
+		/* Quantized distances are approximate */
+		if (so->quantized && hnsw_rerank_k != 0)
+			so->w = RerankCandidates(scan, so->w, value);
+
 		so->first = false;
 
 #if defined(HNSW_MEMORY) && PG_VERSION_NUM >= 130000
@@ -201,6 +321,19 @@ bool hnswgettuple(IndexScanDesc scan, ScanDirection dir)
 
 		heaptid = &element->heaptids[--element->heaptidsLength];
 
+		if (scan->xs_want_itup)
+		{
+			Datum		value = HnswGetValue(base, element);
+			bool		isnull = false;
+
+			/* Free the previous tuple, which the executor is done with */
+			if (scan->xs_itup != NULL)
+				pfree(scan->xs_itup);
+
+			scan->xs_itupdesc = RelationGetDescr(scan->indexRelation);
+			scan->xs_itup = index_form_tuple(scan->xs_itupdesc, &value, &isnull);
+		}
+
 		MemoryContextSwitchTo(oldCtx);
 
 		scan->xs_heaptid = *heaptid;
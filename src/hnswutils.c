@@ -159,6 +159,32 @@ int HnswGetNbits(Relation index)
 		return opts->nbits;
 	return HNSW_DEFAULT_NBITS;
 }
+
+/*
+ * Get whether vectors are stored on separate pages
+ */
+bool HnswGetSplitVectors(Relation index)
+{
+	HnswOptions *opts = (HnswOptions *)index->rd_options;
+
+	if (opts)
+		return opts->split_vectors != 0;
+
+	return HNSW_DEFAULT_SPLIT_VECTORS;
+}
+
+/*
+ * Get the quantizer
+ */
+int HnswGetQuantizer(Relation index)
+{
+	HnswOptions *opts = (HnswOptions *)index->rd_options;
+
+	if (opts && opts->quantizer != 0)
+		return HnswParseQuantizer((char *)opts + opts->quantizer);
+
+	return HNSW_QUANTIZER_NONE;
+}
 const char *HnswGetPQDistFileName(Relation index)
 {
 	HnswOptions *opts = (HnswOptions *)index->rd_options;
@@ -195,6 +221,9 @@ int HnswGetEfConstruction(Relation index)
 
 	return HNSW_DEFAULT_EF_CONSTRUCTION;
 }
+/*
+ * Get the product quantization codebook, loading it on first use
+ */
 PQDist *HnswGetPQDist(Relation index)
 {
 	if (index == NULL)
@@ -203,18 +232,32 @@ PQDist *HnswGetPQDist(Relation index)
 
 	if (opts)
 	{
+		if (opts->pqdist == NULL && opts->use_pq)
+			HnswSetPQDist(index, HnswGetPQDistFileName(index));
+
 		return opts->pqdist;
 	}
 	return NULL;
 }
+
+/*
+ * Load the product quantization codebook
+ *
+ * The codebook is cached with the index options, so it must outlive the
+ * statement that loads it
+ */
 void HnswSetPQDist(Relation index, const char *pq_dist_file_name)
 {
 	HnswOptions *opts = (HnswOptions *)index->rd_options;
 
 	if (opts)
 	{
+		MemoryContext oldCtx = MemoryContextSwitchTo(index->rd_indexcxt);
+
 		opts->pqdist = (PQDist *)palloc(sizeof(PQDist));
 		PQDist_load(opts->pqdist, pq_dist_file_name);
+
+		MemoryContextSwitchTo(oldCtx);
 	}
 }
 
@@ -268,6 +311,37 @@ void HnswInitPage(Buffer buf, Page page)
 	HnswPageGetOpaque(page)->page_id = HNSW_PAGE_ID;
 }
 
+/*
+ * Get the space on an element page that inserts can use
+ *
+ * Inserts can overwrite the tuples of a deleted element, so include the
+ * largest one (and its neighbor tuple if on the same page)
+ */
+Size HnswGetReusableSpace(Page page, BlockNumber blkno)
+{
+	OffsetNumber maxoffno = PageGetMaxOffsetNumber(page);
+	Size maxDeleted = 0;
+
+	for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+	{
+		ItemId itemid = PageGetItemId(page, offno);
+		HnswElementTuple etup = (HnswElementTuple)PageGetItem(page, itemid);
+		Size size;
+
+		if (!HnswIsElementTuple(etup) || !etup->deleted)
+			continue;
+
+		size = ItemIdGetLength(itemid);
+		if (ItemPointerGetBlockNumber(&etup->neighbortid) == blkno)
+			size += ItemIdGetLength(PageGetItemId(page, ItemPointerGetOffsetNumber(&etup->neighbortid)));
+
+		if (size > maxDeleted)
+			maxDeleted = size;
+	}
+
+	return PageGetFreeSpace(page) + maxDeleted;
+}
+
 /*
  * Allocate a neighbor array
  */
@@ -330,7 +404,10 @@ HnswInitElement(char *base, ItemPointer heaptid, int m, double ml, int maxLevel,
 
 	HnswInitNeighbors(base, element, m, allocator);
 
+	element->vectorPage = InvalidBlockNumber;
+	element->vectorOffno = InvalidOffsetNumber;
 	HnswPtrStore(base, element->value, (Pointer)NULL);
+	HnswPtrStore(base, element->codes, (Pointer)NULL);
 	// elog(INFO, "开始导入encode data\n");
 	if (use_pq)
 	{
@@ -363,8 +440,11 @@ HnswInitElementFromBlock(BlockNumber blkno, OffsetNumber offno)
 
 	element->blkno = blkno;
 	element->offno = offno;
+	element->vectorPage = InvalidBlockNumber;
+	element->vectorOffno = InvalidOffsetNumber;
 	HnswPtrStore(base, element->neighbors, (HnswNeighborArrayPtr *)NULL);
 	HnswPtrStore(base, element->value, (Pointer)NULL);
+	HnswPtrStore(base, element->codes, (Pointer)NULL);
 	return element;
 }
 
@@ -474,16 +554,55 @@ void HnswUpdateMetaPage(Relation index, int updateEntry, HnswElement entryPoint,
 	UnlockReleaseBuffer(buf);
 }
 
+/*
+ * Update the vector insert page on the metapage
+ */
+void HnswUpdateVectorInsertPage(Relation index, BlockNumber vectorInsertPage, ForkNumber forkNum, bool building)
+{
+	Buffer buf;
+	Page page;
+	GenericXLogState *state;
+
+	buf = ReadBufferExtended(index, forkNum, HNSW_METAPAGE_BLKNO, RBM_NORMAL, NULL);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	if (building)
+	{
+		state = NULL;
+		page = BufferGetPage(buf);
+	}
+	else
+	{
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+	}
+
+	HnswPageGetMeta(page)->vectorInsertPage = vectorInsertPage;
+
+	if (building)
+		MarkBufferDirty(buf);
+	else
+		GenericXLogFinish(state);
+	UnlockReleaseBuffer(buf);
+}
+
 /*
  * Set element tuple, except for neighbor info
+ *
+ * When vectors are split, only the location of the vector tuple is stored.
+ * When quantized, only the codes are stored.
  */
-void HnswSetElementTuple(char *base, HnswElementTuple etup, HnswElement element)
+void HnswSetElementTuple(char *base, HnswElementTuple etup, HnswElement element, bool splitVectors, HnswQuantizer quantizer, bool encoded)
 {
 	Pointer valuePtr = HnswPtrAccess(base, element->value);
 
 	etup->type = HNSW_ELEMENT_TUPLE_TYPE;
 	etup->level = element->level;
 	etup->deleted = 0;
+	etup->flags = 0;
+	if (splitVectors)
+		etup->flags |= HNSW_ELEMENT_SPLIT_VECTOR;
+	if (quantizer != NULL)
+		etup->flags |= HNSW_ELEMENT_QUANTIZED;
 	etup->id = element->id;
 	for (int i = 0; i < HNSW_HEAPTIDS; i++)
 	{
@@ -492,7 +611,50 @@ void HnswSetElementTuple(char *base, HnswElementTuple etup, HnswElement element)
 		else
 			ItemPointerSetInvalid(&etup->heaptids[i]);
 	}
-	memcpy(&etup->data, valuePtr, VARSIZE_ANY(valuePtr));
+
+	if (quantizer != NULL && encoded)
+		memcpy(HnswElementTupleGetCodes(etup), VARDATA(valuePtr), HnswQuantizerCodeSize(quantizer));
+	else if (quantizer != NULL)
+		HnswQuantizerEncode(quantizer, PointerGetDatum(valuePtr), HnswElementTupleGetCodes(etup));
+	else if (splitVectors)
+	{
+		ItemPointer vectortid = HnswElementTupleGetVectorTid(etup);
+
+		if (BlockNumberIsValid(element->vectorPage))
+			ItemPointerSet(vectortid, element->vectorPage, element->vectorOffno);
+		else
+			ItemPointerSetInvalid(vectortid);
+	}
+	else
+		memcpy(&etup->data, valuePtr, VARSIZE_ANY(valuePtr));
+}
+
+/*
+ * Set vector tuple
+ */
+void HnswSetVectorTuple(char *base, HnswVectorTuple vtup, HnswElement element)
+{
+	Pointer valuePtr = HnswPtrAccess(base, element->value);
+
+	vtup->type = HNSW_VECTOR_TUPLE_TYPE;
+	vtup->unused = 0;
+	vtup->unused2 = 0;
+	memcpy(&vtup->data, valuePtr, VARSIZE_ANY(valuePtr));
+}
+
+/*
+ * Get the product quantization codes for an element
+ *
+ * Elements inserted during builds are encoded once on insert, so only encode
+ * elements without codes
+ */
+static void
+HnswGetElementCodes(char *base, HnswElement element, PQDist *pqdist, uint8_t *codes)
+{
+	if (!HnswPtrIsNull(base, element->codes))
+		memcpy(codes, HnswPtrAccess(base, element->codes), pqdist->m * pqdist->nbits / 8);
+	else
+		PQCaculate_Codes(pqdist, DatumGetVector(HnswGetValue(base, element))->x, codes);
 }
 
 /*
@@ -529,7 +691,7 @@ void HnswSetNeighborTuple(char *base, HnswNeighborTuple ntup, HnswElement e, int
 		int PQSize = pqdist->m * pqdist->nbits / 8;
 		uint8_t *encode_data = palloc(PQSize);
 
-		PQCaculate_Codes(pqdist, DatumGetVector(HnswGetValue(base, e))->x, encode_data);
+		HnswGetElementCodes(base, e, pqdist, encode_data);
 		void *pq_start = (void *)(ntup->indextids + idx);
 		void *pq_store;
 
@@ -545,7 +707,7 @@ void HnswSetNeighborTuple(char *base, HnswNeighborTuple ntup, HnswElement e, int
 			idx += 1;
 			HnswCandidate *hc = &neighbors->items[i];
 			HnswElement hce = HnswPtrAccess(base, hc->element);
-			PQCaculate_Codes(pqdist, DatumGetVector(HnswGetValue(base, hce))->x, encode_data);
+			HnswGetElementCodes(base, hce, pqdist, encode_data);
 			memcpy(pq_store, encode_data, PQSize);
 		}
 		pfree(encode_data);
@@ -616,13 +778,15 @@ LoadNeighborsFromPage(HnswElement element, Relation index, Page page, int m, int
 /*
  * Load neighbors
  */
-void HnswLoadNeighbors(HnswElement element, Relation index, int m)
+XLogRecPtr
+HnswLoadNeighbors(HnswElement element, Relation index, int m)
 {
 	// elog(INFO, "load neighbors");
 	// elog(INFO, "element->neighborPage:%d", element->neighborPage);
 	// elog(INFO, "element->lc:%d", element->level);
 	Buffer buf;
 	Page page;
+	XLogRecPtr lsn;
 
 	buf = ReadBuffer(index, element->neighborPage);
 	LockBuffer(buf, BUFFER_LOCK_SHARE);
@@ -632,8 +796,11 @@ void HnswLoadNeighbors(HnswElement element, Relation index, int m)
 	int nbits = HnswGetNbits(index);
 
 	LoadNeighborsFromPage(element, index, page, m, use_pq, pq_m, nbits);
+	lsn = PageGetLSN(page);
 
 	UnlockReleaseBuffer(buf);
+
+	return lsn;
 }
 
 /*
@@ -648,6 +815,26 @@ void HnswLoadElementFromTuple(HnswElement element, HnswElementTuple etup, bool l
 	element->neighborOffno = ItemPointerGetOffsetNumber(&etup->neighbortid);
 	element->heaptidsLength = 0;
 
+	if (HnswElementTupleIsSplit(etup))
+	{
+		ItemPointer vectortid = HnswElementTupleGetVectorTid(etup);
+
+		element->vectorPage = ItemPointerGetBlockNumberNoCheck(vectortid);
+		element->vectorOffno = ItemPointerGetOffsetNumberNoCheck(vectortid);
+
+		/* Value is loaded separately from the vector page */
+		loadVec = false;
+	}
+	else
+	{
+		element->vectorPage = InvalidBlockNumber;
+		element->vectorOffno = InvalidOffsetNumber;
+
+		/* Quantizer is needed to decode the value */
+		if (HnswElementTupleIsQuantized(etup))
+			loadVec = false;
+	}
+
 	if (loadHeaptids)
 	{
 		for (int i = 0; i < HNSW_HEAPTIDS; i++)
@@ -669,6 +856,83 @@ void HnswLoadElementFromTuple(HnswElement element, HnswElementTuple etup, bool l
 	}
 }
 
+/*
+ * Load the vector of a split element and optionally get its distance from q
+ */
+static void
+HnswLoadVector(HnswElement element, float *distance, Datum *q, Relation index, FmgrInfo *procinfo, Oid collation, bool loadVec, float *maxDistance)
+{
+	Buffer buf;
+	Page page;
+	HnswVectorTuple vtup;
+
+	buf = ReadBuffer(index, element->vectorPage);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+
+	vtup = (HnswVectorTuple)PageGetItem(page, PageGetItemId(page, element->vectorOffno));
+
+	Assert(HnswIsVectorTuple(vtup));
+
+	/* Calculate distance */
+	if (distance != NULL)
+	{
+		if (DatumGetPointer(*q) == NULL)
+			*distance = 0;
+		else
+			*distance = (float)DatumGetFloat8(FunctionCall2Coll(procinfo, collation, *q, PointerGetDatum(&vtup->data)));
+	}
+
+	/* Load value */
+	if (loadVec && (distance == NULL || maxDistance == NULL || *distance < *maxDistance))
+	{
+		char *base = NULL;
+		Datum value = datumCopy(PointerGetDatum(&vtup->data), false, -1);
+
+		HnswPtrStore(base, element->value, DatumGetPointer(value));
+	}
+
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Get the PQ distance of an element from the code in its neighbor tuple
+ */
+static void
+HnswLoadCodeDistance(HnswElement element, float *distance, Datum *q, Relation index, PQDist *pqdist)
+{
+	Buffer buf;
+	Page page;
+	HnswNeighborTuple ntup;
+
+	buf = ReadBuffer(index, element->neighborPage);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+
+	ntup = (HnswNeighborTuple)PageGetItem(page, PageGetItemId(page, element->neighborOffno));
+
+	Assert(HnswIsNeighborTuple(ntup));
+
+	/* Code of the element comes first after the neighbor tids */
+	if (DatumGetPointer(*q) == NULL)
+		*distance = 0;
+	else
+		*distance = calc_dist_pq_loaded_by_id(pqdist, (uint8_t *)(ntup->indextids + ntup->count));
+
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Load the value of an element that was not loaded with its tuple
+ */
+void HnswLoadElementValue(HnswElement element, Relation index)
+{
+	if (BlockNumberIsValid(element->vectorPage))
+		HnswLoadVector(element, NULL, NULL, index, NULL, InvalidOid, true, NULL);
+	else
+		HnswLoadElement(element, NULL, NULL, index, NULL, InvalidOid, true, NULL, 0, NULL);
+}
+
 /*
  * Load an element and optionally get its distance from q
  */
@@ -688,6 +952,57 @@ void HnswLoadElement(HnswElement element, float *distance, Datum *q, Relation in
 
 	Assert(HnswIsElementTuple(etup));
 
+	/* Release the element page before reading the vector page */
+	if (HnswElementTupleIsSplit(etup))
+	{
+		HnswLoadElementFromTuple(element, etup, true, false);
+		UnlockReleaseBuffer(buf);
+
+		/*
+		 * Use the PQ code stored with the neighbors when only the distance
+		 * is needed, so traversal does not read vector pages (without PQ,
+		 * the vector page must still be read)
+		 */
+		if (use_pq && pqdist != NULL && distance != NULL && !loadVec)
+		{
+			HnswLoadCodeDistance(element, distance, q, index, pqdist);
+			return;
+		}
+
+		HnswLoadVector(element, distance, q, index, procinfo, collation, loadVec, maxDistance);
+		return;
+	}
+
+	/* Use codes for distance and decode value if needed */
+	if (HnswElementTupleIsQuantized(etup))
+	{
+		HnswQuantizer quantizer = HnswGetQuantizerParams(index);
+		uint8 *codes = HnswElementTupleGetCodes(etup);
+
+		if (distance != NULL)
+		{
+			if (DatumGetPointer(*q) == NULL)
+				*distance = 0;
+			else
+				*distance = HnswQuantizerDistance(quantizer, procinfo, collation, *q, codes);
+		}
+
+		if (distance == NULL || maxDistance == NULL || *distance < *maxDistance)
+		{
+			HnswLoadElementFromTuple(element, etup, true, false);
+
+			if (loadVec)
+			{
+				char *base = NULL;
+
+				HnswPtrStore(base, element->value, DatumGetPointer(HnswQuantizerDecode(quantizer, codes)));
+			}
+		}
+
+		UnlockReleaseBuffer(buf);
+		return;
+	}
+
 	/* Calculate distance */
 	if (distance != NULL)
 	{
@@ -726,7 +1041,14 @@ HnswEntryCandidate(char *base, HnswElement entryPoint, Datum q, Relation index,
 	if (index == NULL)
 		hc->distance = GetCandidateDistance(base, hc, q, procinfo, collation, use_pq, pqdist);
 	else
+	{
+		HnswQuantizer quantizer = HnswGetQuantizerParams(index);
+
+		if (quantizer != NULL)
+			HnswQuantizerSetQuery(quantizer, q);
+
 		HnswLoadElement(entryPoint, &hc->distance, &q, index, procinfo, collation, loadVec, NULL, use_pq, pqdist);
+	}
 	return hc;
 }
 
@@ -847,8 +1169,8 @@ List *
 HnswSearchLayer(char *base, Datum q, List *ep, int ef, int lc, Relation index, FmgrInfo *procinfo, Oid collation, int m, bool inserting, HnswElement skipElement, int use_pq, PQDist *pqdist, bool is_search_knn)
 {
 
-	// 不在最底层不使用pq
-	if (lc != 0 || !is_search_knn)
+	/* Only searches use PQ (upper layers use it to skip vector pages) */
+	if (!is_search_knn)
 	{
 		use_pq = 0;
 	}
@@ -870,6 +1192,14 @@ HnswSearchLayer(char *base, Datum q, List *ep, int ef, int lc, Relation index, F
 		neighborhoodSize = HNSW_NEIGHBOR_ARRAY_SIZE(HnswGetLayerM(m, lc));
 		neighborhoodData = palloc(neighborhoodSize);
 	}
+	else
+	{
+		HnswQuantizer quantizer = HnswGetQuantizerParams(index);
+
+		/* Encode query once for all distances */
+		if (quantizer != NULL)
+			HnswQuantizerSetQuery(quantizer, q);
+	}
 
 	/* Add entry points to v, C, and W */
 	foreach (lc2, ep)
@@ -1325,6 +1655,10 @@ void HnswUpdateConnection(char *base, HnswElement element, HnswCandidate *hc, in
 		if (index != NULL)
 		{
 			Datum q = HnswGetValue(base, hce);
+			HnswQuantizer quantizer = HnswGetQuantizerParams(index);
+
+			if (quantizer != NULL)
+				HnswQuantizerSetQuery(quantizer, q);
 
 			for (int i = 0; i < currentNeighbors->length; i++)
 			{
@@ -1333,6 +1667,11 @@ void HnswUpdateConnection(char *base, HnswElement element, HnswCandidate *hc, in
 
 				if (HnswPtrIsNull(base, hc3Element->value))
 					HnswLoadElement(hc3Element, &hc3->distance, &q, index, procinfo, collation, true, NULL, 0, NULL);
+				else if (quantizer != NULL)
+				{
+					/* Use the same distances as loaded elements */
+					hc3->distance = HnswQuantizerValueDistance(quantizer, procinfo, collation, q, HnswGetValue(base, hc3Element));
+				}
 				else
 					hc3->distance = GetCandidateDistance(base, hc3, q, procinfo, collation, 0, NULL);
 
@@ -1507,6 +1846,106 @@ void HnswFindElementNeighbors(char *base, HnswElement element, HnswElement entry
 	}
 }
 
+/*
+ * Add seeds to entry points if not already present
+ */
+static List *
+AddSeeds(List *ep, List *seeds)
+{
+	ListCell *lc2;
+	List *ep2 = list_copy(ep);
+
+	foreach (lc2, seeds)
+	{
+		HnswCandidate *hc = (HnswCandidate *)lfirst(lc2);
+		HnswElement hce = HnswPtrAccess((char *)NULL, hc->element);
+		bool found = false;
+		ListCell *lc3;
+
+		foreach (lc3, ep)
+		{
+			HnswElement e = HnswPtrAccess((char *)NULL, ((HnswCandidate *)lfirst(lc3))->element);
+
+			if (e->blkno == hce->blkno && e->offno == hce->offno)
+			{
+				found = true;
+				break;
+			}
+		}
+
+		if (!found)
+			ep2 = lappend(ep2, hc);
+	}
+
+	return ep2;
+}
+
+/*
+ * Find neighbors on disk for an element from a graph built in memory
+ *
+ * The search on each layer is seeded with the neighbors of the element in
+ * memory (a shard or an insert batch) that are already on disk, so a bounded
+ * ef keeps the best of those links and adds links to the rest of the graph.
+ * Layers above the entry point only have the seeds.
+ */
+void HnswMergeElementNeighbors(HnswElement element, HnswElement entryPoint, List **seeds, Relation index, FmgrInfo *procinfo, Oid collation, int m, int ef)
+{
+	char *base = NULL;
+	Datum q = HnswGetValue(base, element);
+	int entryLevel;
+	List *ep;
+
+	ep = list_make1(HnswEntryCandidate(base, entryPoint, q, index, procinfo, collation, true, 0, NULL));
+	entryLevel = entryPoint->level;
+
+	/* 1st phase: greedy search to insert level */
+	for (int lc = entryLevel; lc >= element->level + 1; lc--)
+		ep = HnswSearchLayer(base, q, ep, 1, lc, index, procinfo, collation, m, true, element, 0, NULL, false);
+
+	/* 2nd phase */
+	for (int lc = element->level; lc >= 0; lc--)
+	{
+		int lm = HnswGetLayerM(m, lc);
+		bool searched = lc <= entryLevel;
+		List *neighbors;
+		List *w;
+
+		if (searched)
+		{
+			w = HnswSearchLayer(base, q, AddSeeds(ep, seeds[lc]), ef, lc, index, procinfo, collation, m, true, element, 0, NULL, false);
+			ep = w;
+		}
+		else
+			w = seeds[lc];
+
+		/* Seeds are not ordered when the layer is not searched */
+		neighbors = SelectNeighbors(base, RemoveElements(base, w, element), lm, lc, procinfo, collation, element, NULL, NULL, !searched);
+
+		AddConnections(base, element, neighbors, lc);
+	}
+}
+
+/*
+ * Select neighbors on disk for an element from candidates without a search
+ *
+ * Candidates must have distances to the element. Vacuum uses this to
+ * reconnect an element through the neighbors of its deleted neighbors.
+ */
+void HnswSelectElementNeighbors(HnswElement element, List **candidates, FmgrInfo *procinfo, Oid collation, int m)
+{
+	char *base = NULL;
+
+	for (int lc = element->level; lc >= 0; lc--)
+	{
+		int lm = HnswGetLayerM(m, lc);
+		List *neighbors;
+
+		neighbors = SelectNeighbors(base, RemoveElements(base, candidates[lc], element), lm, lc, procinfo, collation, element, NULL, NULL, true);
+
+		AddConnections(base, element, neighbors, lc);
+	}
+}
+
 PGDLLEXPORT Datum l2_normalize(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum halfvec_l2_normalize(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum sparsevec_l2_normalize(PG_FUNCTION_ARGS);
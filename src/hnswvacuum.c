@@ -3,11 +3,56 @@
 #include <math.h>
 
 #include "access/generic_xlog.h"
+#include "access/parallel.h"
+#include "access/xact.h"
 #include "commands/vacuum.h"
 #include "hnsw.h"
+#include "miscadmin.h"
+#include "optimizer/paths.h"
+#include "postmaster/autovacuum.h"
 #include "storage/bufmgr.h"
 #include "storage/lmgr.h"
+#include "tcop/tcopprot.h"
 #include "utils/memutils.h"
+#include "vacuumutils.h"
+
+#if PG_VERSION_NUM >= 140000
+#include "utils/backend_status.h"
+#else
+#include "pgstat.h"
+#endif
+
+#if PG_VERSION_NUM >= 170000
+#include "storage/read_stream.h"
+#endif
+
+#define PARALLEL_KEY_HNSW_VACUUM_SHARED UINT64CONST(0xA000000000000011)
+#define PARALLEL_KEY_HNSW_VACUUM_CHUNKS UINT64CONST(0xA000000000000012)
+#define PARALLEL_KEY_HNSW_VACUUM_DELETED UINT64CONST(0xA000000000000013)
+#define PARALLEL_KEY_HNSW_VACUUM_QUERY_TEXT UINT64CONST(0xA000000000000014)
+
+/* Reads pages of element page ranges in order */
+typedef struct HnswRangeReader
+{
+	Relation	index;
+	BufferAccessStrategy bas;
+	HnswVacuumRange *ranges;
+	int			nranges;
+
+	/* Next page to read */
+	int			range;
+	BlockNumber offset;
+
+#if PG_VERSION_NUM >= 170000
+	ReadStream *stream;
+#else
+	/* Next page to prefetch */
+	int			prefetchRange;
+	BlockNumber prefetchOffset;
+	int64		nread;
+	int64		nprefetched;
+#endif
+}			HnswRangeReader;
 
 /*
  * Check if deleted list contains an index TID
@@ -18,6 +63,142 @@ DeletedContains(tidhash_hash * deleted, ItemPointer indextid)
 	return tidhash_lookup(deleted, *indextid) != NULL;
 }
 
+/*
+ * Add a page to the element page ranges
+ */
+static void
+AddVacuumRange(HnswVacuumState * vacuumstate, BlockNumber blkno)
+{
+	HnswVacuumRange *range;
+
+	if (vacuumstate->nranges > 0)
+	{
+		range = &vacuumstate->ranges[vacuumstate->nranges - 1];
+
+		/* Pages are usually added in order */
+		if (range->start + range->count == blkno)
+		{
+			range->count++;
+			return;
+		}
+	}
+
+	if (vacuumstate->nranges == vacuumstate->maxranges)
+	{
+		vacuumstate->maxranges *= 2;
+		vacuumstate->ranges = repalloc(vacuumstate->ranges, sizeof(HnswVacuumRange) * vacuumstate->maxranges);
+	}
+
+	range = &vacuumstate->ranges[vacuumstate->nranges++];
+	range->start = blkno;
+	range->count = 1;
+}
+
+/*
+ * Get the next page of ranges, or false if there are no more pages
+ */
+static bool
+NextRangePage(HnswVacuumRange * ranges, int nranges, int *range, BlockNumber *offset, BlockNumber *blkno)
+{
+	while (*range < nranges && *offset >= ranges[*range].count)
+	{
+		(*range)++;
+		*offset = 0;
+	}
+
+	if (*range >= nranges)
+		return false;
+
+	*blkno = ranges[*range].start + *offset;
+	(*offset)++;
+	return true;
+}
+
+#if PG_VERSION_NUM >= 170000
+/*
+ * Get the next block for the read stream
+ */
+static BlockNumber
+RangeReaderNextBlock(ReadStream *stream, void *callback_private_data, void *per_buffer_data)
+{
+	HnswRangeReader *reader = (HnswRangeReader *) callback_private_data;
+	BlockNumber blkno;
+
+	if (!NextRangePage(reader->ranges, reader->nranges, &reader->range, &reader->offset, &blkno))
+		return InvalidBlockNumber;
+
+	return blkno;
+}
+#endif
+
+/*
+ * Start reading pages of ranges
+ *
+ * Uses a read stream with Postgres 17+ and prefetching otherwise, so reads
+ * are not limited to one page at a time
+ */
+static void
+BeginRangeReader(HnswRangeReader * reader, HnswVacuumState * vacuumstate, HnswVacuumRange * ranges, int nranges)
+{
+	reader->index = vacuumstate->index;
+	reader->bas = vacuumstate->bas;
+	reader->ranges = ranges;
+	reader->nranges = nranges;
+	reader->range = 0;
+	reader->offset = 0;
+
+#if PG_VERSION_NUM >= 170000
+	reader->stream = read_stream_begin_relation(READ_STREAM_MAINTENANCE, reader->bas, reader->index, MAIN_FORKNUM, RangeReaderNextBlock, reader, 0);
+#else
+	reader->prefetchRange = 0;
+	reader->prefetchOffset = 0;
+	reader->nread = 0;
+	reader->nprefetched = 0;
+#endif
+}
+
+/*
+ * Read the next page of ranges, or return InvalidBuffer if there are no
+ * more pages
+ */
+static Buffer
+RangeReaderNext(HnswRangeReader * reader)
+{
+#if PG_VERSION_NUM >= 170000
+	return read_stream_next_buffer(reader->stream, NULL);
+#else
+	BlockNumber blkno;
+	BlockNumber prefetchBlkno;
+
+	if (!NextRangePage(reader->ranges, reader->nranges, &reader->range, &reader->offset, &blkno))
+		return InvalidBuffer;
+
+	reader->nread++;
+
+	/* Keep prefetch distance pages ahead */
+	while (reader->nprefetched < reader->nread + VacuumPrefetchDistance() &&
+		   NextRangePage(reader->ranges, reader->nranges, &reader->prefetchRange, &reader->prefetchOffset, &prefetchBlkno))
+	{
+		if (reader->nprefetched >= reader->nread)
+			PrefetchBuffer(reader->index, MAIN_FORKNUM, prefetchBlkno);
+		reader->nprefetched++;
+	}
+
+	return ReadBufferExtended(reader->index, MAIN_FORKNUM, blkno, RBM_NORMAL, reader->bas);
+#endif
+}
+
+/*
+ * Finish reading pages of ranges
+ */
+static void
+EndRangeReader(HnswRangeReader * reader)
+{
+#if PG_VERSION_NUM >= 170000
+	read_stream_end(reader->stream);
+#endif
+}
+
 /*
  * Remove deleted heap TIDs
  *
@@ -32,6 +213,8 @@ RemoveHeapTids(HnswVacuumState * vacuumstate)
 	BufferAccessStrategy bas = vacuumstate->bas;
 	HnswElement entryPoint = HnswGetEntryPoint(vacuumstate->index);
 	IndexBulkDeleteResult *stats = vacuumstate->stats;
+	BlockNumber nblocks = RelationGetNumberOfBlocks(index);
+	BlockNumber prefetched = HNSW_METAPAGE_BLKNO;
 
 	/* Store separately since highestPoint.level is uint8 */
 	int			highestLevel = -1;
@@ -51,6 +234,11 @@ RemoveHeapTids(HnswVacuumState * vacuumstate)
 
 		vacuum_delay_point();
 
+		/* Remember element pages for repairing graph */
+		AddVacuumRange(vacuumstate, blkno);
+
+		VacuumPrefetchNext(index, blkno, nblocks, &prefetched);
+
 		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
 		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
 		state = GenericXLogStart(index);
@@ -177,6 +365,120 @@ NeedsUpdated(HnswVacuumState * vacuumstate, HnswElement element)
 	return needsUpdated;
 }
 
+/*
+ * Add a candidate for repairing an element
+ */
+static void
+AddRepairCandidate(HnswVacuumState * vacuumstate, List **candidates, List **loaded, HnswElement element, HnswElement e, Datum q)
+{
+	HnswCandidate *hc = NULL;
+	ItemPointerData indextid;
+	ListCell   *lc2;
+
+	/* Skip self */
+	if (e->blkno == element->blkno && e->offno == element->offno)
+		return;
+
+	/* Skip elements being deleted */
+	ItemPointerSet(&indextid, e->blkno, e->offno);
+	if (DeletedContains(vacuumstate->deleted, &indextid))
+		return;
+
+	/* Skip elements already added for layer */
+	foreach(lc2, *candidates)
+	{
+		HnswElement hce = HnswPtrAccess((char *) NULL, ((HnswCandidate *) lfirst(lc2))->element);
+
+		if (hce->blkno == e->blkno && hce->offno == e->offno)
+			return;
+	}
+
+	/* Reuse elements loaded for other layers */
+	foreach(lc2, *loaded)
+	{
+		HnswElement hce = HnswPtrAccess((char *) NULL, ((HnswCandidate *) lfirst(lc2))->element);
+
+		if (hce->blkno == e->blkno && hce->offno == e->offno)
+		{
+			hc = (HnswCandidate *) lfirst(lc2);
+			break;
+		}
+	}
+
+	if (hc == NULL)
+	{
+		hc = HnswEntryCandidate(NULL, e, q, vacuumstate->index, vacuumstate->procinfo, vacuumstate->collation, true, 0, NULL);
+		*loaded = lappend(*loaded, hc);
+	}
+
+	*candidates = lappend(*candidates, hc);
+}
+
+/*
+ * Get candidates for repairing an element locally, or NULL if a search is
+ * needed
+ *
+ * Candidates are the remaining neighbors of the element and the neighbors of
+ * its deleted neighbors on each layer, which avoids a search from the entry
+ * point for most elements
+ */
+static List **
+GetRepairCandidates(HnswVacuumState * vacuumstate, HnswElement element)
+{
+	Relation	index = vacuumstate->index;
+	int			m = vacuumstate->m;
+	char	   *base = NULL;
+	Datum		q = HnswGetValue(base, element);
+	List	  **candidates = palloc0(sizeof(List *) * (element->level + 1));
+	List	   *loaded = NIL;
+	bool		foundDeleted = false;
+
+	HnswLoadNeighbors(element, index, m);
+
+	for (int lc = element->level; lc >= 0; lc--)
+	{
+		HnswNeighborArray *neighbors = HnswGetNeighbors(base, element, lc);
+
+		for (int i = 0; i < neighbors->length; i++)
+		{
+			HnswElement neighbor = HnswPtrAccess(base, neighbors->items[i].element);
+			ItemPointerData indextid;
+
+			ItemPointerSet(&indextid, neighbor->blkno, neighbor->offno);
+
+			if (DeletedContains(vacuumstate->deleted, &indextid))
+			{
+				HnswNeighborArray *deletedNeighbors;
+
+				/* Neighbors are not cleared until marked as deleted */
+				HnswLoadElement(neighbor, NULL, NULL, index, vacuumstate->procinfo, vacuumstate->collation, false, NULL, 0, NULL);
+				if (neighbor->level < lc)
+					continue;
+
+				HnswLoadNeighbors(neighbor, index, m);
+				deletedNeighbors = HnswGetNeighbors(base, neighbor, lc);
+
+				for (int j = 0; j < deletedNeighbors->length; j++)
+					AddRepairCandidate(vacuumstate, &candidates[lc], &loaded, element, HnswPtrAccess(base, deletedNeighbors->items[j].element), q);
+
+				foundDeleted = true;
+			}
+			else
+				AddRepairCandidate(vacuumstate, &candidates[lc], &loaded, element, neighbor, q);
+		}
+
+		/* Search if a layer cannot be filled */
+		if (candidates[lc] == NIL)
+			return NULL;
+	}
+
+	/* Search if layer 0 is not full for another reason */
+	if (!foundDeleted || list_length(candidates[0]) < HnswGetLayerM(m, 0))
+		return NULL;
+
+	return candidates;
+}
+
 /*
  * Repair graph for a single element
  */
@@ -196,18 +498,31 @@ RepairGraphElement(HnswVacuumState * vacuumstate, HnswElement element, HnswEleme
 	BufferAccessStrategy bas = vacuumstate->bas;
 	HnswNeighborTuple ntup = vacuumstate->ntup;
 	Size		ntupSize = HNSW_NEIGHBOR_TUPLE_SIZE(element->level, m);
+	List	  **candidates;
 	char	   *base = NULL;
 
 	/* Skip if element is entry point */
 	if (entryPoint != NULL && element->blkno == entryPoint->blkno && element->offno == entryPoint->offno)
 		return;
 
+	/* Product quantization codes are not loaded for candidates */
+	candidates = use_pq ? NULL : GetRepairCandidates(vacuumstate, element);
+
 	/* Init fields */
 	HnswInitNeighbors(base, element, m, NULL);
 	element->heaptidsLength = 0;
 
-	/* Find neighbors for element, skipping itself */
-	HnswFindElementNeighbors(base, element, entryPoint, index, procinfo, collation, m, efConstruction, true, use_pq, pqdist);
+	/* Reconnect through deleted neighbors, or find neighbors, skipping itself */
+	if (candidates != NULL)
+	{
+		HnswSelectElementNeighbors(element, candidates, procinfo, collation, m);
+		vacuumstate->localRepairs++;
+	}
+	else
+	{
+		HnswFindElementNeighbors(base, element, entryPoint, index, procinfo, collation, m, efConstruction, use_pq, pqdist, true);
+		vacuumstate->searchRepairs++;
+	}
 
 	/* Zero memory for each element */
 	MemSet(ntup, 0, HNSW_TUPLE_ALLOC_SIZE);
@@ -320,118 +635,375 @@ RepairGraphEntryPoint(HnswVacuumState * vacuumstate)
 }
 
 /*
- * Repair graph for all elements
+ * Repair graph for elements on a page
  */
 static void
-RepairGraph(HnswVacuumState * vacuumstate)
+RepairGraphPage(HnswVacuumState * vacuumstate, Buffer buf)
 {
 	Relation	index = vacuumstate->index;
-	BufferAccessStrategy bas = vacuumstate->bas;
-	BlockNumber blkno = HNSW_HEAD_BLKNO;
+	BlockNumber blkno = BufferGetBlockNumber(buf);
+	Page		page;
+	OffsetNumber offno;
+	OffsetNumber maxoffno;
+	List	   *elements = NIL;
+	ListCell   *lc2;
+	MemoryContext oldCtx;
 
-	/*
-	 * Wait for inserts to complete. Inserts before this point may have
-	 * neighbors about to be deleted. Inserts after this point will not.
-	 */
-	LockPage(index, HNSW_UPDATE_LOCK, ExclusiveLock);
-	UnlockPage(index, HNSW_UPDATE_LOCK, ExclusiveLock);
+	vacuum_delay_point();
 
-	/* Repair entry point first */
-	RepairGraphEntryPoint(vacuumstate);
+	oldCtx = MemoryContextSwitchTo(vacuumstate->tmpCtx);
 
-	while (BlockNumberIsValid(blkno))
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	maxoffno = PageGetMaxOffsetNumber(page);
+
+	/* Load items into memory to minimize locking */
+	for (offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
 	{
-		Buffer		buf;
-		Page		page;
-		OffsetNumber offno;
-		OffsetNumber maxoffno;
-		List	   *elements = NIL;
-		ListCell   *lc2;
-		MemoryContext oldCtx;
+		HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+		HnswElement element;
 
-		vacuum_delay_point();
+		/* Skip neighbor tuples */
+		if (!HnswIsElementTuple(etup))
+			continue;
 
-		oldCtx = MemoryContextSwitchTo(vacuumstate->tmpCtx);
+		/* Skip updating neighbors if being deleted */
+		if (!ItemPointerIsValid(&etup->heaptids[0]))
+			continue;
 
-		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
-		LockBuffer(buf, BUFFER_LOCK_SHARE);
-		page = BufferGetPage(buf);
-		maxoffno = PageGetMaxOffsetNumber(page);
+		/* Create an element */
+		element = HnswInitElementFromBlock(blkno, offno);
+		HnswLoadElementFromTuple(element, etup, false, true);
 
-		/* Load items into memory to minimize locking */
-		for (offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
-		{
-			HnswElementTuple etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
-			HnswElement element;
+		elements = lappend(elements, element);
+	}
 
-			/* Skip neighbor tuples */
-			if (!HnswIsElementTuple(etup))
-				continue;
+	UnlockReleaseBuffer(buf);
 
-			/* Skip updating neighbors if being deleted */
-			if (!ItemPointerIsValid(&etup->heaptids[0]))
-				continue;
+	/* Update neighbor pages */
+	foreach(lc2, elements)
+	{
+		HnswElement element = (HnswElement) lfirst(lc2);
+		HnswElement entryPoint;
+		LOCKMODE	lockmode = ShareLock;
+		bool		entryLocked = false;
+
+		/* Check if any neighbors point to deleted values */
+		if (!NeedsUpdated(vacuumstate, element))
+			continue;
+
+		/* Load value if not stored in element tuple */
+		if (HnswPtrIsNull((char *) NULL, element->value))
+			HnswLoadElementValue(element, index);
+
+		/* Get a shared lock */
+		LockPage(index, HNSW_UPDATE_LOCK, lockmode);
+
+		/* Refresh entry point for each element */
+		entryPoint = HnswGetEntryPoint(index);
 
-			/* Create an element */
-			element = HnswInitElementFromBlock(blkno, offno);
-			HnswLoadElementFromTuple(element, etup, false, true);
+		/* Serialize with inserts when likely updating entry point */
+		if (entryPoint == NULL || element->level > entryPoint->level)
+		{
+			LockPage(index, HNSW_ENTRY_LOCK, ExclusiveLock);
+			entryLocked = true;
 
-			elements = lappend(elements, element);
+			/* Get latest entry point after lock is acquired */
+			entryPoint = HnswGetEntryPoint(index);
 		}
 
-		blkno = HnswPageGetOpaque(page)->nextblkno;
+		/* Repair connections */
+		RepairGraphElement(vacuumstate, element, entryPoint);
+
+		/*
+		 * Update metapage if needed. Should only happen if entry point was
+		 * replaced and highest point was outdated.
+		 */
+		if (entryPoint == NULL || element->level > entryPoint->level)
+			HnswUpdateMetaPage(index, HNSW_UPDATE_ENTRY_GREATER, element, InvalidBlockNumber, MAIN_FORKNUM, false);
+
+		/* Release locks */
+		if (entryLocked)
+			UnlockPage(index, HNSW_ENTRY_LOCK, ExclusiveLock);
+		UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
+	}
+
+	/* Reset memory context */
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextReset(vacuumstate->tmpCtx);
+}
+
+/*
+ * Add element pages added since heap TIDs were removed
+ */
+static void
+AddNewVacuumRanges(HnswVacuumState * vacuumstate)
+{
+	Relation	index = vacuumstate->index;
+	HnswVacuumRange *range = &vacuumstate->ranges[vacuumstate->nranges - 1];
+	BlockNumber blkno = range->start + range->count - 1;
+
+	for (;;)
+	{
+		Buffer		buf;
 
+		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, vacuumstate->bas);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		blkno = HnswPageGetOpaque(BufferGetPage(buf))->nextblkno;
 		UnlockReleaseBuffer(buf);
 
-		/* Update neighbor pages */
-		foreach(lc2, elements)
-		{
-			HnswElement element = (HnswElement) lfirst(lc2);
-			HnswElement entryPoint;
-			LOCKMODE	lockmode = ShareLock;
+		if (!BlockNumberIsValid(blkno))
+			break;
 
-			/* Check if any neighbors point to deleted values */
-			if (!NeedsUpdated(vacuumstate, element))
-				continue;
+		AddVacuumRange(vacuumstate, blkno);
+	}
+}
 
-			/* Get a shared lock */
-			LockPage(index, HNSW_UPDATE_LOCK, lockmode);
+/*
+ * Repair graph for elements on pages of ranges
+ */
+static void
+RepairGraphRanges(HnswVacuumState * vacuumstate, HnswVacuumRange * ranges, int nranges)
+{
+	HnswRangeReader reader;
+	Buffer		buf;
 
-			/* Refresh entry point for each element */
-			entryPoint = HnswGetEntryPoint(index);
+	BeginRangeReader(&reader, vacuumstate, ranges, nranges);
 
-			/* Prevent concurrent inserts when likely updating entry point */
-			if (entryPoint == NULL || element->level > entryPoint->level)
-			{
-				/* Release shared lock */
-				UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
+	while (BufferIsValid(buf = RangeReaderNext(&reader)))
+		RepairGraphPage(vacuumstate, buf);
 
-				/* Get exclusive lock */
-				lockmode = ExclusiveLock;
-				LockPage(index, HNSW_UPDATE_LOCK, lockmode);
+	EndRangeReader(&reader);
+}
 
-				/* Get latest entry point after lock is acquired */
-				entryPoint = HnswGetEntryPoint(index);
-			}
+/*
+ * Repair graph for elements on pages claimed from shared state
+ */
+static void
+RepairGraphChunks(HnswVacuumState * vacuumstate, HnswVacuumShared * hnswshared, HnswVacuumRange * chunks)
+{
+	for (;;)
+	{
+		HnswVacuumRange *chunk;
 
-			/* Repair connections */
-			RepairGraphElement(vacuumstate, element, entryPoint);
+		SpinLockAcquire(&hnswshared->mutex);
+		if (hnswshared->nextChunk < hnswshared->nchunks)
+			chunk = &chunks[hnswshared->nextChunk++];
+		else
+			chunk = NULL;
+		SpinLockRelease(&hnswshared->mutex);
 
-			/*
-			 * Update metapage if needed. Should only happen if entry point
-			 * was replaced and highest point was outdated.
-			 */
-			if (entryPoint == NULL || element->level > entryPoint->level)
-				HnswUpdateMetaPage(index, HNSW_UPDATE_ENTRY_GREATER, element, InvalidBlockNumber, MAIN_FORKNUM, false);
+		if (chunk == NULL)
+			break;
+
+		RepairGraphRanges(vacuumstate, chunk, 1);
+	}
+
+	/* Add counts for the leader to report */
+	SpinLockAcquire(&hnswshared->mutex);
+	hnswshared->localRepairs += vacuumstate->localRepairs;
+	hnswshared->searchRepairs += vacuumstate->searchRepairs;
+	SpinLockRelease(&hnswshared->mutex);
+}
 
-			/* Release lock */
-			UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
+/*
+ * Compute parallel workers
+ */
+static int
+ComputeVacuumWorkers(HnswVacuumState * vacuumstate)
+{
+#if PG_VERSION_NUM >= 130000
+	BlockNumber npages = 0;
+	BlockNumber threshold = Max(min_parallel_index_scan_size, 1);
+	int			parallel_workers = 0;
+
+	/* Parallel vacuum workers cannot launch workers */
+	if (IsInParallelMode() || max_parallel_maintenance_workers == 0)
+		return 0;
+
+	/* Same as parallel vacuum */
+#if PG_VERSION_NUM >= 170000
+	if (AmAutoVacuumWorkerProcess())
+#else
+	if (IsAutoVacuumWorkerProcess())
+#endif
+		return 0;
+
+	for (int i = 0; i < vacuumstate->nranges; i++)
+		npages += vacuumstate->ranges[i].count;
+
+	/* Same scaling as parallel scans */
+	while (npages >= threshold * 3 && parallel_workers < max_parallel_maintenance_workers)
+	{
+		parallel_workers++;
+		threshold *= 3;
+		if (threshold > MaxBlockNumber / 3)
+			break;
+	}
+
+	return parallel_workers;
+#else
+	/* Page locks do not conflict between workers before Postgres 13 */
+	return 0;
+#endif
+}
+
+/*
+ * Repair graph with parallel workers
+ *
+ * Returns false if workers could not be launched
+ */
+static bool
+ParallelRepairGraph(HnswVacuumState * vacuumstate, int request)
+{
+	ParallelContext *pcxt;
+	HnswVacuumShared *hnswshared;
+	HnswVacuumRange *chunks;
+	ItemPointerData *deleted;
+	tidhash_iterator iter;
+	TidHashEntry *entry;
+	int			nchunks = 0;
+	int			ndeleted = vacuumstate->deleted->members;
+	int			querylen;
+	int			i = 0;
+
+	for (int r = 0; r < vacuumstate->nranges; r++)
+		nchunks += (vacuumstate->ranges[r].count + HNSW_VACUUM_CHUNK_PAGES - 1) / HNSW_VACUUM_CHUNK_PAGES;
+
+	/* Enter parallel mode and create context */
+	EnterParallelMode();
+	pcxt = CreateParallelContext("vector", "HnswParallelVacuumMain", request);
+
+	shm_toc_estimate_chunk(&pcxt->estimator, sizeof(HnswVacuumShared));
+	shm_toc_estimate_chunk(&pcxt->estimator, mul_size(sizeof(HnswVacuumRange), nchunks));
+	shm_toc_estimate_chunk(&pcxt->estimator, mul_size(sizeof(ItemPointerData), ndeleted));
+	shm_toc_estimate_keys(&pcxt->estimator, 3);
+
+	/* Estimate space for query text */
+	if (debug_query_string)
+	{
+		querylen = strlen(debug_query_string);
+		shm_toc_estimate_chunk(&pcxt->estimator, querylen + 1);
+		shm_toc_estimate_keys(&pcxt->estimator, 1);
+	}
+	else
+		querylen = 0;			/* keep compiler quiet */
+
+	InitializeParallelDSM(pcxt);
+
+	/* If no DSM segment was available, back out */
+	if (pcxt->seg == NULL)
+	{
+		DestroyParallelContext(pcxt);
+		ExitParallelMode();
+		return false;
+	}
+
+	/* Store shared state */
+	hnswshared = (HnswVacuumShared *) shm_toc_allocate(pcxt->toc, sizeof(HnswVacuumShared));
+	hnswshared->indexrelid = RelationGetRelid(vacuumstate->index);
+	hnswshared->nchunks = nchunks;
+	hnswshared->ndeleted = ndeleted;
+	SpinLockInit(&hnswshared->mutex);
+	hnswshared->nextChunk = 0;
+	hnswshared->localRepairs = 0;
+	hnswshared->searchRepairs = 0;
+
+	/* Split ranges into chunks */
+	chunks = (HnswVacuumRange *) shm_toc_allocate(pcxt->toc, mul_size(sizeof(HnswVacuumRange), nchunks));
+	nchunks = 0;
+	for (int r = 0; r < vacuumstate->nranges; r++)
+	{
+		HnswVacuumRange *range = &vacuumstate->ranges[r];
+
+		for (BlockNumber j = 0; j < range->count; j += HNSW_VACUUM_CHUNK_PAGES)
+		{
+			chunks[nchunks].start = range->start + j;
+			chunks[nchunks].count = Min(HNSW_VACUUM_CHUNK_PAGES, range->count - j);
+			nchunks++;
 		}
+	}
+
+	/* Store deleted elements */
+	deleted = (ItemPointerData *) shm_toc_allocate(pcxt->toc, mul_size(sizeof(ItemPointerData), ndeleted));
+	tidhash_start_iterate(vacuumstate->deleted, &iter);
+	while ((entry = tidhash_iterate(vacuumstate->deleted, &iter)) != NULL)
+		deleted[i++] = entry->tid;
+
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_HNSW_VACUUM_SHARED, hnswshared);
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_HNSW_VACUUM_CHUNKS, chunks);
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_HNSW_VACUUM_DELETED, deleted);
+
+	/* Store query string for workers */
+	if (debug_query_string)
+	{
+		char	   *sharedquery;
 
-		/* Reset memory context */
-		MemoryContextSwitchTo(oldCtx);
-		MemoryContextReset(vacuumstate->tmpCtx);
+		sharedquery = (char *) shm_toc_allocate(pcxt->toc, querylen + 1);
+		memcpy(sharedquery, debug_query_string, querylen + 1);
+		shm_toc_insert(pcxt->toc, PARALLEL_KEY_HNSW_VACUUM_QUERY_TEXT, sharedquery);
 	}
+
+	LaunchParallelWorkers(pcxt);
+
+	/* If no workers were successfully launched, back out */
+	if (pcxt->nworkers_launched == 0)
+	{
+		WaitForParallelWorkersToFinish(pcxt);
+		DestroyParallelContext(pcxt);
+		ExitParallelMode();
+		return false;
+	}
+
+	/* Log participants */
+	ereport(DEBUG1, (errmsg("using %d parallel workers for hnsw vacuum", pcxt->nworkers_launched)));
+
+	/* Participate as a worker */
+	RepairGraphChunks(vacuumstate, hnswshared, chunks);
+
+	/* Shutdown worker processes */
+	WaitForParallelWorkersToFinish(pcxt);
+
+	/* Get counts from all participants */
+	vacuumstate->localRepairs = hnswshared->localRepairs;
+	vacuumstate->searchRepairs = hnswshared->searchRepairs;
+
+	DestroyParallelContext(pcxt);
+	ExitParallelMode();
+
+	return true;
+}
+
+/*
+ * Repair graph for all elements
+ */
+static void
+RepairGraph(HnswVacuumState * vacuumstate)
+{
+	Relation	index = vacuumstate->index;
+	int			parallel_workers;
+
+	/*
+	 * Wait for inserts to complete. Inserts before this point may have
+	 * neighbors about to be deleted. Inserts after this point will not.
+	 */
+	LockPage(index, HNSW_UPDATE_LOCK, ExclusiveLock);
+	UnlockPage(index, HNSW_UPDATE_LOCK, ExclusiveLock);
+
+	/* Include pages added by inserts since heap TIDs were removed */
+	AddNewVacuumRanges(vacuumstate);
+
+	/* Repair entry point first */
+	RepairGraphEntryPoint(vacuumstate);
+
+	/* Split pages between workers if the index is large enough */
+	parallel_workers = ComputeVacuumWorkers(vacuumstate);
+	if (parallel_workers <= 0 || !ParallelRepairGraph(vacuumstate, parallel_workers))
+		RepairGraphRanges(vacuumstate, vacuumstate->ranges, vacuumstate->nranges);
+
+	ereport(DEBUG1,
+			(errmsg("repaired " INT64_FORMAT " hnsw elements through deleted neighbors and " INT64_FORMAT " with search",
+					vacuumstate->localRepairs, vacuumstate->searchRepairs)));
 }
 
 /*
@@ -440,10 +1012,11 @@ RepairGraph(HnswVacuumState * vacuumstate)
 static void
 MarkDeleted(HnswVacuumState * vacuumstate)
 {
-	BlockNumber blkno = HNSW_HEAD_BLKNO;
 	BlockNumber insertPage = InvalidBlockNumber;
 	Relation	index = vacuumstate->index;
 	BufferAccessStrategy bas = vacuumstate->bas;
+	HnswRangeReader reader;
+	Buffer		buf;
 
 	/*
 	 * Wait for index scans to complete. Scans before this point may contain
@@ -453,18 +1026,21 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 	LockPage(index, HNSW_SCAN_LOCK, ExclusiveLock);
 	UnlockPage(index, HNSW_SCAN_LOCK, ExclusiveLock);
 
-	while (BlockNumberIsValid(blkno))
+	/* Deleted elements are on pages seen when removing heap TIDs */
+	BeginRangeReader(&reader, vacuumstate, vacuumstate->ranges, vacuumstate->nranges);
+
+	while (BufferIsValid(buf = RangeReaderNext(&reader)))
 	{
-		Buffer		buf;
+		BlockNumber blkno = BufferGetBlockNumber(buf);
 		Page		page;
 		GenericXLogState *state;
 		OffsetNumber offno;
 		OffsetNumber maxoffno;
+		bool		hasDeleted = false;
+		Size		freeSpace = 0;
 
 		vacuum_delay_point();
 
-		buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
-
 		/*
 		 * ambulkdelete cannot delete entries from pages that are pinned by
 		 * other backends
@@ -498,6 +1074,7 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 				if (!BlockNumberIsValid(insertPage))
 					insertPage = blkno;
 
+				hasDeleted = true;
 				continue;
 			}
 
@@ -524,8 +1101,12 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 			ntup = (HnswNeighborTuple) PageGetItem(npage, PageGetItemId(npage, neighborOffno));
 
 			/* Overwrite element */
+			/* Keep vector TID so vector tuple can be reused */
 			etup->deleted = 1;
-			MemSet(&etup->data, 0, VARSIZE_ANY(&etup->data));
+			if (HnswElementTupleIsQuantized(etup))
+				MemSet(HnswElementTupleGetCodes(etup), 0, ItemIdGetLength(PageGetItemId(page, offno)) - offsetof(HnswElementTupleData, data));
+			else if (!HnswElementTupleIsSplit(etup))
+				MemSet(&etup->data, 0, VARSIZE_ANY(&etup->data));
 
 			/* Overwrite neighbors */
 			for (int i = 0; i < ntup->count; i++)
@@ -545,29 +1126,39 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 			if (!BlockNumberIsValid(insertPage))
 				insertPage = blkno;
 
+			hasDeleted = true;
+
 			/* Prepare new xlog */
 			state = GenericXLogStart(index);
 			page = GenericXLogRegisterBuffer(state, buf, 0);
 		}
 
-		blkno = HnswPageGetOpaque(page)->nextblkno;
+		/* Inserts overwrite deleted elements */
+		if (hasDeleted)
+			freeSpace = HnswGetReusableSpace(page, blkno);
 
 		GenericXLogAbort(state);
 		UnlockReleaseBuffer(buf);
+
+		if (hasDeleted)
+			RecordPageWithFreeSpace(index, blkno, freeSpace);
 	}
 
+	EndRangeReader(&reader);
+
 	/* Update insert page last, after everything has been marked as deleted */
 	HnswUpdateMetaPage(index, 0, NULL, insertPage, MAIN_FORKNUM, false);
+
+	/* Make space visible to inserts */
+	FreeSpaceMapVacuum(index);
 }
 
 /*
  * Initialize the vacuum state
  */
 static void
-InitVacuumState(HnswVacuumState * vacuumstate, IndexVacuumInfo *info, IndexBulkDeleteResult *stats, IndexBulkDeleteCallback callback, void *callback_state)
+InitVacuumState(HnswVacuumState * vacuumstate, Relation index, IndexBulkDeleteResult *stats, IndexBulkDeleteCallback callback, void *callback_state)
 {
-	Relation	index = info->index;
-
 	if (stats == NULL)
 		stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
 
@@ -589,6 +1180,14 @@ InitVacuumState(HnswVacuumState * vacuumstate, IndexVacuumInfo *info, IndexBulkD
 
 	/* Create hash table */
 	vacuumstate->deleted = tidhash_create(CurrentMemoryContext, 256, NULL);
+
+	vacuumstate->localRepairs = 0;
+	vacuumstate->searchRepairs = 0;
+
+	/* Element pages are usually a few contiguous ranges */
+	vacuumstate->nranges = 0;
+	vacuumstate->maxranges = 16;
+	vacuumstate->ranges = palloc(sizeof(HnswVacuumRange) * vacuumstate->maxranges);
 }
 
 /*
@@ -600,9 +1199,54 @@ FreeVacuumState(HnswVacuumState * vacuumstate)
 	tidhash_destroy(vacuumstate->deleted);
 	FreeAccessStrategy(vacuumstate->bas);
 	pfree(vacuumstate->ntup);
+	pfree(vacuumstate->ranges);
 	MemoryContextDelete(vacuumstate->tmpCtx);
 }
 
+/*
+ * Perform work within a launched parallel process
+ */
+void
+HnswParallelVacuumMain(dsm_segment *seg, shm_toc *toc)
+{
+	char	   *sharedquery;
+	HnswVacuumShared *hnswshared;
+	HnswVacuumRange *chunks;
+	ItemPointerData *deleted;
+	HnswVacuumState vacuumstate;
+	Relation	indexRel;
+
+	/* Set debug_query_string for individual workers first */
+	sharedquery = shm_toc_lookup(toc, PARALLEL_KEY_HNSW_VACUUM_QUERY_TEXT, true);
+	debug_query_string = sharedquery;
+
+	/* Report the query string from leader */
+	pgstat_report_activity(STATE_RUNNING, debug_query_string);
+
+	/* Look up shared state */
+	hnswshared = shm_toc_lookup(toc, PARALLEL_KEY_HNSW_VACUUM_SHARED, false);
+	chunks = shm_toc_lookup(toc, PARALLEL_KEY_HNSW_VACUUM_CHUNKS, false);
+	deleted = shm_toc_lookup(toc, PARALLEL_KEY_HNSW_VACUUM_DELETED, false);
+
+	/* Open index using lock mode obtained by vacuum */
+	indexRel = index_open(hnswshared->indexrelid, RowExclusiveLock);
+
+	InitVacuumState(&vacuumstate, indexRel, NULL, NULL, NULL);
+
+	for (int i = 0; i < hnswshared->ndeleted; i++)
+	{
+		bool		found;
+
+		tidhash_insert(vacuumstate.deleted, deleted[i], &found);
+	}
+
+	RepairGraphChunks(&vacuumstate, hnswshared, chunks);
+
+	FreeVacuumState(&vacuumstate);
+
+	index_close(indexRel, RowExclusiveLock);
+}
+
 /*
  * Bulk delete tuples from the index
  */
@@ -612,16 +1256,20 @@ hnswbulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 {
 	HnswVacuumState vacuumstate;
 
-	InitVacuumState(&vacuumstate, info, stats, callback, callback_state);
+	InitVacuumState(&vacuumstate, info->index, stats, callback, callback_state);
 
 	/* Pass 1: Remove heap TIDs */
 	RemoveHeapTids(&vacuumstate);
 
-	/* Pass 2: Repair graph */
+	/*
+	 * Pass 2: Repair graph (always, since elements whose layer 0 is not full
+	 * are also repaired)
+	 */
 	RepairGraph(&vacuumstate);
 
-	/* Pass 3: Mark as deleted */
-	MarkDeleted(&vacuumstate);
+	/* Pass 3: Mark as deleted (nothing to mark if no elements are deleted) */
+	if (vacuumstate.deleted->members > 0)
+		MarkDeleted(&vacuumstate);
 
 	FreeVacuumState(&vacuumstate);
 
@@ -42,6 +42,9 @@
 #define PARALLEL_KEY_IVFFLAT_CENTERS	UINT64CONST(0xA000000000000003)
 #define PARALLEL_KEY_QUERY_TEXT			UINT64CONST(0xA000000000000004)
 
+PGDLLEXPORT Datum vector_l2_squared_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum vector_negative_inner_product(PG_FUNCTION_ARGS);
+
 /*
  * Add sample
  */
@@ -236,7 +239,7 @@ BuildCallback(Relation index, CALLBACK_ITEM_POINTER, Datum *values,
  * Get index tuple from sort state
  */
 static inline void
-GetNextTuple(Tuplesortstate *sortstate, TupleDesc tupdesc, TupleTableSlot *slot, IndexTuple *itup, int *list)
+GetNextTuple(Tuplesortstate *sortstate, TupleDesc tupdesc, TupleTableSlot *slot, IndexTuple *itup, int *list, IvfflatPQ pq, VectorArray centers)
 {
 	Datum		value;
 	bool		isnull;
@@ -246,9 +249,16 @@ GetNextTuple(Tuplesortstate *sortstate, TupleDesc tupdesc, TupleTableSlot *slot,
 		*list = DatumGetInt32(slot_getattr(slot, 1, &isnull));
 		value = slot_getattr(slot, 3, &isnull);
 
+		/* Store codes for the residual to the list center */
+		if (pq != NULL)
+			value = IvfflatPQEncodeValue(pq, value, PointerGetDatum(VectorArrayGet(centers, *list)));
+
 		/* Form the index tuple */
 		*itup = index_form_tuple(tupdesc, &value, &isnull);
 		(*itup)->t_tid = *((ItemPointer) DatumGetPointer(slot_getattr(slot, 2, &isnull)));
+
+		if (pq != NULL)
+			pfree(DatumGetPointer(value));
 	}
 	else
 		*list = -1;
@@ -271,7 +281,7 @@ InsertTuples(Relation index, IvfflatBuildState * buildstate, ForkNumber forkNum)
 
 	pgstat_progress_update_param(PROGRESS_CREATEIDX_TUPLES_TOTAL, buildstate->indtuples);
 
-	GetNextTuple(buildstate->sortstate, tupdesc, slot, &itup, &list);
+	GetNextTuple(buildstate->sortstate, tupdesc, slot, &itup, &list, buildstate->pq, buildstate->centers);
 
 	for (int i = 0; i < buildstate->centers->length; i++)
 	{
@@ -307,7 +317,7 @@ InsertTuples(Relation index, IvfflatBuildState * buildstate, ForkNumber forkNum)
 
 			pgstat_progress_update_param(PROGRESS_CREATEIDX_TUPLES_DONE, ++inserted);
 
-			GetNextTuple(buildstate->sortstate, tupdesc, slot, &itup, &list);
+			GetNextTuple(buildstate->sortstate, tupdesc, slot, &itup, &list, buildstate->pq, buildstate->centers);
 		}
 
 		insertPage = BufferGetBlockNumber(buf);
@@ -357,6 +367,37 @@ InitBuildState(IvfflatBuildState * buildstate, Relation heap, Relation index, In
 	if (buildstate->kmeansnormprocinfo != NULL && buildstate->dimensions == 1)
 		elog(ERROR, "dimensions must be greater than one for this opclass");
 
+	/* Product quantization stores codes for residuals to list centers */
+	buildstate->pq = NULL;
+	if (IvfflatGetQuantizer(index) == IVFFLAT_QUANTIZER_PQ)
+	{
+		int			m = IvfflatGetPqM(index);
+
+		if (IvfflatOptionalProcInfo(index, IVFFLAT_TYPE_INFO_PROC) != NULL)
+			elog(ERROR, "quantizer requires vector type for ivfflat index");
+
+		if (buildstate->procinfo->fn_addr != vector_l2_squared_distance && buildstate->procinfo->fn_addr != vector_negative_inner_product)
+			elog(ERROR, "quantizer requires L2, inner product, or cosine distance for ivfflat index");
+
+		/* Default to the most subvectors with at least four dimensions */
+		if (m == 0)
+		{
+			m = Max(buildstate->dimensions / 4, 1);
+			while (buildstate->dimensions % m != 0)
+				m--;
+		}
+
+		if (buildstate->dimensions % m != 0)
+			elog(ERROR, "dimensions must be divisible by pq_m");
+
+		buildstate->pq = IvfflatInitPQ(buildstate->dimensions, m);
+	}
+
+	/* Coarse lists group lists to find them without computing every distance */
+	buildstate->coarseLists = IvfflatGetCoarseLists(index);
+	if (buildstate->coarseLists >= buildstate->lists)
+		elog(ERROR, "coarse_lists must be less than lists");
+
 	/* Create tuple description for sorting */
 	buildstate->tupdesc = CreateTemplateTupleDesc(3);
 	TupleDescInitEntry(buildstate->tupdesc, (AttrNumber) 1, "list", INT4OID, -1, 0);
@@ -367,6 +408,13 @@ InitBuildState(IvfflatBuildState * buildstate, Relation heap, Relation index, In
 
 	buildstate->centers = VectorArrayInit(buildstate->lists, buildstate->dimensions, buildstate->typeInfo->itemSize(buildstate->dimensions));
 	buildstate->listInfo = palloc(sizeof(ListInfo) * buildstate->lists);
+	buildstate->coarseCenters = NULL;
+	buildstate->coarseCounts = NULL;
+	if (buildstate->coarseLists > 0)
+	{
+		buildstate->coarseCenters = VectorArrayInit(buildstate->coarseLists, buildstate->dimensions, buildstate->centers->itemsize);
+		buildstate->coarseCounts = palloc0(sizeof(int) * buildstate->coarseLists);
+	}
 
 	buildstate->tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
 											   "Ivfflat build temporary context",
@@ -390,6 +438,15 @@ FreeBuildState(IvfflatBuildState * buildstate)
 	VectorArrayFree(buildstate->centers);
 	pfree(buildstate->listInfo);
 
+	if (buildstate->pq != NULL)
+		pfree(buildstate->pq);
+
+	if (buildstate->coarseCenters != NULL)
+	{
+		VectorArrayFree(buildstate->coarseCenters);
+		pfree(buildstate->coarseCounts);
+	}
+
 #ifdef IVFFLAT_KMEANS_DEBUG
 	pfree(buildstate->listSums);
 	pfree(buildstate->listCounts);
@@ -398,6 +455,90 @@ FreeBuildState(IvfflatBuildState * buildstate)
 	MemoryContextDelete(buildstate->tmpCtx);
 }
 
+/*
+ * Cluster list centers into coarse lists
+ *
+ * Centers are reordered so the lists for each coarse list are consecutive
+ */
+static void
+ComputeCoarseCenters(IvfflatBuildState * buildstate)
+{
+	VectorArray centers = buildstate->centers;
+	VectorArray coarseCenters = buildstate->coarseCenters;
+	VectorArray sorted;
+	int		   *closest = palloc(sizeof(int) * centers->length);
+	int		   *offsets = palloc0(sizeof(int) * coarseCenters->maxlen);
+
+	IvfflatKmeans(buildstate->index, centers, coarseCenters, buildstate->typeInfo, 0);
+
+	/* Assign each list to the closest coarse center */
+	for (int i = 0; i < centers->length; i++)
+	{
+		Datum		center = PointerGetDatum(VectorArrayGet(centers, i));
+		double		minDistance = DBL_MAX;
+
+		closest[i] = 0;
+		for (int j = 0; j < coarseCenters->length; j++)
+		{
+			double		distance = DatumGetFloat8(FunctionCall2Coll(buildstate->procinfo, buildstate->collation, center, PointerGetDatum(VectorArrayGet(coarseCenters, j))));
+
+			if (distance < minDistance)
+			{
+				minDistance = distance;
+				closest[i] = j;
+			}
+		}
+
+		buildstate->coarseCounts[closest[i]]++;
+	}
+
+	for (int j = 1; j < coarseCenters->length; j++)
+		offsets[j] = offsets[j - 1] + buildstate->coarseCounts[j - 1];
+
+	/* Reorder centers */
+	sorted = VectorArrayInit(centers->maxlen, centers->dim, centers->itemsize);
+	for (int i = 0; i < centers->length; i++)
+		VectorArraySet(sorted, offsets[closest[i]]++, VectorArrayGet(centers, i));
+	sorted->length = centers->length;
+
+	for (int i = 0; i < centers->length; i++)
+		VectorArraySet(centers, i, VectorArrayGet(sorted, i));
+
+	VectorArrayFree(sorted);
+	pfree(closest);
+	pfree(offsets);
+}
+
+/*
+ * Refine centers with more batches of samples
+ *
+ * The first batch is used again so it counts towards the centers
+ */
+static void
+RefineCenters(IvfflatBuildState * buildstate, int batches)
+{
+	double	   *counts = palloc0(sizeof(double) * buildstate->centers->length);
+
+	ereport(DEBUG1,
+			(errmsg("using %d batches of %d samples for k-means", batches, buildstate->samples->maxlen)));
+
+	for (int i = 0; i < batches; i++)
+	{
+		/* Can take a while, so ensure we can interrupt */
+		CHECK_FOR_INTERRUPTS();
+
+		if (i > 0)
+		{
+			buildstate->samples->length = 0;
+			SampleRows(buildstate);
+		}
+
+		IvfflatKmeansRefine(buildstate->index, buildstate->samples, buildstate->centers, buildstate->typeInfo, counts);
+	}
+
+	pfree(counts);
+}
+
 /*
  * Compute centers
  */
@@ -405,6 +546,9 @@ static void
 ComputeCenters(IvfflatBuildState * buildstate)
 {
 	int			numSamples;
+	int			maxSamples;
+	int			batches = 1;
+	int			parallel_workers = 0;
 
 	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_IVFFLAT_PHASE_KMEANS);
 
@@ -418,8 +562,18 @@ ComputeCenters(IvfflatBuildState * buildstate)
 	if (buildstate->heap == NULL)
 		numSamples = 1;
 
+	/*
+	 * Use batches of samples that fit in maintenance_work_mem when possible,
+	 * refining centers with each batch after the first
+	 */
+	maxSamples = IvfflatKmeansMaxSamples(buildstate->index, buildstate->lists, buildstate->dimensions, buildstate->centers->itemsize);
+	if (numSamples > maxSamples && maxSamples >= buildstate->lists)
+	{
+		batches = (numSamples + maxSamples - 1) / maxSamples;
+		numSamples = maxSamples;
+	}
+
 	/* Sample rows */
-	/* TODO Ensure within maintenance_work_mem */
 	buildstate->samples = VectorArrayInit(numSamples, buildstate->dimensions, buildstate->centers->itemsize);
 	if (buildstate->heap != NULL)
 	{
@@ -434,8 +588,25 @@ ComputeCenters(IvfflatBuildState * buildstate)
 		}
 	}
 
+	/* Calculate parallel workers */
+	if (buildstate->heap != NULL)
+		parallel_workers = plan_create_index_workers(RelationGetRelid(buildstate->heap), RelationGetRelid(buildstate->index));
+
 	/* Calculate centers */
-	IvfflatBench("k-means", IvfflatKmeans(buildstate->index, buildstate->samples, buildstate->centers, buildstate->typeInfo));
+	IvfflatBench("k-means", IvfflatKmeans(buildstate->index, buildstate->samples, buildstate->centers, buildstate->typeInfo, parallel_workers));
+
+	/* Refine centers with more samples */
+	/* Stop if the table has no more rows than a single batch */
+	if (batches > 1 && buildstate->samples->length == buildstate->samples->maxlen)
+		IvfflatBench("k-means refinement", RefineCenters(buildstate, batches));
+
+	/* Calculate coarse centers */
+	if (buildstate->coarseLists > 0)
+		IvfflatBench("coarse k-means", ComputeCoarseCenters(buildstate));
+
+	/* Train product quantization on residuals */
+	if (buildstate->pq != NULL)
+		IvfflatBench("pq training", IvfflatPQTrain(buildstate->pq, buildstate->samples, buildstate->centers, buildstate->procinfo, buildstate->collation));
 
 	/* Free samples before we allocate more memory */
 	VectorArrayFree(buildstate->samples);
@@ -445,7 +616,7 @@ ComputeCenters(IvfflatBuildState * buildstate)
  * Create the metapage
  */
 static void
-CreateMetaPage(Relation index, int dimensions, int lists, ForkNumber forkNum)
+CreateMetaPage(Relation index, int dimensions, int lists, IvfflatPQ pq, ForkNumber forkNum)
 {
 	Buffer		buf;
 	Page		page;
@@ -461,6 +632,11 @@ CreateMetaPage(Relation index, int dimensions, int lists, ForkNumber forkNum)
 	metap->version = IVFFLAT_VERSION;
 	metap->dimensions = dimensions;
 	metap->lists = lists;
+	metap->quantizer = pq != NULL ? IVFFLAT_QUANTIZER_PQ : IVFFLAT_QUANTIZER_NONE;
+	metap->pqM = pq != NULL ? pq->m : 0;
+	metap->pqPage = InvalidBlockNumber;
+	metap->coarseLists = 0;
+	metap->coarsePage = InvalidBlockNumber;
 	((PageHeader) page)->pd_lower =
 		((char *) metap + sizeof(IvfflatMetaPageData)) - (char *) page;
 
@@ -517,6 +693,110 @@ CreateListPages(Relation index, VectorArray centers, int dimensions,
 	pfree(list);
 }
 
+/*
+ * Create product quantization pages
+ */
+static void
+CreatePQPages(Relation index, IvfflatPQ pq, ForkNumber forkNum)
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	float	   *params = pq->centroids;
+	Size		nparams = (Size) IVFFLAT_PQ_CENTROIDS * pq->dimensions;
+	BlockNumber pqPage;
+
+	buf = IvfflatNewBuffer(index, forkNum);
+	IvfflatInitRegisterPage(index, &buf, &page, &state);
+	pqPage = BufferGetBlockNumber(buf);
+
+	for (;;)
+	{
+		int			count = Min(nparams, IVFFLAT_PQ_PAGE_FLOATS);
+
+		memcpy(PageGetContents(page), params, count * sizeof(float));
+		((PageHeader) page)->pd_lower = (PageGetContents(page) + count * sizeof(float)) - (char *) page;
+		params += count;
+		nparams -= count;
+
+		if (nparams == 0)
+			break;
+
+		IvfflatAppendPage(index, &buf, &page, &state, forkNum);
+	}
+
+	IvfflatCommitBuffer(buf, state);
+
+	/* Update metapage */
+	buf = ReadBufferExtended(index, forkNum, IVFFLAT_METAPAGE_BLKNO, RBM_NORMAL, NULL);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	IvfflatPageGetMeta(page)->pqPage = pqPage;
+	IvfflatCommitBuffer(buf, state);
+}
+
+/*
+ * Create coarse list pages
+ */
+static void
+CreateCoarsePages(Relation index, VectorArray coarseCenters, int *coarseCounts, ListInfo * listInfo, ForkNumber forkNum)
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	Size		coarseSize;
+	IvfflatCoarseList coarse;
+	BlockNumber coarsePage;
+	int			firstList = 0;
+
+	coarseSize = MAXALIGN(IVFFLAT_COARSE_LIST_SIZE(coarseCenters->itemsize));
+	coarse = palloc0(coarseSize);
+
+	buf = IvfflatNewBuffer(index, forkNum);
+	IvfflatInitRegisterPage(index, &buf, &page, &state);
+	coarsePage = BufferGetBlockNumber(buf);
+
+	for (int i = 0; i < coarseCenters->length; i++)
+	{
+		/* Zero memory for each coarse list */
+		MemSet(coarse, 0, coarseSize);
+
+		/* Load coarse list */
+		if (coarseCounts[i] > 0)
+			coarse->firstList = listInfo[firstList];
+		else
+		{
+			coarse->firstList.blkno = InvalidBlockNumber;
+			coarse->firstList.offno = InvalidOffsetNumber;
+		}
+		coarse->listCount = coarseCounts[i];
+		memcpy(&coarse->center, VectorArrayGet(coarseCenters, i), VARSIZE_ANY(VectorArrayGet(coarseCenters, i)));
+		firstList += coarseCounts[i];
+
+		/* Ensure free space */
+		if (PageGetFreeSpace(page) < coarseSize)
+			IvfflatAppendPage(index, &buf, &page, &state, forkNum);
+
+		/* Add the item */
+		if (PageAddItem(page, (Item) coarse, coarseSize, InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+	}
+
+	IvfflatCommitBuffer(buf, state);
+
+	pfree(coarse);
+
+	/* Update metapage */
+	buf = ReadBufferExtended(index, forkNum, IVFFLAT_METAPAGE_BLKNO, RBM_NORMAL, NULL);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	IvfflatPageGetMeta(page)->coarseLists = coarseCenters->length;
+	IvfflatPageGetMeta(page)->coarsePage = coarsePage;
+	IvfflatCommitBuffer(buf, state);
+}
+
 #ifdef IVFFLAT_KMEANS_DEBUG
 /*
  * Print k-means metrics
@@ -1004,8 +1284,12 @@ BuildIndex(Relation heap, Relation index, IndexInfo *indexInfo,
 	ComputeCenters(buildstate);
 
 	/* Create pages */
-	CreateMetaPage(index, buildstate->dimensions, buildstate->lists, forkNum);
+	CreateMetaPage(index, buildstate->dimensions, buildstate->lists, buildstate->pq, forkNum);
 	CreateListPages(index, buildstate->centers, buildstate->dimensions, buildstate->lists, forkNum, &buildstate->listInfo);
+	if (buildstate->pq != NULL)
+		CreatePQPages(index, buildstate->pq, forkNum);
+	if (buildstate->coarseLists > 0)
+		CreateCoarsePages(index, buildstate->coarseCenters, buildstate->coarseCounts, buildstate->listInfo, forkNum);
 	CreateEntryPages(buildstate, forkNum);
 
 	/* Write WAL for initialization fork since GenericXLog functions do not */
@@ -16,8 +16,22 @@
 #endif
 
 int			ivfflat_probes;
+int			ivfflat_rerank_k;
+int			ivfflat_batch_size;
+int			ivfflat_coarse_probes;
+double		ivfflat_probe_ratio;
 static relopt_kind ivfflat_relopt_kind;
 
+/*
+ * Validate the quantizer option
+ */
+static void
+IvfflatValidateQuantizer(const char *value)
+{
+	if (value != NULL)
+		IvfflatParseQuantizer(value);
+}
+
 /*
  * Initialize index options and variables
  */
@@ -29,6 +43,24 @@ IvfflatInit(void)
 					  IVFFLAT_DEFAULT_LISTS, IVFFLAT_MIN_LISTS, IVFFLAT_MAX_LISTS
 #if PG_VERSION_NUM >= 130000
 					  ,AccessExclusiveLock
+#endif
+		);
+	add_string_reloption(ivfflat_relopt_kind, "quantizer", "Quantizer for list storage",
+						 NULL, IvfflatValidateQuantizer
+#if PG_VERSION_NUM >= 130000
+						 ,AccessExclusiveLock
+#endif
+		);
+	add_int_reloption(ivfflat_relopt_kind, "pq_m", "Number of subvectors for product quantization",
+					  IVFFLAT_DEFAULT_PQ_M, IVFFLAT_MIN_PQ_M, IVFFLAT_MAX_PQ_M
+#if PG_VERSION_NUM >= 130000
+					  ,AccessExclusiveLock
+#endif
+		);
+	add_int_reloption(ivfflat_relopt_kind, "coarse_lists", "Number of coarse lists for finding lists",
+					  IVFFLAT_DEFAULT_COARSE_LISTS, IVFFLAT_MIN_COARSE_LISTS, IVFFLAT_MAX_COARSE_LISTS
+#if PG_VERSION_NUM >= 130000
+					  ,AccessExclusiveLock
 #endif
 		);
 
@@ -36,6 +68,22 @@ IvfflatInit(void)
 							"Valid range is 1..lists.", &ivfflat_probes,
 							IVFFLAT_DEFAULT_PROBES, IVFFLAT_MIN_LISTS, IVFFLAT_MAX_LISTS, PGC_USERSET, 0, NULL, NULL, NULL);
 
+	DefineCustomIntVariable("ivfflat.rerank_k", "Sets the number of candidates to re-rank with exact distances for quantized indexes",
+							"0 disables re-ranking.", &ivfflat_rerank_k,
+							IVFFLAT_DEFAULT_RERANK_K, IVFFLAT_MIN_RERANK_K, IVFFLAT_MAX_RERANK_K, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("ivfflat.batch_size", "Sets the number of nearest items to keep for each pass over the probed lists",
+							"Another pass with twice as many items is made when more are needed.", &ivfflat_batch_size,
+							IVFFLAT_DEFAULT_BATCH_SIZE, IVFFLAT_MIN_BATCH_SIZE, IVFFLAT_MAX_BATCH_SIZE, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("ivfflat.coarse_probes", "Sets the number of coarse lists to search for indexes with coarse lists",
+							"More coarse lists are searched if needed to find probes lists.", &ivfflat_coarse_probes,
+							IVFFLAT_DEFAULT_COARSE_PROBES, IVFFLAT_MIN_LISTS, IVFFLAT_MAX_LISTS, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomRealVariable("ivfflat.probe_ratio", "Sets the maximum ratio of the distance to a probed list center to the distance to the nearest list center",
+							 "0 disables the limit. Not used with inner product.", &ivfflat_probe_ratio,
+							 IVFFLAT_DEFAULT_PROBE_RATIO, IVFFLAT_MIN_PROBE_RATIO, IVFFLAT_MAX_PROBE_RATIO, PGC_USERSET, 0, NULL, NULL, NULL);
+
 	MarkGUCPrefixReserved("ivfflat");
 }
 
@@ -130,6 +178,10 @@ ivfflatcostestimate(PlannerInfo *root, IndexPath *path, double loop_count,
 	if (ratio < costs.indexSelectivity)
 		costs.indexSelectivity = ratio;
 
+	/* Lists are divided among the leader and workers for parallel scans */
+	if (path->path.parallel_workers > 0)
+		costs.indexTotalCost /= path->path.parallel_workers + 1;
+
 	/* Use total cost since most work happens before first tuple is returned */
 	*indexStartupCost = costs.indexTotalCost;
 	*indexTotalCost = costs.indexTotalCost;
@@ -146,6 +198,9 @@ ivfflatoptions(Datum reloptions, bool validate)
 {
 	static const relopt_parse_elt tab[] = {
 		{"lists", RELOPT_TYPE_INT, offsetof(IvfflatOptions, lists)},
+		{"quantizer", RELOPT_TYPE_STRING, offsetof(IvfflatOptions, quantizer)},
+		{"pq_m", RELOPT_TYPE_INT, offsetof(IvfflatOptions, pqM)},
+		{"coarse_lists", RELOPT_TYPE_INT, offsetof(IvfflatOptions, coarseLists)},
 	};
 
 #if PG_VERSION_NUM >= 130000
@@ -203,7 +258,7 @@ ivfflathandler(PG_FUNCTION_ARGS)
 	amroutine->amstorage = false;
 	amroutine->amclusterable = false;
 	amroutine->ampredlocks = false;
-	amroutine->amcanparallel = false;
+	amroutine->amcanparallel = true;
 #if PG_VERSION_NUM >= 170000
 	amroutine->amcanbuildparallel = true;
 #endif
@@ -246,9 +301,9 @@ ivfflathandler(PG_FUNCTION_ARGS)
 	amroutine->amrestrpos = NULL;
 
 	/* Interface functions to support parallel index scans */
-	amroutine->amestimateparallelscan = NULL;
-	amroutine->aminitparallelscan = NULL;
-	amroutine->amparallelrescan = NULL;
+	amroutine->amestimateparallelscan = ivfflatestimateparallelscan;
+	amroutine->aminitparallelscan = ivfflatinitparallelscan;
+	amroutine->amparallelrescan = ivfflatparallelrescan;
 
 	PG_RETURN_POINTER(amroutine);
 }
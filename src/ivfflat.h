@@ -43,6 +43,42 @@
 #define IVFFLAT_MIN_LISTS		1
 #define IVFFLAT_MAX_LISTS		32768
 #define IVFFLAT_DEFAULT_PROBES	1
+#define IVFFLAT_DEFAULT_PQ_M	0
+#define IVFFLAT_MIN_PQ_M		0
+#define IVFFLAT_MAX_PQ_M		IVFFLAT_MAX_DIM
+#define IVFFLAT_DEFAULT_RERANK_K	100
+#define IVFFLAT_MIN_RERANK_K	0
+#define IVFFLAT_MAX_RERANK_K	10000
+#define IVFFLAT_DEFAULT_BATCH_SIZE	1000
+#define IVFFLAT_MIN_BATCH_SIZE	1
+#define IVFFLAT_MAX_BATCH_SIZE	1000000
+#define IVFFLAT_DEFAULT_COARSE_LISTS	0
+#define IVFFLAT_MIN_COARSE_LISTS	0
+#define IVFFLAT_MAX_COARSE_LISTS	IVFFLAT_MAX_LISTS
+#define IVFFLAT_DEFAULT_COARSE_PROBES	1
+#define IVFFLAT_DEFAULT_PROBE_RATIO	0
+#define IVFFLAT_MIN_PROBE_RATIO	0
+#define IVFFLAT_MAX_PROBE_RATIO	1000
+
+/* Quantizers */
+#define IVFFLAT_QUANTIZER_NONE	0
+#define IVFFLAT_QUANTIZER_PQ	1
+
+/* Product quantization uses 8-bit codes */
+#define IVFFLAT_PQ_CENTROIDS	256
+#define IVFFLAT_PQ_ITERATIONS	10
+#define IVFFLAT_PQ_MAX_SAMPLES	(IVFFLAT_PQ_CENTROIDS * 64)
+#define IVFFLAT_PQ_PAGE_FLOATS	((int) ((BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(IvfflatPageOpaqueData))) / sizeof(float)))
+
+/* Blocked k-means */
+#define IVFFLAT_KMEANS_TILE_SAMPLES	64
+#define IVFFLAT_KMEANS_TILE_BYTES	(256 * 1024)
+#define IVFFLAT_KMEANS_BATCH_SAMPLES	262144
+#define IVFFLAT_KMEANS_CHUNK_SAMPLES	(IVFFLAT_KMEANS_TILE_SAMPLES * 16)
+
+/* Rebalancing splits lists with more than twice the average tuples */
+#define IVFFLAT_REBALANCE_SPLIT_FACTOR	2
+#define IVFFLAT_REBALANCE_MAX_SAMPLES	10000
 
 /* Build phases */
 /* PROGRESS_CREATEIDX_SUBPHASE_INITIALIZE is 1 */
@@ -51,6 +87,7 @@
 #define PROGRESS_IVFFLAT_PHASE_LOAD		4
 
 #define IVFFLAT_LIST_SIZE(size)	(offsetof(IvfflatListData, center) + size)
+#define IVFFLAT_COARSE_LIST_SIZE(size)	(offsetof(IvfflatCoarseListData, center) + size)
 
 #define IvfflatPageGetOpaque(page)	((IvfflatPageOpaque) PageGetSpecialPointer(page))
 #define IvfflatPageGetMeta(page)	((IvfflatMetaPageData *) PageGetContents(page))
@@ -80,6 +117,10 @@
 
 /* Variables */
 extern int	ivfflat_probes;
+extern int	ivfflat_rerank_k;
+extern int	ivfflat_batch_size;
+extern int	ivfflat_coarse_probes;
+extern double ivfflat_probe_ratio;
 
 typedef struct VectorArrayData
 {
@@ -103,8 +144,21 @@ typedef struct IvfflatOptions
 {
 	int32		vl_len_;		/* varlena header (do not touch directly!) */
 	int			lists;			/* number of lists */
+	int			quantizer;		/* offset of quantizer string */
+	int			pqM;			/* number of subvectors */
+	int			coarseLists;	/* number of coarse lists */
 }			IvfflatOptions;
 
+typedef struct IvfflatPQData
+{
+	int			dimensions;
+	int			m;				/* number of subvectors */
+	int			dsub;			/* dimensions per subvector */
+	float	   *centroids;		/* m x IVFFLAT_PQ_CENTROIDS x dsub */
+}			IvfflatPQData;
+
+typedef IvfflatPQData * IvfflatPQ;
+
 typedef struct IvfflatSpool
 {
 	Tuplesortstate *sortstate;
@@ -149,6 +203,30 @@ typedef struct IvfflatLeader
 	char	   *ivfcenters;
 }			IvfflatLeader;
 
+typedef struct IvfflatKmeansShared
+{
+	/* Immutable state */
+	int			numSamples;
+	int			numCenters;
+	int			dimensions;
+	Size		itemsize;
+
+	/* Worker progress */
+	ConditionVariable startcv;
+	ConditionVariable donecv;
+
+	/* Mutex for mutable state */
+	slock_t		mutex;
+
+	/* Mutable state */
+	int			generation;
+	bool		finished;
+	int			nextSample;
+	int			endSample;
+	int			nparticipantsdone;
+	int			changes;
+}			IvfflatKmeansShared;
+
 typedef struct IvfflatTypeInfo
 {
 	int			maxDimensions;
@@ -184,6 +262,10 @@ typedef struct IvfflatBuildState
 	VectorArray samples;
 	VectorArray centers;
 	ListInfo   *listInfo;
+	IvfflatPQ	pq;
+	int			coarseLists;
+	VectorArray coarseCenters;
+	int		   *coarseCounts;
 
 #ifdef IVFFLAT_KMEANS_DEBUG
 	double		inertia;
@@ -214,6 +296,11 @@ typedef struct IvfflatMetaPageData
 	uint32		version;
 	uint16		dimensions;
 	uint16		lists;
+	uint16		quantizer;
+	uint16		pqM;
+	BlockNumber pqPage;
+	uint16		coarseLists;
+	BlockNumber coarsePage;
 }			IvfflatMetaPageData;
 
 typedef IvfflatMetaPageData * IvfflatMetaPage;
@@ -236,34 +323,91 @@ typedef struct IvfflatListData
 
 typedef IvfflatListData * IvfflatList;
 
+/* Lists for a coarse list are consecutive, starting at firstList */
+typedef struct IvfflatCoarseListData
+{
+	ListInfo	firstList;
+	int32		listCount;
+	Vector		center;
+}			IvfflatCoarseListData;
+
+typedef IvfflatCoarseListData * IvfflatCoarseList;
+
+typedef struct IvfflatCoarseItem
+{
+	ListInfo	firstList;
+	int			listCount;
+	double		distance;
+}			IvfflatCoarseItem;
+
 typedef struct IvfflatScanList
 {
 	pairingheap_node ph_node;
 	BlockNumber startPage;
+	ListInfo	listInfo;
 	double		distance;
 }			IvfflatScanList;
 
+typedef struct IvfflatParallelScanData
+{
+	slock_t		mutex;
+	int			nextList;
+}			IvfflatParallelScanData;
+
+typedef IvfflatParallelScanData * IvfflatParallelScan;
+
+typedef struct IvfflatScanItem
+{
+	pairingheap_node ph_node;
+	ItemPointerData heaptid;
+	double		distance;
+}			IvfflatScanItem;
+
+typedef struct IvfflatRerankItem
+{
+	ItemPointerData heaptid;
+	double		distance;
+}			IvfflatRerankItem;
+
 typedef struct IvfflatScanOpaqueData
 {
 	const		IvfflatTypeInfo *typeInfo;
 	int			probes;
 	int			dimensions;
 	bool		first;
+	Datum		value;
 
-	/* Sorting */
-	Tuplesortstate *sortstate;
-	TupleDesc	tupdesc;
-	TupleTableSlot *slot;
-	bool		isnull;
+	/* Items */
+	int			batchSize;
+	IvfflatScanItem *items;
+	IvfflatScanItem **sortedItems;
+	int			itemsLength;
+	int			itemIndex;
+	bool		exhausted;
+	pairingheap *itemQueue;
 
 	/* Support functions */
 	FmgrInfo   *procinfo;
 	FmgrInfo   *normprocinfo;
 	Oid			collation;
 	Datum		(*distfunc) (FmgrInfo *flinfo, Oid collation, Datum arg1, Datum arg2);
+	void		(*batchdistfunc) (int dim, float *q, float **x, int n, double *distances);
+
+	/* Product quantization */
+	IvfflatPQ	pq;
+	float	   *pqTable;
+	int			rerankK;
+	IvfflatRerankItem *rerankItems;
+	int			rerankLength;
+	int			rerankIndex;
 
 	/* Lists */
+	int			coarseLists;
+	BlockNumber coarsePage;
+	double		probeRatio;
+	double		(*centerdistfunc) (double distance);
 	pairingheap *listQueue;
+	int			listCount;
 	IvfflatScanList lists[FLEXIBLE_ARRAY_MEMBER];	/* must come last */
 }			IvfflatScanOpaqueData;
 
@@ -288,11 +432,16 @@ VectorArraySet(VectorArray arr, int offset, Pointer val)
 /* Methods */
 VectorArray VectorArrayInit(int maxlen, int dimensions, Size itemsize);
 void		VectorArrayFree(VectorArray arr);
-void		IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo);
+void		IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo, int parallelWorkers);
+int			IvfflatKmeansMaxSamples(Relation index, int numCenters, int dimensions, Size itemsize);
+void		IvfflatKmeansRefine(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo, double *counts);
 FmgrInfo   *IvfflatOptionalProcInfo(Relation index, uint16 procnum);
 Datum		IvfflatNormValue(const IvfflatTypeInfo * typeInfo, Oid collation, Datum value);
 bool		IvfflatCheckNorm(FmgrInfo *procinfo, Oid collation, Datum value);
 int			IvfflatGetLists(Relation index);
+int			IvfflatGetCoarseLists(Relation index);
+void		IvfflatGetCoarseInfo(Relation index, int *coarseLists, BlockNumber *coarsePage);
+IvfflatCoarseItem *IvfflatGetCoarseItems(Relation index, int coarseLists, BlockNumber coarsePage, FmgrInfo *procinfo, Oid collation, Datum value);
 void		IvfflatGetMetaPageInfo(Relation index, int *lists, int *dimensions);
 void		IvfflatUpdateList(Relation index, ListInfo listInfo, BlockNumber insertPage, BlockNumber originalInsertPage, BlockNumber startPage, ForkNumber forkNum);
 void		IvfflatCommitBuffer(Buffer buf, GenericXLogState *state);
@@ -302,7 +451,18 @@ void		IvfflatInitPage(Buffer buf, Page page);
 void		IvfflatInitRegisterPage(Relation index, Buffer *buf, Page *page, GenericXLogState **state);
 void		IvfflatInit(void);
 const		IvfflatTypeInfo *IvfflatGetTypeInfo(Relation index);
+int			IvfflatGetQuantizer(Relation index);
+int			IvfflatGetPqM(Relation index);
+int			IvfflatParseQuantizer(const char *value);
+IvfflatPQ	IvfflatInitPQ(int dimensions, int m);
+void		IvfflatPQTrain(IvfflatPQ pq, VectorArray samples, VectorArray centers, FmgrInfo *procinfo, Oid collation);
+void		IvfflatPQEncode(IvfflatPQ pq, Datum value, Datum center, uint8 *codes);
+Datum		IvfflatPQEncodeValue(IvfflatPQ pq, Datum value, Datum center);
+float		IvfflatPQComputeTable(IvfflatPQ pq, FmgrInfo *procinfo, Datum query, Datum center, float *table);
+float		IvfflatPQDistance(IvfflatPQ pq, float *table, uint8 *codes);
+IvfflatPQ	IvfflatGetPQ(Relation index);
 PGDLLEXPORT void IvfflatParallelBuildMain(dsm_segment *seg, shm_toc *toc);
+PGDLLEXPORT void IvfflatParallelKmeansMain(dsm_segment *seg, shm_toc *toc);
 
 /* Index access methods */
 IndexBuildResult *ivfflatbuild(Relation heap, Relation index, IndexInfo *indexInfo);
@@ -319,5 +479,12 @@ IndexScanDesc ivfflatbeginscan(Relation index, int nkeys, int norderbys);
 void		ivfflatrescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int norderbys);
 bool		ivfflatgettuple(IndexScanDesc scan, ScanDirection dir);
 void		ivfflatendscan(IndexScanDesc scan);
+#if PG_VERSION_NUM >= 170000
+Size		ivfflatestimateparallelscan(int nkeys, int norderbys);
+#else
+Size		ivfflatestimateparallelscan(void);
+#endif
+void		ivfflatinitparallelscan(void *target);
+void		ivfflatparallelrescan(IndexScanDesc scan);
 
 #endif
@@ -9,25 +9,15 @@
 #include "utils/memutils.h"
 
 /*
- * Find the list that minimizes the distance function
+ * Search count lists starting at start, or all lists if count is -1
  */
 static void
-FindInsertPage(Relation index, Datum *values, BlockNumber *insertPage, ListInfo * listInfo)
+SearchInsertLists(Relation index, Datum value, FmgrInfo *procinfo, Oid collation, ListInfo start, int count, double *minDistance, BlockNumber *insertPage, ListInfo * listInfo)
 {
-	double		minDistance = DBL_MAX;
-	BlockNumber nextblkno = IVFFLAT_HEAD_BLKNO;
-	FmgrInfo   *procinfo;
-	Oid			collation;
-
-	/* Avoid compiler warning */
-	listInfo->blkno = nextblkno;
-	listInfo->offno = FirstOffsetNumber;
-
-	procinfo = index_getprocinfo(index, 1, IVFFLAT_DISTANCE_PROC);
-	collation = index->rd_indcollation[0];
+	BlockNumber nextblkno = start.blkno;
+	OffsetNumber startoffno = start.offno;
 
-	/* Search all list pages */
-	while (BlockNumberIsValid(nextblkno))
+	while (BlockNumberIsValid(nextblkno) && count != 0)
 	{
 		Buffer		cbuf;
 		Page		cpage;
@@ -38,29 +28,95 @@ FindInsertPage(Relation index, Datum *values, BlockNumber *insertPage, ListInfo
 		cpage = BufferGetPage(cbuf);
 		maxoffno = PageGetMaxOffsetNumber(cpage);
 
-		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		for (OffsetNumber offno = startoffno; offno <= maxoffno && count != 0; offno = OffsetNumberNext(offno), count--)
 		{
 			IvfflatList list;
 			double		distance;
 
 			list = (IvfflatList) PageGetItem(cpage, PageGetItemId(cpage, offno));
-			distance = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, values[0], PointerGetDatum(&list->center)));
+			distance = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, value, PointerGetDatum(&list->center)));
 
-			if (distance < minDistance || !BlockNumberIsValid(*insertPage))
+			if (distance < *minDistance || !BlockNumberIsValid(*insertPage))
 			{
 				*insertPage = list->insertPage;
 				listInfo->blkno = nextblkno;
 				listInfo->offno = offno;
-				minDistance = distance;
+				*minDistance = distance;
 			}
 		}
 
 		nextblkno = IvfflatPageGetOpaque(cpage)->nextblkno;
+		startoffno = FirstOffsetNumber;
 
 		UnlockReleaseBuffer(cbuf);
 	}
 }
 
+/*
+ * Find the list that minimizes the distance function
+ */
+static void
+FindInsertPage(Relation index, Datum *values, int coarseLists, BlockNumber coarsePage, BlockNumber *insertPage, ListInfo * listInfo)
+{
+	double		minDistance = DBL_MAX;
+	FmgrInfo   *procinfo;
+	Oid			collation;
+
+	/* Avoid compiler warning */
+	listInfo->blkno = IVFFLAT_HEAD_BLKNO;
+	listInfo->offno = FirstOffsetNumber;
+
+	procinfo = index_getprocinfo(index, 1, IVFFLAT_DISTANCE_PROC);
+	collation = index->rd_indcollation[0];
+
+	if (coarseLists > 0)
+	{
+		IvfflatCoarseItem *items = IvfflatGetCoarseItems(index, coarseLists, coarsePage, procinfo, collation, values[0]);
+
+		/* Search nearest coarse lists, and more if needed to find a list */
+		for (int i = 0; i < coarseLists; i++)
+		{
+			if (i >= ivfflat_coarse_probes && BlockNumberIsValid(*insertPage))
+				break;
+
+			if (items[i].listCount > 0)
+				SearchInsertLists(index, values[0], procinfo, collation, items[i].firstList, items[i].listCount, &minDistance, insertPage, listInfo);
+		}
+
+		pfree(items);
+	}
+	else
+	{
+		ListInfo	head = {IVFFLAT_HEAD_BLKNO, FirstOffsetNumber};
+
+		/* Search all list pages */
+		SearchInsertLists(index, values[0], procinfo, collation, head, -1, &minDistance, insertPage, listInfo);
+	}
+}
+
+/*
+ * Encode the residual of a value to the center of a list
+ */
+static Datum
+EncodeValue(Relation index, IvfflatPQ pq, Datum value, ListInfo listInfo)
+{
+	Buffer		cbuf;
+	Page		cpage;
+	IvfflatList list;
+	Datum		codes;
+
+	cbuf = ReadBuffer(index, listInfo.blkno);
+	LockBuffer(cbuf, BUFFER_LOCK_SHARE);
+	cpage = BufferGetPage(cbuf);
+	list = (IvfflatList) PageGetItem(cpage, PageGetItemId(cpage, listInfo.offno));
+
+	codes = IvfflatPQEncodeValue(pq, value, PointerGetDatum(&list->center));
+
+	UnlockReleaseBuffer(cbuf);
+
+	return codes;
+}
+
 /*
  * Insert a tuple into the index
  */
@@ -78,6 +134,9 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid, R
 	BlockNumber insertPage = InvalidBlockNumber;
 	ListInfo	listInfo;
 	BlockNumber originalInsertPage;
+	IvfflatPQ	pq;
+	int			coarseLists;
+	BlockNumber coarsePage;
 
 	/* Detoast once for all calls */
 	value = PointerGetDatum(PG_DETOAST_DATUM(values[0]));
@@ -94,14 +153,19 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid, R
 		value = IvfflatNormValue(typeInfo, collation, value);
 	}
 
-	/* Ensure index is valid */
-	IvfflatGetMetaPageInfo(index, NULL, NULL);
+	/* Ensure index is valid and get coarse lists */
+	IvfflatGetCoarseInfo(index, &coarseLists, &coarsePage);
 
 	/* Find the insert page - sets the page and list info */
-	FindInsertPage(index, values, &insertPage, &listInfo);
+	FindInsertPage(index, values, coarseLists, coarsePage, &insertPage, &listInfo);
 	Assert(BlockNumberIsValid(insertPage));
 	originalInsertPage = insertPage;
 
+	/* Store codes for quantized indexes */
+	pq = IvfflatGetPQ(index);
+	if (pq != NULL)
+		value = EncodeValue(index, pq, value, listInfo);
+
 	/* Form tuple */
 	itup = index_form_tuple(RelationGetDescr(index), &value, isnull);
 	itup->t_tid = *heap_tid;
@@ -3,16 +3,39 @@
 #include <float.h>
 #include <math.h>
 
+#include "access/parallel.h"
 #include "bitvec.h"
 #include "halfutils.h"
 #include "halfvec.h"
 #include "ivfflat.h"
 #include "miscadmin.h"
+#include "storage/spin.h"
 #include "utils/builtins.h"
 #include "utils/datum.h"
 #include "utils/memutils.h"
 #include "vector.h"
 
+#if PG_VERSION_NUM >= 140000
+#include "utils/wait_event.h"
+#else
+#include "pgstat.h"
+#endif
+
+#if defined(USE_TARGET_CLONES) && !defined(__FMA__)
+#define IVFFLAT_TARGET_CLONES __attribute__((target_clones("default", "fma")))
+#else
+#define IVFFLAT_TARGET_CLONES
+#endif
+
+#define PARALLEL_KEY_KMEANS_SHARED		UINT64CONST(0xA000000000000011)
+#define PARALLEL_KEY_KMEANS_SAMPLES		UINT64CONST(0xA000000000000012)
+#define PARALLEL_KEY_KMEANS_CENTERS		UINT64CONST(0xA000000000000013)
+#define PARALLEL_KEY_KMEANS_BIAS		UINT64CONST(0xA000000000000014)
+#define PARALLEL_KEY_KMEANS_CLOSEST		UINT64CONST(0xA000000000000015)
+
+PGDLLEXPORT Datum l2_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum vector_spherical_distance(PG_FUNCTION_ARGS);
+
 /*
  * Initialize with kmeans++
  *
@@ -497,6 +520,717 @@ ElkanKmeans(Relation index, VectorArray samples, VectorArray centers, const Ivff
 	}
 }
 
+/*
+ * Compute the inner products between a tile of samples and a tile of centers
+ *
+ * Four centers are processed at once so each sample element is loaded once
+ * for all of them
+ */
+IVFFLAT_TARGET_CLONES static void
+TileInnerProducts(int dim, float **x, int nx, float **c, int nc, float *products)
+{
+	for (int i = 0; i < nx; i++)
+	{
+		float	   *xi = x[i];
+		int			j = 0;
+
+		for (; j + 4 <= nc; j += 4)
+		{
+			float	   *c0 = c[j];
+			float	   *c1 = c[j + 1];
+			float	   *c2 = c[j + 2];
+			float	   *c3 = c[j + 3];
+			float		d0 = 0.0;
+			float		d1 = 0.0;
+			float		d2 = 0.0;
+			float		d3 = 0.0;
+
+			/* Auto-vectorized */
+			for (int k = 0; k < dim; k++)
+			{
+				float		v = xi[k];
+
+				d0 += v * c0[k];
+				d1 += v * c1[k];
+				d2 += v * c2[k];
+				d3 += v * c3[k];
+			}
+
+			products[i * nc + j] = d0;
+			products[i * nc + j + 1] = d1;
+			products[i * nc + j + 2] = d2;
+			products[i * nc + j + 3] = d3;
+		}
+
+		for (; j < nc; j++)
+		{
+			float	   *cj = c[j];
+			float		d = 0.0;
+
+			/* Auto-vectorized */
+			for (int k = 0; k < dim; k++)
+				d += xi[k] * cj[k];
+
+			products[i * nc + j] = d;
+		}
+	}
+}
+
+/*
+ * Get the number of centers in a tile, so a tile fits in cache
+ */
+static int
+TileCenters(int dimensions)
+{
+	int			tileCenters = IVFFLAT_KMEANS_TILE_BYTES / (dimensions * sizeof(float));
+
+	/* Multiple of four for the inner product kernel */
+	return Max(tileCenters & ~3, 4);
+}
+
+/*
+ * Compute the part of the score that only depends on the center
+ *
+ * For L2 distance, ||x - c||^2 = ||x||^2 - 2 x.c + ||c||^2, so the closest
+ * center maximizes x.c - ||c||^2 / 2. For spherical distance, the closest
+ * center maximizes x.c.
+ */
+static void
+ComputeBias(VectorArray centers, bool spherical, float *bias)
+{
+	for (int j = 0; j < centers->length; j++)
+	{
+		Vector	   *c = (Vector *) VectorArrayGet(centers, j);
+		float		norm = 0.0;
+
+		if (!spherical)
+		{
+			for (int k = 0; k < c->dim; k++)
+				norm += c->x[k] * c->x[k];
+		}
+
+		bias[j] = 0.5 * norm;
+	}
+}
+
+/*
+ * Assign samples to the closest center a tile at a time
+ *
+ * Returns the number of samples whose center changed
+ */
+static int
+AssignSamples(VectorArray samples, int start, int end, VectorArray centers, float *bias, int *closestCenters, float *products)
+{
+	int			dimensions = centers->dim;
+	int			numCenters = centers->length;
+	int			tileCenters = TileCenters(dimensions);
+	float	   *x[IVFFLAT_KMEANS_TILE_SAMPLES];
+	float	  **c = palloc(tileCenters * sizeof(float *));
+	int			changes = 0;
+
+	for (int i = start; i < end; i += IVFFLAT_KMEANS_TILE_SAMPLES)
+	{
+		int			nx = Min(IVFFLAT_KMEANS_TILE_SAMPLES, end - i);
+		float		maxScores[IVFFLAT_KMEANS_TILE_SAMPLES];
+		int			closest[IVFFLAT_KMEANS_TILE_SAMPLES];
+
+		/* Can take a while, so ensure we can interrupt */
+		CHECK_FOR_INTERRUPTS();
+
+		for (int k = 0; k < nx; k++)
+		{
+			x[k] = ((Vector *) VectorArrayGet(samples, i + k))->x;
+			maxScores[k] = -FLT_MAX;
+			closest[k] = 0;
+		}
+
+		for (int j = 0; j < numCenters; j += tileCenters)
+		{
+			int			nc = Min(tileCenters, numCenters - j);
+
+			for (int l = 0; l < nc; l++)
+				c[l] = ((Vector *) VectorArrayGet(centers, j + l))->x;
+
+			TileInnerProducts(dimensions, x, nx, c, nc, products);
+
+			for (int k = 0; k < nx; k++)
+			{
+				for (int l = 0; l < nc; l++)
+				{
+					float		score = products[k * nc + l] - bias[j + l];
+
+					if (score > maxScores[k])
+					{
+						maxScores[k] = score;
+						closest[k] = j + l;
+					}
+				}
+			}
+		}
+
+		for (int k = 0; k < nx; k++)
+		{
+			if (closestCenters[i + k] != closest[k])
+			{
+				closestCenters[i + k] = closest[k];
+				changes++;
+			}
+		}
+	}
+
+	pfree(c);
+
+	return changes;
+}
+
+typedef struct IvfflatKmeansLeader
+{
+	ParallelContext *pcxt;
+	int			nparticipants;
+	IvfflatKmeansShared *shared;
+	VectorArrayData samples;
+	VectorArrayData centers;
+	float	   *bias;
+	int		   *closestCenters;
+}			IvfflatKmeansLeader;
+
+/*
+ * Set up the arrays in shared memory
+ */
+static void
+LookupSharedArrays(shm_toc *toc, IvfflatKmeansShared * shared, VectorArray samples, VectorArray centers, float **bias, int **closestCenters)
+{
+	samples->length = shared->numSamples;
+	samples->maxlen = shared->numSamples;
+	samples->dim = shared->dimensions;
+	samples->itemsize = shared->itemsize;
+	samples->items = shm_toc_lookup(toc, PARALLEL_KEY_KMEANS_SAMPLES, false);
+
+	centers->length = shared->numCenters;
+	centers->maxlen = shared->numCenters;
+	centers->dim = shared->dimensions;
+	centers->itemsize = shared->itemsize;
+	centers->items = shm_toc_lookup(toc, PARALLEL_KEY_KMEANS_CENTERS, false);
+
+	*bias = shm_toc_lookup(toc, PARALLEL_KEY_KMEANS_BIAS, false);
+	*closestCenters = shm_toc_lookup(toc, PARALLEL_KEY_KMEANS_CLOSEST, false);
+}
+
+/*
+ * Assign chunks of samples until none are left
+ */
+static void
+ParticipateAssign(IvfflatKmeansShared * shared, VectorArray samples, VectorArray centers, float *bias, int *closestCenters, float *products)
+{
+	int			changes = 0;
+
+	for (;;)
+	{
+		int			start;
+		int			end;
+
+		SpinLockAcquire(&shared->mutex);
+		start = shared->nextSample;
+		end = Min(start + IVFFLAT_KMEANS_CHUNK_SAMPLES, shared->endSample);
+		shared->nextSample = end;
+		SpinLockRelease(&shared->mutex);
+
+		if (start >= end)
+			break;
+
+		changes += AssignSamples(samples, start, end, centers, bias, closestCenters, products);
+	}
+
+	SpinLockAcquire(&shared->mutex);
+	shared->changes += changes;
+	shared->nparticipantsdone++;
+	SpinLockRelease(&shared->mutex);
+
+	ConditionVariableSignal(&shared->donecv);
+}
+
+/*
+ * Perform work within a launched parallel process
+ */
+void
+IvfflatParallelKmeansMain(dsm_segment *seg, shm_toc *toc)
+{
+	IvfflatKmeansShared *shared;
+	VectorArrayData samples;
+	VectorArrayData centers;
+	float	   *bias;
+	int		   *closestCenters;
+	float	   *products;
+	int			generation = 0;
+
+	/* Look up shared state */
+	shared = shm_toc_lookup(toc, PARALLEL_KEY_KMEANS_SHARED, false);
+	LookupSharedArrays(toc, shared, &samples, &centers, &bias, &closestCenters);
+
+	products = palloc(sizeof(float) * IVFFLAT_KMEANS_TILE_SAMPLES * TileCenters(shared->dimensions));
+
+	for (;;)
+	{
+		bool		finished = false;
+
+		/* Wait for the leader to start the next iteration */
+		for (;;)
+		{
+			SpinLockAcquire(&shared->mutex);
+			if (shared->generation != generation)
+			{
+				generation = shared->generation;
+				finished = shared->finished;
+				SpinLockRelease(&shared->mutex);
+				break;
+			}
+			SpinLockRelease(&shared->mutex);
+
+			ConditionVariableSleep(&shared->startcv, WAIT_EVENT_PARALLEL_CREATE_INDEX_SCAN);
+		}
+
+		ConditionVariableCancelSleep();
+
+		if (finished)
+			break;
+
+		ParticipateAssign(shared, &samples, &centers, bias, closestCenters, products);
+	}
+}
+
+/*
+ * Begin parallel k-means
+ *
+ * Returns NULL if no workers could be launched
+ */
+static IvfflatKmeansLeader *
+BeginParallelKmeans(VectorArray samples, VectorArray centers, int request)
+{
+	ParallelContext *pcxt;
+	IvfflatKmeansShared *shared;
+	IvfflatKmeansLeader *leader;
+	Size		estsamples = samples->itemsize * samples->length;
+	Size		estcenters = centers->itemsize * centers->maxlen;
+	Size		estbias = sizeof(float) * centers->maxlen;
+	Size		estclosest = sizeof(int) * samples->length;
+	char	   *sharedsamples;
+
+	/* Enter parallel mode and create context */
+	EnterParallelMode();
+	Assert(request > 0);
+	pcxt = CreateParallelContext("vector", "IvfflatParallelKmeansMain", request);
+
+	/* Estimate size of workspaces */
+	shm_toc_estimate_chunk(&pcxt->estimator, sizeof(IvfflatKmeansShared));
+	shm_toc_estimate_chunk(&pcxt->estimator, estsamples);
+	shm_toc_estimate_chunk(&pcxt->estimator, estcenters);
+	shm_toc_estimate_chunk(&pcxt->estimator, estbias);
+	shm_toc_estimate_chunk(&pcxt->estimator, estclosest);
+	shm_toc_estimate_keys(&pcxt->estimator, 5);
+
+	/* Everyone's had a chance to ask for space, so now create the DSM */
+	InitializeParallelDSM(pcxt);
+
+	/* If no DSM segment was available, back out (do serial k-means) */
+	if (pcxt->seg == NULL)
+	{
+		DestroyParallelContext(pcxt);
+		ExitParallelMode();
+		return NULL;
+	}
+
+	/* Store shared state */
+	shared = (IvfflatKmeansShared *) shm_toc_allocate(pcxt->toc, sizeof(IvfflatKmeansShared));
+	/* Initialize immutable state */
+	shared->numSamples = samples->length;
+	shared->numCenters = centers->maxlen;
+	shared->dimensions = centers->dim;
+	shared->itemsize = centers->itemsize;
+	ConditionVariableInit(&shared->startcv);
+	ConditionVariableInit(&shared->donecv);
+	SpinLockInit(&shared->mutex);
+	/* Initialize mutable state */
+	shared->generation = 0;
+	shared->finished = false;
+	shared->nextSample = 0;
+	shared->endSample = 0;
+	shared->nparticipantsdone = 0;
+	shared->changes = 0;
+
+	sharedsamples = shm_toc_allocate(pcxt->toc, estsamples);
+	memcpy(sharedsamples, samples->items, estsamples);
+
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_KMEANS_SHARED, shared);
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_KMEANS_SAMPLES, sharedsamples);
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_KMEANS_CENTERS, shm_toc_allocate(pcxt->toc, estcenters));
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_KMEANS_BIAS, shm_toc_allocate(pcxt->toc, estbias));
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_KMEANS_CLOSEST, shm_toc_allocate(pcxt->toc, estclosest));
+
+	/* Launch workers */
+	LaunchParallelWorkers(pcxt);
+
+	/* If no workers were successfully launched, back out (do serial k-means) */
+	if (pcxt->nworkers_launched == 0)
+	{
+		WaitForParallelWorkersToFinish(pcxt);
+		DestroyParallelContext(pcxt);
+		ExitParallelMode();
+		return NULL;
+	}
+
+	/* Log participants */
+	ereport(DEBUG1, (errmsg("using %d parallel workers for k-means", pcxt->nworkers_launched)));
+
+	leader = (IvfflatKmeansLeader *) palloc0(sizeof(IvfflatKmeansLeader));
+	leader->pcxt = pcxt;
+	leader->nparticipants = pcxt->nworkers_launched + 1;
+	leader->shared = shared;
+	LookupSharedArrays(pcxt->toc, shared, &leader->samples, &leader->centers, &leader->bias, &leader->closestCenters);
+
+	/* Wait for all launched workers */
+	WaitForParallelWorkersToAttach(pcxt);
+
+	return leader;
+}
+
+/*
+ * End parallel k-means
+ */
+static void
+EndParallelKmeans(IvfflatKmeansLeader * leader)
+{
+	IvfflatKmeansShared *shared = leader->shared;
+
+	/* Tell workers to exit */
+	SpinLockAcquire(&shared->mutex);
+	shared->finished = true;
+	shared->generation++;
+	SpinLockRelease(&shared->mutex);
+
+	ConditionVariableBroadcast(&shared->startcv);
+
+	/* Shutdown worker processes */
+	WaitForParallelWorkersToFinish(leader->pcxt);
+	DestroyParallelContext(leader->pcxt);
+	ExitParallelMode();
+}
+
+/*
+ * Assign samples to the closest center with the leader and workers
+ */
+static int
+AssignSamplesParallel(IvfflatKmeansLeader * leader, int start, int end, VectorArray centers, float *bias, float *products)
+{
+	IvfflatKmeansShared *shared = leader->shared;
+	int			changes;
+
+	/* Publish centers for this iteration */
+	memcpy(leader->centers.items, centers->items, centers->itemsize * centers->length);
+	memcpy(leader->bias, bias, sizeof(float) * centers->length);
+
+	SpinLockAcquire(&shared->mutex);
+	shared->nextSample = start;
+	shared->endSample = end;
+	shared->nparticipantsdone = 0;
+	shared->changes = 0;
+	shared->generation++;
+	SpinLockRelease(&shared->mutex);
+
+	ConditionVariableBroadcast(&shared->startcv);
+
+	/* Join ourselves */
+	ParticipateAssign(shared, &leader->samples, &leader->centers, leader->bias, leader->closestCenters, products);
+
+	/* Wait for workers */
+	for (;;)
+	{
+		SpinLockAcquire(&shared->mutex);
+		if (shared->nparticipantsdone == leader->nparticipants)
+		{
+			changes = shared->changes;
+			SpinLockRelease(&shared->mutex);
+			break;
+		}
+		SpinLockRelease(&shared->mutex);
+
+		ConditionVariableSleep(&shared->donecv, WAIT_EVENT_PARALLEL_CREATE_INDEX_SCAN);
+	}
+
+	ConditionVariableCancelSleep();
+
+	return changes;
+}
+
+/*
+ * Initialize with kmeans++ using inner products
+ */
+static void
+InitCentersBlocked(VectorArray samples, VectorArray centers, bool spherical, float *sampleNorms, float *products)
+{
+	int			dimensions = centers->dim;
+	int			numCenters = centers->maxlen;
+	int			numSamples = samples->length;
+	float	   *weight = palloc(numSamples * sizeof(float));
+	float	   *x[IVFFLAT_KMEANS_TILE_SAMPLES];
+
+	/* Choose an initial center uniformly at random */
+	VectorArraySet(centers, 0, VectorArrayGet(samples, RandomInt() % samples->length));
+	centers->length++;
+
+	for (int j = 0; j < numSamples; j++)
+		weight[j] = FLT_MAX;
+
+	for (int i = 0; i + 1 < numCenters; i++)
+	{
+		float	   *c = ((Vector *) VectorArrayGet(centers, i))->x;
+		float		norm = 0.0;
+		double		sum = 0.0;
+		double		choice;
+		int			j;
+
+		for (int k = 0; k < dimensions; k++)
+			norm += c[k] * c[k];
+
+		for (j = 0; j < numSamples; j += IVFFLAT_KMEANS_TILE_SAMPLES)
+		{
+			int			nx = Min(IVFFLAT_KMEANS_TILE_SAMPLES, numSamples - j);
+
+			/* Can take a while, so ensure we can interrupt */
+			CHECK_FOR_INTERRUPTS();
+
+			for (int k = 0; k < nx; k++)
+				x[k] = ((Vector *) VectorArrayGet(samples, j + k))->x;
+
+			TileInnerProducts(dimensions, x, nx, &c, 1, products);
+
+			for (int k = 0; k < nx; k++)
+			{
+				float		distance;
+
+				/* Use distance squared for weighted probability distribution */
+				if (spherical)
+				{
+					double		product = products[k];
+
+					/* Prevent NaN with acos with loss of precision */
+					if (product > 1)
+						product = 1;
+					else if (product < -1)
+						product = -1;
+
+					distance = acos(product) / M_PI;
+					distance *= distance;
+				}
+				else
+				{
+					distance = sampleNorms[j + k] - 2 * products[k] + norm;
+					if (distance < 0)
+						distance = 0;
+				}
+
+				if (distance < weight[j + k])
+					weight[j + k] = distance;
+
+				sum += weight[j + k];
+			}
+		}
+
+		/* Choose new center using weighted probability distribution. */
+		choice = sum * RandomDouble();
+		for (j = 0; j < numSamples - 1; j++)
+		{
+			choice -= weight[j];
+			if (choice <= 0)
+				break;
+		}
+
+		VectorArraySet(centers, i + 1, VectorArrayGet(samples, j));
+		centers->length++;
+	}
+
+	pfree(weight);
+}
+
+/*
+ * Update centers with a mini-batch, using a learning rate of one over the
+ * number of samples assigned to each center so far
+ */
+static void
+UpdateCentersMiniBatch(VectorArray samples, int start, int end, float *agg, VectorArray centers, int *centerCounts, double *totalCounts, int *closestCenters)
+{
+	int			dimensions = centers->dim;
+
+	MemSet(agg, 0, sizeof(float) * (int64) centers->length * dimensions);
+	MemSet(centerCounts, 0, sizeof(int) * centers->length);
+
+	for (int i = start; i < end; i++)
+	{
+		Vector	   *vec = (Vector *) VectorArrayGet(samples, i);
+		float	   *x = agg + ((int64) closestCenters[i] * dimensions);
+
+		for (int k = 0; k < dimensions; k++)
+			x[k] += vec->x[k];
+
+		centerCounts[closestCenters[i]]++;
+	}
+
+	for (int j = 0; j < centers->length; j++)
+	{
+		Vector	   *c = (Vector *) VectorArrayGet(centers, j);
+		float	   *x = agg + ((int64) j * dimensions);
+
+		/* Keep previous center if empty */
+		if (centerCounts[j] == 0)
+			continue;
+
+		totalCounts[j] += centerCounts[j];
+
+		/* Same as moving the center towards each sample in turn */
+		for (int k = 0; k < dimensions; k++)
+			c->x[k] += (x[k] - centerCounts[j] * c->x[k]) / totalCounts[j];
+	}
+}
+
+/*
+ * Use Lloyd's algorithm with inner products computed in tiles
+ *
+ * Unlike Elkan's algorithm, this does not need bounds for each sample and
+ * center, so memory is linear in the number of samples. Large samples use
+ * mini-batches.
+ *
+ * https://www.eecs.tufts.edu/~dsculley/papers/fastkmeans.pdf
+ */
+static void
+BlockedKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo, bool spherical, int parallelWorkers)
+{
+	IvfflatKmeansLeader *leader = NULL;
+	FmgrInfo   *normprocinfo;
+	Oid			collation;
+	int			dimensions = centers->dim;
+	int			numCenters = centers->maxlen;
+	int			numSamples = samples->length;
+	int			batchSamples = Min(numSamples, IVFFLAT_KMEANS_BATCH_SAMPLES);
+	int			tileCenters = TileCenters(dimensions);
+	float	   *agg;
+	int		   *centerCounts;
+	int		   *closestCenters;
+	float	   *sampleNorms;
+	float	   *bias;
+	float	   *products;
+	double	   *totalCounts;
+	int			start = 0;
+	int			changes = 0;
+
+	/* Calculate allocation sizes */
+	Size		samplesSize = VECTOR_ARRAY_SIZE(samples->maxlen, samples->itemsize);
+	Size		centersSize = VECTOR_ARRAY_SIZE(centers->maxlen, centers->itemsize);
+	Size		aggSize = sizeof(float) * (int64) numCenters * dimensions;
+	Size		centerCountsSize = sizeof(int) * numCenters;
+	Size		closestCentersSize = sizeof(int) * numSamples;
+	Size		sampleNormsSize = sizeof(float) * numSamples;
+	Size		biasSize = sizeof(float) * numCenters;
+	Size		productsSize = sizeof(float) * IVFFLAT_KMEANS_TILE_SAMPLES * tileCenters;
+	Size		totalCountsSize = sizeof(double) * numCenters;
+
+	/* Calculate total size */
+	Size		totalSize = samplesSize + centersSize + aggSize + centerCountsSize + closestCentersSize + sampleNormsSize + biasSize + productsSize + totalCountsSize;
+
+	/* Check memory requirements */
+	/* Add one to error message to ceil */
+	if (totalSize > (Size) maintenance_work_mem * 1024L)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("memory required is %zu MB, maintenance_work_mem is %d MB",
+						totalSize / (1024 * 1024) + 1, maintenance_work_mem / 1024)));
+
+	/* Set support functions */
+	normprocinfo = IvfflatOptionalProcInfo(index, IVFFLAT_KMEANS_NORM_PROC);
+	collation = index->rd_indcollation[0];
+
+	/* Allocate space */
+	agg = palloc(aggSize);
+	centerCounts = palloc(centerCountsSize);
+	sampleNorms = palloc(sampleNormsSize);
+	bias = palloc(biasSize);
+	products = palloc(productsSize);
+	totalCounts = palloc0(totalCountsSize);
+
+	/* Share the assignment step with parallel workers */
+	if (parallelWorkers > 0 && numSamples > IVFFLAT_KMEANS_CHUNK_SAMPLES)
+		leader = BeginParallelKmeans(samples, centers, parallelWorkers);
+
+	/* Assignments are in shared memory for parallel k-means */
+	if (leader != NULL)
+		closestCenters = leader->closestCenters;
+	else
+		closestCenters = palloc(closestCentersSize);
+
+#ifdef IVFFLAT_MEMORY
+	ShowMemoryUsage(MemoryContextGetParent(CurrentMemoryContext), totalSize);
+#endif
+
+	for (int j = 0; j < numSamples; j++)
+	{
+		Vector	   *vec = (Vector *) VectorArrayGet(samples, j);
+		float		norm = 0.0;
+
+		for (int k = 0; k < dimensions; k++)
+			norm += vec->x[k] * vec->x[k];
+
+		sampleNorms[j] = norm;
+
+		/* No center yet */
+		closestCenters[j] = -1;
+	}
+
+	/* Pick initial centers */
+	InitCentersBlocked(samples, centers, spherical, sampleNorms, products);
+
+	/* Give 500 iterations to converge */
+	for (int iteration = 0; iteration < 500; iteration++)
+	{
+		int			end = Min(start + batchSamples, numSamples);
+
+		ComputeBias(centers, spherical, bias);
+		if (leader != NULL)
+			changes += AssignSamplesParallel(leader, start, end, centers, bias, products);
+		else
+			changes += AssignSamples(samples, start, end, centers, bias, closestCenters, products);
+
+		if (batchSamples == numSamples)
+		{
+			/* Centers are already the means of the samples assigned */
+			if (changes == 0)
+				break;
+
+			ComputeNewCenters(samples, agg, centers, centerCounts, closestCenters, normprocinfo, collation, typeInfo);
+			changes = 0;
+		}
+		else
+		{
+			UpdateCentersMiniBatch(samples, start, end, agg, centers, centerCounts, totalCounts, closestCenters);
+
+			/* Normalize if needed */
+			if (normprocinfo != NULL)
+				NormCenters(typeInfo, collation, centers);
+
+			/* Stop after a full pass with no changes */
+			start = end;
+			if (start == numSamples)
+			{
+				if (changes == 0)
+					break;
+
+				start = 0;
+				changes = 0;
+			}
+		}
+	}
+
+	if (leader != NULL)
+		EndParallelKmeans(leader);
+}
+
 /*
  * Ensure no NaN or infinite values
  */
@@ -559,12 +1293,23 @@ CheckCenters(Relation index, VectorArray centers, const IvfflatTypeInfo * typeIn
 	CheckNorms(centers, index);
 }
 
+/*
+ * Check if blocked k-means can be used
+ *
+ * Distances for vector can be computed from inner products in tiles
+ */
+static bool
+UseBlockedKmeans(FmgrInfo *procinfo)
+{
+	return procinfo->fn_addr == l2_distance || procinfo->fn_addr == vector_spherical_distance;
+}
+
 /*
  * Perform naive k-means centering
  * We use spherical k-means for inner product and cosine
  */
 void
-IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo)
+IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo, int parallelWorkers)
 {
 	MemoryContext kmeansCtx = AllocSetContextCreate(CurrentMemoryContext,
 													"Ivfflat kmeans temporary context",
@@ -574,7 +1319,80 @@ IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const Iv
 	if (samples->length == 0)
 		RandomCenters(index, centers, typeInfo);
 	else
-		ElkanKmeans(index, samples, centers, typeInfo);
+	{
+		FmgrInfo   *procinfo = index_getprocinfo(index, 1, IVFFLAT_KMEANS_DISTANCE_PROC);
+
+		if (UseBlockedKmeans(procinfo))
+			BlockedKmeans(index, samples, centers, typeInfo, procinfo->fn_addr == vector_spherical_distance, parallelWorkers);
+		else
+			ElkanKmeans(index, samples, centers, typeInfo);
+	}
+
+	CheckCenters(index, centers, typeInfo);
+
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextDelete(kmeansCtx);
+}
+
+/*
+ * Get the max number of samples for k-means that fit in maintenance_work_mem,
+ * or -1 if centers cannot be refined with more samples
+ */
+int
+IvfflatKmeansMaxSamples(Relation index, int numCenters, int dimensions, Size itemsize)
+{
+	FmgrInfo   *procinfo = index_getprocinfo(index, 1, IVFFLAT_KMEANS_DISTANCE_PROC);
+	Size		memory = (Size) maintenance_work_mem * 1024L;
+	Size		fixedSize;
+	Size		sampleSize;
+
+	if (!UseBlockedKmeans(procinfo))
+		return -1;
+
+	/* Same allocations as BlockedKmeans */
+	fixedSize = VECTOR_ARRAY_SIZE(0, itemsize) + VECTOR_ARRAY_SIZE(numCenters, itemsize) + sizeof(float) * (int64) numCenters * dimensions + (sizeof(int) + sizeof(float) + sizeof(double)) * numCenters + sizeof(float) * IVFFLAT_KMEANS_TILE_SAMPLES * TileCenters(dimensions);
+	sampleSize = MAXALIGN(itemsize) + sizeof(int) + sizeof(float);
+
+	if (fixedSize >= memory)
+		return -1;
+
+	return (int) Min((memory - fixedSize) / sampleSize, INT_MAX);
+}
+
+/*
+ * Refine centers with another batch of samples
+ *
+ * Counts are the number of samples assigned to each center so far, so each
+ * center moves to the mean of all samples assigned to it across batches
+ */
+void
+IvfflatKmeansRefine(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo, double *counts)
+{
+	MemoryContext kmeansCtx = AllocSetContextCreate(CurrentMemoryContext,
+													"Ivfflat kmeans temporary context",
+													ALLOCSET_DEFAULT_SIZES);
+	MemoryContext oldCtx = MemoryContextSwitchTo(kmeansCtx);
+	FmgrInfo   *procinfo = index_getprocinfo(index, 1, IVFFLAT_KMEANS_DISTANCE_PROC);
+	FmgrInfo   *normprocinfo = IvfflatOptionalProcInfo(index, IVFFLAT_KMEANS_NORM_PROC);
+	int			dimensions = centers->dim;
+	float	   *agg = palloc(sizeof(float) * (int64) centers->length * dimensions);
+	int		   *centerCounts = palloc(sizeof(int) * centers->length);
+	int		   *closestCenters = palloc(sizeof(int) * samples->length);
+	float	   *bias = palloc(sizeof(float) * centers->length);
+	float	   *products = palloc(sizeof(float) * IVFFLAT_KMEANS_TILE_SAMPLES * TileCenters(dimensions));
+
+	Assert(UseBlockedKmeans(procinfo));
+
+	for (int j = 0; j < samples->length; j++)
+		closestCenters[j] = -1;
+
+	ComputeBias(centers, procinfo->fn_addr == vector_spherical_distance, bias);
+	AssignSamples(samples, 0, samples->length, centers, bias, closestCenters, products);
+	UpdateCentersMiniBatch(samples, 0, samples->length, agg, centers, centerCounts, counts, closestCenters);
+
+	/* Normalize if needed */
+	if (normprocinfo != NULL)
+		NormCenters(typeInfo, index->rd_indcollation[0], centers);
 
 	CheckCenters(index, centers, typeInfo);
 
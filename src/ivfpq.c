@@ -0,0 +1,381 @@
+#include "postgres.h"
+
+#include <float.h>
+
+#include "fmgr.h"
+#include "ivfflat.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "utils/rel.h"
+#include "vector.h"
+
+PGDLLEXPORT Datum vector_l2_squared_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum vector_negative_inner_product(PG_FUNCTION_ARGS);
+
+/*
+ * Parse the quantizer option
+ */
+int
+IvfflatParseQuantizer(const char *value)
+{
+	if (value == NULL || strcmp(value, "none") == 0)
+		return IVFFLAT_QUANTIZER_NONE;
+
+	if (strcmp(value, "pq") == 0)
+		return IVFFLAT_QUANTIZER_PQ;
+
+	ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("invalid value for quantizer option: \"%s\"", value),
+			 errdetail("Valid values are \"none\" and \"pq\".")));
+
+	return IVFFLAT_QUANTIZER_NONE;
+}
+
+/*
+ * Allocate product quantization params
+ *
+ * Centroids are stored in a single chunk so they can be written to and read
+ * from pages as is
+ */
+static IvfflatPQ
+IvfflatAllocPQ(MemoryContext ctx, int dimensions, int m)
+{
+	Size		headerSize = MAXALIGN(sizeof(IvfflatPQData));
+	IvfflatPQ	pq;
+
+	pq = MemoryContextAllocExtended(ctx, headerSize + IVFFLAT_PQ_CENTROIDS * dimensions * sizeof(float), MCXT_ALLOC_ZERO | MCXT_ALLOC_HUGE);
+	pq->dimensions = dimensions;
+	pq->m = m;
+	pq->dsub = m > 0 ? dimensions / m : 0;
+	pq->centroids = (float *) ((char *) pq + headerSize);
+	return pq;
+}
+
+/*
+ * Initialize product quantization for training
+ */
+IvfflatPQ
+IvfflatInitPQ(int dimensions, int m)
+{
+	return IvfflatAllocPQ(CurrentMemoryContext, dimensions, m);
+}
+
+/*
+ * Get the centroids for a subvector
+ */
+static inline float *
+IvfflatPQSubCentroids(IvfflatPQ pq, int j)
+{
+	return pq->centroids + (Size) j * IVFFLAT_PQ_CENTROIDS * pq->dsub;
+}
+
+/*
+ * Find the closest centroid for a subvector
+ */
+static int
+IvfflatPQClosest(float *centroids, int dsub, float *x)
+{
+	int			closest = 0;
+	float		minDistance = FLT_MAX;
+
+	for (int k = 0; k < IVFFLAT_PQ_CENTROIDS; k++)
+	{
+		float	   *c = centroids + k * dsub;
+		float		distance = 0.0;
+
+		/* Auto-vectorized */
+		for (int d = 0; d < dsub; d++)
+		{
+			float		diff = x[d] - c[d];
+
+			distance += diff * diff;
+		}
+
+		if (distance < minDistance)
+		{
+			minDistance = distance;
+			closest = k;
+		}
+	}
+
+	return closest;
+}
+
+/*
+ * Train centroids for each subvector on residuals to the list centers
+ *
+ * Uses Lloyd's algorithm with L2 distance, since residuals are compared
+ * with L2 distance or inner product
+ */
+void
+IvfflatPQTrain(IvfflatPQ pq, VectorArray samples, VectorArray centers, FmgrInfo *procinfo, Oid collation)
+{
+	int			numSamples = Min(samples->length, IVFFLAT_PQ_MAX_SAMPLES);
+	int			dimensions = pq->dimensions;
+	int			dsub = pq->dsub;
+	float	   *residuals;
+	float	   *sums;
+	int		   *counts;
+	int		   *closest;
+
+	/* Use zero residuals if there are no samples */
+	if (numSamples == 0)
+		return;
+
+	residuals = palloc_extended((Size) numSamples * dimensions * sizeof(float), MCXT_ALLOC_HUGE);
+	sums = palloc(IVFFLAT_PQ_CENTROIDS * dsub * sizeof(float));
+	counts = palloc(IVFFLAT_PQ_CENTROIDS * sizeof(int));
+	closest = palloc(numSamples * sizeof(int));
+
+	/* Compute residuals */
+	for (int i = 0; i < numSamples; i++)
+	{
+		Datum		sample = PointerGetDatum(VectorArrayGet(samples, i));
+		Vector	   *vec = (Vector *) VectorArrayGet(samples, i);
+		Vector	   *center = NULL;
+		double		minDistance = DBL_MAX;
+
+		for (int c = 0; c < centers->length; c++)
+		{
+			double		distance = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, sample, PointerGetDatum(VectorArrayGet(centers, c))));
+
+			if (distance < minDistance || center == NULL)
+			{
+				minDistance = distance;
+				center = (Vector *) VectorArrayGet(centers, c);
+			}
+		}
+
+		for (int d = 0; d < dimensions; d++)
+			residuals[(Size) i * dimensions + d] = vec->x[d] - center->x[d];
+	}
+
+	for (int j = 0; j < pq->m; j++)
+	{
+		float	   *centroids = IvfflatPQSubCentroids(pq, j);
+
+		/* Initialize with samples, which are already in random order */
+		for (int k = 0; k < IVFFLAT_PQ_CENTROIDS; k++)
+			memcpy(centroids + k * dsub, residuals + (Size) (k % numSamples) * dimensions + j * dsub, dsub * sizeof(float));
+
+		for (int iteration = 0; iteration < IVFFLAT_PQ_ITERATIONS; iteration++)
+		{
+			/* Can take a while, so ensure we can interrupt */
+			CHECK_FOR_INTERRUPTS();
+
+			/* Assign */
+			for (int i = 0; i < numSamples; i++)
+				closest[i] = IvfflatPQClosest(centroids, dsub, residuals + (Size) i * dimensions + j * dsub);
+
+			/* Update */
+			MemSet(sums, 0, IVFFLAT_PQ_CENTROIDS * dsub * sizeof(float));
+			MemSet(counts, 0, IVFFLAT_PQ_CENTROIDS * sizeof(int));
+
+			for (int i = 0; i < numSamples; i++)
+			{
+				float	   *x = residuals + (Size) i * dimensions + j * dsub;
+				float	   *sum = sums + closest[i] * dsub;
+
+				for (int d = 0; d < dsub; d++)
+					sum[d] += x[d];
+
+				counts[closest[i]]++;
+			}
+
+			for (int k = 0; k < IVFFLAT_PQ_CENTROIDS; k++)
+			{
+				/* Keep previous centroid if empty */
+				if (counts[k] == 0)
+					continue;
+
+				for (int d = 0; d < dsub; d++)
+					centroids[k * dsub + d] = sums[k * dsub + d] / counts[k];
+			}
+		}
+	}
+
+	pfree(residuals);
+	pfree(sums);
+	pfree(counts);
+	pfree(closest);
+}
+
+/*
+ * Encode the residual of a value to a list center
+ */
+void
+IvfflatPQEncode(IvfflatPQ pq, Datum value, Datum center, uint8 *codes)
+{
+	Vector	   *vec = (Vector *) DatumGetPointer(value);
+	Vector	   *c = (Vector *) DatumGetPointer(center);
+	float	   *residual = palloc(pq->dsub * sizeof(float));
+
+	for (int j = 0; j < pq->m; j++)
+	{
+		for (int d = 0; d < pq->dsub; d++)
+			residual[d] = vec->x[j * pq->dsub + d] - c->x[j * pq->dsub + d];
+
+		codes[j] = IvfflatPQClosest(IvfflatPQSubCentroids(pq, j), pq->dsub, residual);
+	}
+
+	pfree(residual);
+}
+
+/*
+ * Encode a value as a varlena to store in an index tuple
+ */
+Datum
+IvfflatPQEncodeValue(IvfflatPQ pq, Datum value, Datum center)
+{
+	bytea	   *result = palloc(VARHDRSZ + pq->m);
+
+	SET_VARSIZE(result, VARHDRSZ + pq->m);
+	IvfflatPQEncode(pq, value, center, (uint8 *) VARDATA(result));
+	return PointerGetDatum(result);
+}
+
+/*
+ * Compute the distance table for a query and list
+ *
+ * Returns the part of the distance that does not depend on the codes
+ */
+float
+IvfflatPQComputeTable(IvfflatPQ pq, FmgrInfo *procinfo, Datum query, Datum center, float *table)
+{
+	Vector	   *q = (Vector *) DatumGetPointer(query);
+	Vector	   *c = (Vector *) DatumGetPointer(center);
+	bool		innerProduct = procinfo->fn_addr == vector_negative_inner_product;
+	float		offset = 0.0;
+
+	if (q->dim != pq->dimensions)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_EXCEPTION),
+				 errmsg("different vector dimensions %d and %d", q->dim, pq->dimensions)));
+
+	for (int j = 0; j < pq->m; j++)
+	{
+		float	   *centroids = IvfflatPQSubCentroids(pq, j);
+		float	   *qx = q->x + j * pq->dsub;
+		float	   *cx = c->x + j * pq->dsub;
+
+		for (int k = 0; k < IVFFLAT_PQ_CENTROIDS; k++)
+		{
+			float	   *r = centroids + k * pq->dsub;
+			float		distance = 0.0;
+
+			/* Auto-vectorized */
+			if (innerProduct)
+			{
+				for (int d = 0; d < pq->dsub; d++)
+					distance -= qx[d] * r[d];
+			}
+			else
+			{
+				for (int d = 0; d < pq->dsub; d++)
+				{
+					float		diff = qx[d] - cx[d] - r[d];
+
+					distance += diff * diff;
+				}
+			}
+
+			table[j * IVFFLAT_PQ_CENTROIDS + k] = distance;
+		}
+
+		if (innerProduct)
+		{
+			for (int d = 0; d < pq->dsub; d++)
+				offset -= qx[d] * cx[d];
+		}
+	}
+
+	return offset;
+}
+
+/*
+ * Get the distance for codes with a distance table
+ */
+float
+IvfflatPQDistance(IvfflatPQ pq, float *table, uint8 *codes)
+{
+	float		distance = 0.0;
+
+	for (int j = 0; j < pq->m; j++)
+		distance += table[j * IVFFLAT_PQ_CENTROIDS + codes[j]];
+
+	return distance;
+}
+
+/*
+ * Get the product quantization params for an index, or NULL if not quantized
+ *
+ * Params are cached in rd_amcache, since they only change when the index is
+ * rebuilt
+ */
+IvfflatPQ
+IvfflatGetPQ(Relation index)
+{
+	IvfflatPQ	pq = (IvfflatPQ) index->rd_amcache;
+
+	if (pq == NULL)
+	{
+		Buffer		buf;
+		Page		page;
+		IvfflatMetaPage metap;
+		BlockNumber blkno;
+		float	   *params;
+		Size		nparams;
+
+		buf = ReadBuffer(index, IVFFLAT_METAPAGE_BLKNO);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		metap = IvfflatPageGetMeta(page);
+
+		if (unlikely(metap->magicNumber != IVFFLAT_MAGIC_NUMBER))
+			elog(ERROR, "ivfflat index is not valid");
+
+		/* Zero for indexes created before quantizers */
+		if (metap->quantizer == IVFFLAT_QUANTIZER_PQ)
+		{
+			pq = IvfflatAllocPQ(index->rd_indexcxt, metap->dimensions, metap->pqM);
+			blkno = metap->pqPage;
+		}
+		else
+		{
+			pq = IvfflatAllocPQ(index->rd_indexcxt, 0, 0);
+			blkno = InvalidBlockNumber;
+		}
+
+		UnlockReleaseBuffer(buf);
+
+		params = pq->centroids;
+		nparams = (Size) IVFFLAT_PQ_CENTROIDS * pq->dimensions;
+
+		while (nparams > 0)
+		{
+			int			count = Min(nparams, IVFFLAT_PQ_PAGE_FLOATS);
+
+			if (!BlockNumberIsValid(blkno))
+				elog(ERROR, "ivfflat product quantization pages not found");
+
+			buf = ReadBuffer(index, blkno);
+			LockBuffer(buf, BUFFER_LOCK_SHARE);
+			page = BufferGetPage(buf);
+
+			memcpy(params, PageGetContents(page), count * sizeof(float));
+			params += count;
+			nparams -= count;
+
+			blkno = IvfflatPageGetOpaque(page)->nextblkno;
+			UnlockReleaseBuffer(buf);
+		}
+
+		index->rd_amcache = pq;
+	}
+
+	if (pq->m == 0)
+		return NULL;
+
+	return pq;
+}
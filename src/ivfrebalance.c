@@ -0,0 +1,638 @@
+#include "postgres.h"
+
+#include <float.h>
+
+#include "access/generic_xlog.h"
+#include "access/itup.h"
+#include "access/table.h"
+#include "catalog/index.h"
+#include "catalog/pg_class.h"
+#include "commands/defrem.h"
+#include "fmgr.h"
+#include "ivfflat.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "utils/acl.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "vector.h"
+
+typedef struct RebalanceList
+{
+	ListInfo	listInfo;
+	BlockNumber startPage;
+	BlockNumber insertPage;
+	int64		count;
+	Pointer		center;
+}			RebalanceList;
+
+/*
+ * Count the tuples in a list
+ */
+static int64
+CountTuples(Relation index, BlockNumber searchPage)
+{
+	int64		count = 0;
+
+	while (BlockNumberIsValid(searchPage))
+	{
+		Buffer		buf;
+		Page		page;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBuffer(index, searchPage);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+
+		count += PageGetMaxOffsetNumber(page);
+		searchPage = IvfflatPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+	}
+
+	return count;
+}
+
+/*
+ * Get the lists with their centers and tuple counts
+ */
+static RebalanceList *
+GetLists(Relation index, int lists, Size itemsize)
+{
+	RebalanceList *items = palloc(sizeof(RebalanceList) * lists);
+	BlockNumber nextblkno = IVFFLAT_HEAD_BLKNO;
+	int			n = 0;
+
+	while (BlockNumberIsValid(nextblkno))
+	{
+		Buffer		cbuf;
+		Page		cpage;
+		OffsetNumber maxoffno;
+
+		cbuf = ReadBuffer(index, nextblkno);
+		LockBuffer(cbuf, BUFFER_LOCK_SHARE);
+		cpage = BufferGetPage(cbuf);
+		maxoffno = PageGetMaxOffsetNumber(cpage);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			IvfflatList list = (IvfflatList) PageGetItem(cpage, PageGetItemId(cpage, offno));
+
+			if (n >= lists)
+				elog(ERROR, "ivfflat index has more lists than expected");
+
+			items[n].listInfo.blkno = nextblkno;
+			items[n].listInfo.offno = offno;
+			items[n].startPage = list->startPage;
+			items[n].insertPage = list->insertPage;
+			items[n].center = palloc(itemsize);
+			memcpy(items[n].center, &list->center, VARSIZE_ANY(&list->center));
+			n++;
+		}
+
+		nextblkno = IvfflatPageGetOpaque(cpage)->nextblkno;
+
+		UnlockReleaseBuffer(cbuf);
+	}
+
+	if (n != lists)
+		elog(ERROR, "ivfflat index has fewer lists than expected");
+
+	for (int i = 0; i < lists; i++)
+		items[i].count = CountTuples(index, items[i].startPage);
+
+	return items;
+}
+
+/*
+ * Compare list tuple counts
+ */
+static int
+CompareListCounts(const void *a, const void *b)
+{
+	int64		ca = (*(RebalanceList * const *) a)->count;
+	int64		cb = (*(RebalanceList * const *) b)->count;
+
+	if (ca < cb)
+		return -1;
+
+	if (ca > cb)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Read the tuples in a list
+ */
+static List *
+ReadTuples(Relation index, BlockNumber searchPage)
+{
+	List	   *tuples = NIL;
+
+	while (BlockNumberIsValid(searchPage))
+	{
+		Buffer		buf;
+		Page		page;
+		OffsetNumber maxoffno;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBuffer(index, searchPage);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+			tuples = lappend(tuples, CopyIndexTuple((IndexTuple) PageGetItem(page, PageGetItemId(page, offno))));
+
+		searchPage = IvfflatPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+	}
+
+	return tuples;
+}
+
+/*
+ * Find the nearest list, skipping the lists being rebalanced
+ */
+static RebalanceList *
+FindNearestList(RebalanceList * items, int lists, Datum value, FmgrInfo *procinfo, Oid collation, RebalanceList * skip1, RebalanceList * skip2)
+{
+	RebalanceList *nearest = NULL;
+	double		minDistance = DBL_MAX;
+
+	for (int i = 0; i < lists; i++)
+	{
+		double		distance;
+
+		if (&items[i] == skip1 || &items[i] == skip2)
+			continue;
+
+		distance = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, value, PointerGetDatum(items[i].center)));
+
+		if (distance < minDistance || nearest == NULL)
+		{
+			nearest = &items[i];
+			minDistance = distance;
+		}
+	}
+
+	return nearest;
+}
+
+/*
+ * Move the first tuple on a page to another list
+ *
+ * The tuple is deleted and added in the same WAL record, so it is never lost
+ * or duplicated after a crash
+ */
+static void
+MoveTuple(Relation index, Buffer srcbuf, IndexTuple itup, RebalanceList * target)
+{
+	Size		itemsz = MAXALIGN(IndexTupleSize(itup));
+	BlockNumber insertPage = target->insertPage;
+	Buffer		buf;
+	Buffer		newbuf = InvalidBuffer;
+	Page		page;
+	Page		srcpage;
+	GenericXLogState *state;
+
+	/* Find a page with enough space, like inserts */
+	for (;;)
+	{
+		BlockNumber nextblkno;
+
+		buf = ReadBuffer(index, insertPage);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+
+		if (PageGetFreeSpace(BufferGetPage(buf)) >= itemsz)
+			break;
+
+		nextblkno = IvfflatPageGetOpaque(BufferGetPage(buf))->nextblkno;
+		if (!BlockNumberIsValid(nextblkno))
+			break;
+
+		UnlockReleaseBuffer(buf);
+		insertPage = nextblkno;
+	}
+
+	state = GenericXLogStart(index);
+	srcpage = GenericXLogRegisterBuffer(state, srcbuf, 0);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+
+	/* Add a new page */
+	/* No extension lock needed since no other backends can access the index */
+	if (PageGetFreeSpace(page) < itemsz)
+	{
+		Page		newpage;
+
+		newbuf = IvfflatNewBuffer(index, MAIN_FORKNUM);
+		newpage = GenericXLogRegisterBuffer(state, newbuf, GENERIC_XLOG_FULL_IMAGE);
+		IvfflatInitPage(newbuf, newpage);
+
+		insertPage = BufferGetBlockNumber(newbuf);
+		IvfflatPageGetOpaque(page)->nextblkno = insertPage;
+		page = newpage;
+	}
+
+	if (PageAddItem(page, (Item) itup, itemsz, InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+		elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+	PageIndexTupleDelete(srcpage, FirstOffsetNumber);
+
+	GenericXLogFinish(state);
+
+	UnlockReleaseBuffer(buf);
+	if (BufferIsValid(newbuf))
+		UnlockReleaseBuffer(newbuf);
+
+	/* Update the insert page */
+	if (insertPage != target->insertPage)
+	{
+		IvfflatUpdateList(index, target->listInfo, insertPage, target->insertPage, InvalidBlockNumber, MAIN_FORKNUM);
+		target->insertPage = insertPage;
+	}
+
+	target->count++;
+}
+
+/*
+ * Move all tuples in a list to their nearest other list
+ */
+static void
+MergeList(Relation index, RebalanceList * items, int lists, RebalanceList * merge, RebalanceList * split, FmgrInfo *procinfo, Oid collation)
+{
+	TupleDesc	tupdesc = RelationGetDescr(index);
+	BlockNumber searchPage = merge->startPage;
+
+	while (BlockNumberIsValid(searchPage))
+	{
+		Buffer		buf;
+		Page		page;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBuffer(index, searchPage);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		page = BufferGetPage(buf);
+
+		/* Always move the first tuple, since deleting shifts the rest */
+		while (PageGetMaxOffsetNumber(page) >= FirstOffsetNumber)
+		{
+			IndexTuple	itup = CopyIndexTuple((IndexTuple) PageGetItem(page, PageGetItemId(page, FirstOffsetNumber)));
+			bool		isnull;
+			Datum		value = index_getattr(itup, 1, tupdesc, &isnull);
+			RebalanceList *target = FindNearestList(items, lists, value, procinfo, collation, merge, split);
+
+			MoveTuple(index, buf, itup, target);
+			pfree(itup);
+		}
+
+		searchPage = IvfflatPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+	}
+
+	merge->count = 0;
+}
+
+/*
+ * Write tuples to new pages
+ */
+static void
+WriteTuples(Relation index, List *tuples, BlockNumber *startPage, BlockNumber *insertPage)
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	ListCell   *lc;
+
+	buf = IvfflatNewBuffer(index, MAIN_FORKNUM);
+	IvfflatInitRegisterPage(index, &buf, &page, &state);
+
+	*startPage = BufferGetBlockNumber(buf);
+
+	foreach(lc, tuples)
+	{
+		IndexTuple	itup = lfirst(lc);
+		Size		itemsz = MAXALIGN(IndexTupleSize(itup));
+
+		/* Check for free space */
+		if (PageGetFreeSpace(page) < itemsz)
+			IvfflatAppendPage(index, &buf, &page, &state, MAIN_FORKNUM);
+
+		/* Add the item */
+		if (PageAddItem(page, (Item) itup, itemsz, InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+	}
+
+	*insertPage = BufferGetBlockNumber(buf);
+
+	IvfflatCommitBuffer(buf, state);
+}
+
+/*
+ * Set the center and pages of a list
+ */
+static void
+SetList(Page page, RebalanceList * item)
+{
+	IvfflatList list = (IvfflatList) PageGetItem(page, PageGetItemId(page, item->listInfo.offno));
+
+	list->startPage = item->startPage;
+	list->insertPage = item->insertPage;
+	memcpy(&list->center, item->center, VARSIZE_ANY(item->center));
+}
+
+/*
+ * Switch two lists to their new centers and pages in a single WAL record
+ */
+static void
+UpdateLists(Relation index, RebalanceList * first, RebalanceList * second)
+{
+	Buffer		buf;
+	Buffer		buf2 = InvalidBuffer;
+	Page		page;
+	Page		page2;
+	GenericXLogState *state;
+
+	buf = ReadBuffer(index, first->listInfo.blkno);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+
+	if (second->listInfo.blkno == first->listInfo.blkno)
+		page2 = page;
+	else
+	{
+		buf2 = ReadBuffer(index, second->listInfo.blkno);
+		LockBuffer(buf2, BUFFER_LOCK_EXCLUSIVE);
+		page2 = GenericXLogRegisterBuffer(state, buf2, 0);
+	}
+
+	SetList(page, first);
+	SetList(page2, second);
+
+	GenericXLogFinish(state);
+
+	UnlockReleaseBuffer(buf);
+	if (BufferIsValid(buf2))
+		UnlockReleaseBuffer(buf2);
+}
+
+/*
+ * Append the pages of an old list to the end of a new list
+ *
+ * A crash part way through only leaves the remaining old pages unused
+ */
+static void
+RecyclePages(Relation index, BlockNumber searchPage, BlockNumber lastPage)
+{
+	while (BlockNumberIsValid(searchPage))
+	{
+		Buffer		buf;
+		Buffer		lastbuf;
+		Page		page;
+		Page		lastpage;
+		GenericXLogState *state;
+		BlockNumber nextblkno;
+
+		CHECK_FOR_INTERRUPTS();
+
+		lastbuf = ReadBuffer(index, lastPage);
+		LockBuffer(lastbuf, BUFFER_LOCK_EXCLUSIVE);
+		buf = ReadBuffer(index, searchPage);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+
+		/* Must be read before the page is initialized */
+		nextblkno = IvfflatPageGetOpaque(BufferGetPage(buf))->nextblkno;
+
+		state = GenericXLogStart(index);
+		lastpage = GenericXLogRegisterBuffer(state, lastbuf, 0);
+		page = GenericXLogRegisterBuffer(state, buf, GENERIC_XLOG_FULL_IMAGE);
+
+		IvfflatInitPage(buf, page);
+		IvfflatPageGetOpaque(lastpage)->nextblkno = searchPage;
+
+		GenericXLogFinish(state);
+
+		UnlockReleaseBuffer(buf);
+		UnlockReleaseBuffer(lastbuf);
+
+		lastPage = searchPage;
+		searchPage = nextblkno;
+	}
+}
+
+/*
+ * Split a list with 2-means, using the slot of another list whose tuples are
+ * moved to their nearest other lists
+ *
+ * Returns false if the tuples in the list cannot be split
+ */
+static bool
+SplitList(Relation index, const IvfflatTypeInfo * typeInfo, int dimensions, RebalanceList * items, int lists, RebalanceList * split, RebalanceList * merge)
+{
+	TupleDesc	tupdesc = RelationGetDescr(index);
+	FmgrInfo   *procinfo = index_getprocinfo(index, 1, IVFFLAT_DISTANCE_PROC);
+	Oid			collation = index->rd_indcollation[0];
+	Size		itemsize = typeInfo->itemSize(dimensions);
+	List	   *tuples;
+	List	   *firstTuples = NIL;
+	List	   *secondTuples = NIL;
+	VectorArray samples;
+	VectorArray centers;
+	int			numTuples;
+	int			numSamples;
+	ListCell   *lc;
+	BlockNumber oldSplitPage = split->startPage;
+	BlockNumber oldMergePage = merge->startPage;
+
+	tuples = ReadTuples(index, split->startPage);
+	numTuples = list_length(tuples);
+
+	/* Sample evenly across the list */
+	numSamples = Min(numTuples, IVFFLAT_REBALANCE_MAX_SAMPLES);
+	samples = VectorArrayInit(numSamples, dimensions, itemsize);
+	for (int i = 0; i < numSamples; i++)
+	{
+		IndexTuple	itup = list_nth(tuples, (int) ((int64) i * numTuples / numSamples));
+		bool		isnull;
+		Datum		value = index_getattr(itup, 1, tupdesc, &isnull);
+
+		VectorArraySet(samples, i, DatumGetPointer(value));
+	}
+	samples->length = numSamples;
+
+	centers = VectorArrayInit(2, dimensions, itemsize);
+	IvfflatKmeans(index, samples, centers, typeInfo, 0);
+
+	/* Assign each tuple to the closest center */
+	foreach(lc, tuples)
+	{
+		IndexTuple	itup = lfirst(lc);
+		bool		isnull;
+		Datum		value = index_getattr(itup, 1, tupdesc, &isnull);
+		double		distance0 = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, value, PointerGetDatum(VectorArrayGet(centers, 0))));
+		double		distance1 = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, value, PointerGetDatum(VectorArrayGet(centers, 1))));
+
+		if (distance1 < distance0)
+			secondTuples = lappend(secondTuples, itup);
+		else
+			firstTuples = lappend(firstTuples, itup);
+	}
+
+	/* Nothing to split, for instance if all values are the same */
+	if (firstTuples == NIL || secondTuples == NIL)
+		return false;
+
+	/* Empty the list whose slot is reused */
+	MergeList(index, items, lists, merge, split, procinfo, collation);
+
+	/*
+	 * Write the split tuples to new pages and switch both lists at once, so
+	 * scans after a crash see either the old or the new lists
+	 */
+	WriteTuples(index, firstTuples, &split->startPage, &split->insertPage);
+	WriteTuples(index, secondTuples, &merge->startPage, &merge->insertPage);
+
+	memcpy(split->center, VectorArrayGet(centers, 0), VARSIZE_ANY(VectorArrayGet(centers, 0)));
+	memcpy(merge->center, VectorArrayGet(centers, 1), VARSIZE_ANY(VectorArrayGet(centers, 1)));
+	split->count = list_length(firstTuples);
+	merge->count = list_length(secondTuples);
+
+	UpdateLists(index, split, merge);
+
+	/* Reuse the old pages for future inserts */
+	RecyclePages(index, oldSplitPage, split->insertPage);
+	RecyclePages(index, oldMergePage, merge->insertPage);
+
+	return true;
+}
+
+/*
+ * Split oversized lists and merge small ones
+ *
+ * The number of lists does not change, so each split reuses the slot of the
+ * smallest remaining list
+ */
+static int
+RebalanceLists(Relation index)
+{
+	const		IvfflatTypeInfo *typeInfo = IvfflatGetTypeInfo(index);
+	int			lists;
+	int			dimensions;
+	int			coarseLists;
+	BlockNumber coarsePage;
+	RebalanceList *items;
+	RebalanceList **sorted;
+	int64		total = 0;
+	double		average;
+	int			splits = 0;
+	int			lo;
+	int			hi;
+	MemoryContext splitCtx;
+	MemoryContext oldCtx;
+
+	IvfflatGetMetaPageInfo(index, &lists, &dimensions);
+
+	/* Codes are relative to the list center, so cannot be moved */
+	if (IvfflatGetPQ(index) != NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("cannot rebalance ivfflat index with quantizer"),
+				 errhint("Use REINDEX instead.")));
+
+	/* Split lists must stay in the range of their coarse center */
+	IvfflatGetCoarseInfo(index, &coarseLists, &coarsePage);
+	if (coarseLists > 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("cannot rebalance ivfflat index with coarse lists"),
+				 errhint("Use REINDEX instead.")));
+
+	items = GetLists(index, lists, typeInfo->itemSize(dimensions));
+
+	sorted = palloc(sizeof(RebalanceList *) * lists);
+	for (int i = 0; i < lists; i++)
+	{
+		sorted[i] = &items[i];
+		total += items[i].count;
+	}
+	average = (double) total / lists;
+
+	qsort(sorted, lists, sizeof(RebalanceList *), CompareListCounts);
+
+	splitCtx = AllocSetContextCreate(CurrentMemoryContext,
+									 "Ivfflat rebalance temporary context",
+									 ALLOCSET_DEFAULT_SIZES);
+
+	/* Pair the largest lists with the smallest ones */
+	for (lo = 0, hi = lists - 1; lo < hi; lo++, hi--)
+	{
+		RebalanceList *split = sorted[hi];
+		RebalanceList *merge = sorted[lo];
+
+		if (split->count <= IVFFLAT_REBALANCE_SPLIT_FACTOR * average || merge->count >= average)
+			break;
+
+		oldCtx = MemoryContextSwitchTo(splitCtx);
+
+		if (SplitList(index, typeInfo, dimensions, items, lists, split, merge))
+			splits++;
+
+		MemoryContextSwitchTo(oldCtx);
+		MemoryContextReset(splitCtx);
+	}
+
+	MemoryContextDelete(splitCtx);
+
+	return splits;
+}
+
+/*
+ * Rebalance the lists of an ivfflat index
+ */
+FUNCTION_PREFIX PG_FUNCTION_INFO_V1(ivfflat_rebalance);
+Datum
+ivfflat_rebalance(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Relation	heap;
+	Relation	index;
+	int			splits;
+
+	if (get_rel_relkind(relid) != RELKIND_INDEX)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an index", get_rel_name(relid))));
+
+#if PG_VERSION_NUM >= 160000
+	if (!object_ownercheck(RelationRelationId, relid, GetUserId()))
+#else
+	if (!pg_class_ownercheck(relid, GetUserId()))
+#endif
+		aclcheck_error(ACLCHECK_NOT_OWNER, OBJECT_INDEX, get_rel_name(relid));
+
+	/* Lock the table first, like REINDEX */
+	/* Tuples are moved between pages, so block all other access to the index */
+	heap = table_open(IndexGetRelation(relid, false), ShareLock);
+	index = index_open(relid, AccessExclusiveLock);
+
+	if (index->rd_rel->relam != get_index_am_oid("ivfflat", false))
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an ivfflat index", RelationGetRelationName(index))));
+
+	splits = RebalanceLists(index);
+
+	/* Keep locks until end of transaction */
+	index_close(index, NoLock);
+	table_close(heap, NoLock);
+
+	PG_RETURN_INT32(splits);
+}
@@ -1,20 +1,32 @@
 #include "postgres.h"
 
 #include <float.h>
+#include <math.h>
 
 #include "access/relscan.h"
-#include "catalog/pg_operator_d.h"
-#include "catalog/pg_type_d.h"
+#include "access/tableam.h"
+#include "halfvec.h"			/* for USE_TARGET_CLONES */
 #include "lib/pairingheap.h"
 #include "ivfflat.h"
 #include "miscadmin.h"
 #include "pgstat.h"
 #include "storage/bufmgr.h"
-
-#ifdef IVFFLAT_MEMORY
+#include "storage/spin.h"
 #include "utils/memutils.h"
+#include "utils/rel.h"
+#include "vector.h"
+
+#if defined(USE_TARGET_CLONES) && !defined(__FMA__)
+#define IVFFLAT_TARGET_CLONES __attribute__((target_clones("default", "fma")))
+#else
+#define IVFFLAT_TARGET_CLONES
 #endif
 
+PGDLLEXPORT Datum vector_l2_squared_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum vector_negative_inner_product(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum halfvec_l2_squared_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum halfvec_negative_inner_product(PG_FUNCTION_ARGS);
+
 /*
  * Compare list distances
  */
@@ -31,18 +43,16 @@ CompareLists(const pairingheap_node *a, const pairingheap_node *b, void *arg)
 }
 
 /*
- * Get lists and sort by distance
+ * Search count lists starting at start, or all lists if count is -1
  */
 static void
-GetScanLists(IndexScanDesc scan, Datum value)
+SearchLists(IndexScanDesc scan, Datum value, ListInfo start, int count, double *maxDistance)
 {
 	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
-	BlockNumber nextblkno = IVFFLAT_HEAD_BLKNO;
-	int			listCount = 0;
-	double		maxDistance = DBL_MAX;
+	BlockNumber nextblkno = start.blkno;
+	OffsetNumber startoffno = start.offno;
 
-	/* Search all list pages */
-	while (BlockNumberIsValid(nextblkno))
+	while (BlockNumberIsValid(nextblkno) && count != 0)
 	{
 		Buffer		cbuf;
 		Page		cpage;
@@ -54,7 +64,7 @@ GetScanLists(IndexScanDesc scan, Datum value)
 
 		maxoffno = PageGetMaxOffsetNumber(cpage);
 
-		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		for (OffsetNumber offno = startoffno; offno <= maxoffno && count != 0; offno = OffsetNumberNext(offno), count--)
 		{
 			IvfflatList list = (IvfflatList) PageGetItem(cpage, PageGetItemId(cpage, offno));
 			double		distance;
@@ -62,23 +72,25 @@ GetScanLists(IndexScanDesc scan, Datum value)
 			/* Use procinfo from the index instead of scan key for performance */
 			distance = DatumGetFloat8(so->distfunc(so->procinfo, so->collation, PointerGetDatum(&list->center), value));
 
-			if (listCount < so->probes)
+			if (so->listCount < so->probes)
 			{
 				IvfflatScanList *scanlist;
 
-				scanlist = &so->lists[listCount];
+				scanlist = &so->lists[so->listCount];
 				scanlist->startPage = list->startPage;
+				scanlist->listInfo.blkno = nextblkno;
+				scanlist->listInfo.offno = offno;
 				scanlist->distance = distance;
-				listCount++;
+				so->listCount++;
 
 				/* Add to heap */
 				pairingheap_add(so->listQueue, &scanlist->ph_node);
 
 				/* Calculate max distance */
-				if (listCount == so->probes)
-					maxDistance = ((IvfflatScanList *) pairingheap_first(so->listQueue))->distance;
+				if (so->listCount == so->probes)
+					*maxDistance = ((IvfflatScanList *) pairingheap_first(so->listQueue))->distance;
 			}
-			else if (distance < maxDistance)
+			else if (distance < *maxDistance)
 			{
 				IvfflatScanList *scanlist;
 
@@ -87,30 +99,335 @@ GetScanLists(IndexScanDesc scan, Datum value)
 
 				/* Reuse */
 				scanlist->startPage = list->startPage;
+				scanlist->listInfo.blkno = nextblkno;
+				scanlist->listInfo.offno = offno;
 				scanlist->distance = distance;
 				pairingheap_add(so->listQueue, &scanlist->ph_node);
 
 				/* Update max distance */
-				maxDistance = ((IvfflatScanList *) pairingheap_first(so->listQueue))->distance;
+				*maxDistance = ((IvfflatScanList *) pairingheap_first(so->listQueue))->distance;
 			}
 		}
 
 		nextblkno = IvfflatPageGetOpaque(cpage)->nextblkno;
+		startoffno = FirstOffsetNumber;
 
 		UnlockReleaseBuffer(cbuf);
 	}
 }
 
 /*
- * Get items
+ * Get lists and sort by distance
+ */
+static void
+GetScanLists(IndexScanDesc scan, Datum value)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+	double		maxDistance = DBL_MAX;
+
+	so->listCount = 0;
+
+	if (so->coarseLists > 0)
+	{
+		IvfflatCoarseItem *items = IvfflatGetCoarseItems(scan->indexRelation, so->coarseLists, so->coarsePage, so->procinfo, so->collation, value);
+
+		/* Search nearest coarse lists, and more if needed to find probes lists */
+		for (int i = 0; i < so->coarseLists; i++)
+		{
+			if (i >= ivfflat_coarse_probes && so->listCount >= so->probes)
+				break;
+
+			if (items[i].listCount > 0)
+				SearchLists(scan, value, items[i].firstList, items[i].listCount, &maxDistance);
+		}
+
+		pfree(items);
+	}
+	else
+	{
+		ListInfo	head = {IVFFLAT_HEAD_BLKNO, FirstOffsetNumber};
+
+		/* Search all list pages */
+		SearchLists(scan, value, head, -1, &maxDistance);
+	}
+}
+
+/*
+ * Compute the distance table for a list
+ */
+static float
+ComputeListTable(IndexScanDesc scan, ListInfo listInfo, Datum value)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+	Buffer		cbuf;
+	Page		cpage;
+	IvfflatList list;
+	float		offset;
+
+	cbuf = ReadBuffer(scan->indexRelation, listInfo.blkno);
+	LockBuffer(cbuf, BUFFER_LOCK_SHARE);
+	cpage = BufferGetPage(cbuf);
+	list = (IvfflatList) PageGetItem(cpage, PageGetItemId(cpage, listInfo.offno));
+
+	offset = IvfflatPQComputeTable(so->pq, so->procinfo, value, PointerGetDatum(&list->center), so->pqTable);
+
+	UnlockReleaseBuffer(cbuf);
+
+	return offset;
+}
+
+/*
+ * Get the distance to a list center from a squared L2 distance
+ */
+static double
+L2CenterDistance(double distance)
+{
+	return sqrt(distance);
+}
+
+/*
+ * Get the distance to a list center from the negative inner product of
+ * normalized vectors
+ */
+static double
+CosineCenterDistance(double distance)
+{
+	return sqrt(Max(2.0 + 2.0 * distance, 0.0));
+}
+
+/*
+ * Get the distance to a list center for other distances
+ */
+static double
+CenterDistance(double distance)
+{
+	return distance;
+}
+
+/*
+ * Remove lists that are much farther than the nearest list
+ *
+ * Queries near the middle of a list can stop early, while queries near the
+ * boundary of several lists still search up to probes lists
+ */
+static void
+LimitScanLists(IndexScanDesc scan)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+	double		minDistance = DBL_MAX;
+	double		maxDistance;
+	int			listCount = 0;
+
+	for (int i = 0; i < so->listCount; i++)
+		minDistance = Min(minDistance, so->centerdistfunc(so->lists[i].distance));
+
+	/* Ratio is not meaningful for a zero distance */
+	if (minDistance <= 0)
+		return;
+
+	/* Always keep the nearest list */
+	maxDistance = Max(minDistance * so->probeRatio, minDistance);
+
+	for (int i = 0; i < so->listCount; i++)
+	{
+		if (so->centerdistfunc(so->lists[i].distance) <= maxDistance)
+			so->lists[listCount++] = so->lists[i];
+	}
+
+	so->listCount = listCount;
+}
+
+/*
+ * Get the next list to search
+ *
+ * For parallel scans, participants claim lists from a shared counter on the
+ * first pass and keep searching the lists they claimed on later passes
+ */
+static IvfflatScanList *
+GetNextList(IndexScanDesc scan, bool firstPass, int *listIndex)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+
+	if (scan->parallel_scan != NULL && firstPass)
+	{
+		IvfflatParallelScan pscan = (IvfflatParallelScan) OffsetToPointer(scan->parallel_scan, scan->parallel_scan->ps_offset);
+		int			next;
+
+		SpinLockAcquire(&pscan->mutex);
+		next = pscan->nextList++;
+		SpinLockRelease(&pscan->mutex);
+
+		if (next >= so->listCount)
+		{
+			so->listCount = *listIndex;
+			return NULL;
+		}
+
+		/* Move claimed lists to the front */
+		so->lists[*listIndex] = so->lists[next];
+		return &so->lists[(*listIndex)++];
+	}
+
+	if (*listIndex >= so->listCount)
+		return NULL;
+
+	return &so->lists[(*listIndex)++];
+}
+
+/*
+ * Compare item distances, using heap TIDs to break ties
+ */
+static inline int
+CompareItemValues(double distance1, ItemPointer tid1, double distance2, ItemPointer tid2)
+{
+	if (distance1 > distance2)
+		return 1;
+
+	if (distance1 < distance2)
+		return -1;
+
+	return ItemPointerCompare(tid1, tid2);
+}
+
+/*
+ * Compare items
+ */
+static int
+CompareItems(const pairingheap_node *a, const pairingheap_node *b, void *arg)
+{
+	IvfflatScanItem *ia = (IvfflatScanItem *) a;
+	IvfflatScanItem *ib = (IvfflatScanItem *) b;
+
+	return CompareItemValues(ia->distance, &ia->heaptid, ib->distance, &ib->heaptid);
+}
+
+/*
+ * Get the squared L2 distances between a query and vectors
+ *
+ * Vectors are processed four at a time so each query element is loaded once
+ * for four distances
+ */
+IVFFLAT_TARGET_CLONES static void
+L2SquaredDistanceBatch(int dim, float *q, float **x, int n, double *distances)
+{
+	int			i = 0;
+
+	for (; i + 4 <= n; i += 4)
+	{
+		float	   *x0 = x[i];
+		float	   *x1 = x[i + 1];
+		float	   *x2 = x[i + 2];
+		float	   *x3 = x[i + 3];
+		float		d0 = 0.0;
+		float		d1 = 0.0;
+		float		d2 = 0.0;
+		float		d3 = 0.0;
+
+		/* Auto-vectorized */
+		for (int j = 0; j < dim; j++)
+		{
+			float		diff0 = q[j] - x0[j];
+			float		diff1 = q[j] - x1[j];
+			float		diff2 = q[j] - x2[j];
+			float		diff3 = q[j] - x3[j];
+
+			d0 += diff0 * diff0;
+			d1 += diff1 * diff1;
+			d2 += diff2 * diff2;
+			d3 += diff3 * diff3;
+		}
+
+		distances[i] = d0;
+		distances[i + 1] = d1;
+		distances[i + 2] = d2;
+		distances[i + 3] = d3;
+	}
+
+	for (; i < n; i++)
+	{
+		float	   *x0 = x[i];
+		float		d0 = 0.0;
+
+		/* Auto-vectorized */
+		for (int j = 0; j < dim; j++)
+		{
+			float		diff0 = q[j] - x0[j];
+
+			d0 += diff0 * diff0;
+		}
+
+		distances[i] = d0;
+	}
+}
+
+/*
+ * Get the negative inner products between a query and vectors
+ */
+IVFFLAT_TARGET_CLONES static void
+NegativeInnerProductBatch(int dim, float *q, float **x, int n, double *distances)
+{
+	int			i = 0;
+
+	for (; i + 4 <= n; i += 4)
+	{
+		float	   *x0 = x[i];
+		float	   *x1 = x[i + 1];
+		float	   *x2 = x[i + 2];
+		float	   *x3 = x[i + 3];
+		float		d0 = 0.0;
+		float		d1 = 0.0;
+		float		d2 = 0.0;
+		float		d3 = 0.0;
+
+		/* Auto-vectorized */
+		for (int j = 0; j < dim; j++)
+		{
+			d0 += q[j] * x0[j];
+			d1 += q[j] * x1[j];
+			d2 += q[j] * x2[j];
+			d3 += q[j] * x3[j];
+		}
+
+		distances[i] = -d0;
+		distances[i + 1] = -d1;
+		distances[i + 2] = -d2;
+		distances[i + 3] = -d3;
+	}
+
+	for (; i < n; i++)
+	{
+		float	   *x0 = x[i];
+		float		d0 = 0.0;
+
+		/* Auto-vectorized */
+		for (int j = 0; j < dim; j++)
+			d0 += q[j] * x0[j];
+
+		distances[i] = -d0;
+	}
+}
+
+/*
+ * Get the nearest items after the last item of the previous pass
+ *
+ * Only batchSize items are kept in a max-heap, so the cost of a pass is
+ * linear in the number of tuples in the probed lists instead of sorting
+ * all of them
  */
 static void
-GetScanItems(IndexScanDesc scan, Datum value)
+GetScanItems(IndexScanDesc scan, Datum value, IvfflatScanItem *last)
 {
 	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
 	TupleDesc	tupdesc = RelationGetDescr(scan->indexRelation);
 	double		tuples = 0;
-	TupleTableSlot *slot = MakeSingleTupleTableSlot(so->tupdesc, &TTSOpsVirtual);
+	int			itemCount = 0;
+	int			listIndex = 0;
+	IvfflatScanList *scanlist;
+	Vector	   *query = (Vector *) DatumGetPointer(value);
+	bool		useBatch = so->batchdistfunc != NULL && query != NULL;
+	IndexTuple	itups[MaxIndexTuplesPerPage];
+	float	   *vecs[MaxIndexTuplesPerPage];
+	double		distances[MaxIndexTuplesPerPage];
 
 	/*
 	 * Reuse same set of shared buffers for scan
@@ -119,10 +436,18 @@ GetScanItems(IndexScanDesc scan, Datum value)
 	 */
 	BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
 
+	pairingheap_reset(so->itemQueue);
+
 	/* Search closest probes lists */
-	while (!pairingheap_is_empty(so->listQueue))
+	while ((scanlist = GetNextList(scan, last == NULL, &listIndex)) != NULL)
 	{
-		BlockNumber searchPage = ((IvfflatScanList *) pairingheap_remove_first(so->listQueue))->startPage;
+		BlockNumber searchPage = scanlist->startPage;
+		float		offset = 0.0;
+		bool		useTable = so->pq != NULL && DatumGetPointer(value) != NULL;
+
+		/* Compute distances to codes with a table for each list */
+		if (useTable)
+			offset = ComputeListTable(scan, scanlist->listInfo, value);
 
 		/* Search all entry pages for list */
 		while (BlockNumberIsValid(searchPage))
@@ -130,6 +455,7 @@ GetScanItems(IndexScanDesc scan, Datum value)
 			Buffer		buf;
 			Page		page;
 			OffsetNumber maxoffno;
+			int			n = 0;
 
 			buf = ReadBufferExtended(scan->indexRelation, MAIN_FORKNUM, searchPage, RBM_NORMAL, bas);
 			LockBuffer(buf, BUFFER_LOCK_SHARE);
@@ -145,23 +471,66 @@ GetScanItems(IndexScanDesc scan, Datum value)
 
 				itup = (IndexTuple) PageGetItem(page, itemid);
 				datum = index_getattr(itup, 1, tupdesc, &isnull);
+				itups[n] = itup;
 
 				/*
-				 * Add virtual tuple
-				 *
 				 * Use procinfo from the index instead of scan key for
 				 * performance
 				 */
-				ExecClearTuple(slot);
-				slot->tts_values[0] = so->distfunc(so->procinfo, so->collation, datum, value);
-				slot->tts_isnull[0] = false;
-				slot->tts_values[1] = PointerGetDatum(&itup->t_tid);
-				slot->tts_isnull[1] = false;
-				ExecStoreVirtualTuple(slot);
+				if (useBatch)
+				{
+					Vector	   *vec = DatumGetVector(datum);
+
+					if (vec->dim != query->dim)
+						ereport(ERROR,
+								(errcode(ERRCODE_DATA_EXCEPTION),
+								 errmsg("different vector dimensions %d and %d", vec->dim, query->dim)));
+
+					vecs[n] = vec->x;
+				}
+				else if (useTable)
+					distances[n] = offset + IvfflatPQDistance(so->pq, so->pqTable, (uint8 *) VARDATA_ANY(DatumGetPointer(datum)));
+				else if (so->pq != NULL)
+					distances[n] = 0.0;
+				else
+					distances[n] = DatumGetFloat8(so->distfunc(so->procinfo, so->collation, datum, value));
+
+				n++;
+			}
+
+			/* Compute distances for the whole page at once */
+			if (useBatch)
+				so->batchdistfunc(query->dim, query->x, vecs, n, distances);
 
-				tuplesort_puttupleslot(so->sortstate, slot);
+			for (int j = 0; j < n; j++)
+			{
+				IndexTuple	itup = itups[j];
+				double		distance = distances[j];
+				IvfflatScanItem *item;
 
 				tuples++;
+
+				/* Skip items returned by previous passes */
+				if (last != NULL && CompareItemValues(distance, &itup->t_tid, last->distance, &last->heaptid) <= 0)
+					continue;
+
+				if (itemCount < so->batchSize)
+					item = &so->items[itemCount++];
+				else
+				{
+					item = (IvfflatScanItem *) pairingheap_first(so->itemQueue);
+
+					/* Skip if not closer than the furthest item */
+					if (CompareItemValues(distance, &itup->t_tid, item->distance, &item->heaptid) >= 0)
+						continue;
+
+					/* Reuse */
+					pairingheap_remove_first(so->itemQueue);
+				}
+
+				item->heaptid = itup->t_tid;
+				item->distance = distance;
+				pairingheap_add(so->itemQueue, &item->ph_node);
 			}
 
 			searchPage = IvfflatPageGetOpaque(page)->nextblkno;
@@ -170,16 +539,139 @@ GetScanItems(IndexScanDesc scan, Datum value)
 		}
 	}
 
-	ExecDropSingleTupleTableSlot(slot);
 	FreeAccessStrategy(bas);
 
-	if (tuples < 100)
+	if (last == NULL && tuples < 100 && scan->parallel_scan == NULL)
 		ereport(DEBUG1,
 				(errmsg("index scan found few tuples"),
 				 errdetail("Index may have been created with little data."),
 				 errhint("Recreate the index and possibly decrease lists.")));
 
-	tuplesort_performsort(so->sortstate);
+	/* Sort by removing the furthest item first */
+	for (int i = itemCount - 1; i >= 0; i--)
+		so->sortedItems[i] = (IvfflatScanItem *) pairingheap_remove_first(so->itemQueue);
+
+	so->itemsLength = itemCount;
+	so->itemIndex = 0;
+
+	/* No more items if the batch is not full */
+	so->exhausted = itemCount < so->batchSize;
+}
+
+/*
+ * Get the next nearest item
+ */
+static IvfflatScanItem *
+GetNextItem(IndexScanDesc scan)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+
+	if (so->itemIndex == so->itemsLength)
+	{
+		IvfflatScanItem last;
+		int			maxBatchSize = MaxAllocSize / sizeof(IvfflatScanItem);
+
+		if (so->exhausted)
+			return NULL;
+
+		/* Copy before items are resized */
+		last = *so->sortedItems[so->itemsLength - 1];
+
+		/* Double the batch size so the number of passes stays small */
+		if (so->batchSize < maxBatchSize)
+		{
+			so->batchSize = Min(so->batchSize, maxBatchSize / 2) * 2;
+			so->items = repalloc(so->items, so->batchSize * sizeof(IvfflatScanItem));
+			so->sortedItems = repalloc(so->sortedItems, so->batchSize * sizeof(IvfflatScanItem *));
+		}
+
+		IvfflatBench("GetScanItems", GetScanItems(scan, so->value, &last));
+
+		if (so->itemsLength == 0)
+			return NULL;
+	}
+
+	return so->sortedItems[so->itemIndex++];
+}
+
+/*
+ * Compare re-rank items
+ */
+static int
+CompareRerankItems(const void *a, const void *b)
+{
+	if (((const IvfflatRerankItem *) a)->distance < ((const IvfflatRerankItem *) b)->distance)
+		return -1;
+
+	if (((const IvfflatRerankItem *) a)->distance > ((const IvfflatRerankItem *) b)->distance)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Re-rank the nearest items with exact distances from the heap
+ */
+static void
+RerankItems(IndexScanDesc scan, Datum value)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+	Relation	heap = scan->heapRelation;
+	AttrNumber	attno = scan->indexRelation->rd_index->indkey.values[0];
+	TupleTableSlot *slot;
+	IndexFetchTableData *fetch;
+
+	/* Heap values are only available for columns */
+	if (heap == NULL || attno == InvalidAttrNumber || DatumGetPointer(value) == NULL)
+		return;
+
+	while (so->rerankLength < so->rerankK)
+	{
+		IvfflatScanItem *next = GetNextItem(scan);
+		IvfflatRerankItem *item;
+
+		if (next == NULL)
+			break;
+
+		item = &so->rerankItems[so->rerankLength++];
+		item->heaptid = next->heaptid;
+		item->distance = next->distance;
+	}
+
+	slot = table_slot_create(heap, NULL);
+	fetch = table_index_fetch_begin(heap);
+
+	for (int i = 0; i < so->rerankLength; i++)
+	{
+		IvfflatRerankItem *item = &so->rerankItems[i];
+		ItemPointerData tid = item->heaptid;
+		bool		call_again = false;
+		bool		all_dead = false;
+		bool		isnull;
+		Datum		heapValue;
+
+		/* Keep the approximate distance if not visible */
+		if (!table_index_fetch_tuple(fetch, &tid, scan->xs_snapshot, slot, &call_again, &all_dead))
+			continue;
+
+		heapValue = slot_getattr(slot, attno, &isnull);
+		if (!isnull)
+		{
+			heapValue = PointerGetDatum(PG_DETOAST_DATUM(heapValue));
+
+			if (so->normprocinfo != NULL)
+				heapValue = IvfflatNormValue(so->typeInfo, so->collation, heapValue);
+
+			item->distance = DatumGetFloat8(FunctionCall2Coll(so->procinfo, so->collation, heapValue, value));
+		}
+
+		ExecClearTuple(slot);
+	}
+
+	table_index_fetch_end(fetch);
+	ExecDropSingleTupleTableSlot(slot);
+
+	qsort(so->rerankItems, so->rerankLength, sizeof(IvfflatRerankItem), CompareRerankItems);
 }
 
 /*
@@ -223,17 +715,18 @@ GetScanValue(IndexScanDesc scan)
 }
 
 /*
- * Initialize scan sort state
+ * Free scan value
  */
-static Tuplesortstate *
-InitScanSortState(TupleDesc tupdesc)
+static void
+FreeScanValue(IndexScanDesc scan)
 {
-	AttrNumber	attNums[] = {1};
-	Oid			sortOperators[] = {Float8LessOperator};
-	Oid			sortCollations[] = {InvalidOid};
-	bool		nullsFirstFlags[] = {false};
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+
+	/* Clean up if we allocated a new value */
+	if (DatumGetPointer(so->value) != NULL && so->value != scan->orderByData->sk_argument)
+		pfree(DatumGetPointer(so->value));
 
-	return tuplesort_begin_heap(tupdesc, 1, attNums, sortOperators, sortCollations, nullsFirstFlags, work_mem, NULL, false);
+	so->value = PointerGetDatum(NULL);
 }
 
 /*
@@ -259,23 +752,64 @@ ivfflatbeginscan(Relation index, int nkeys, int norderbys)
 	so = (IvfflatScanOpaque) palloc(offsetof(IvfflatScanOpaqueData, lists) + probes * sizeof(IvfflatScanList));
 	so->typeInfo = IvfflatGetTypeInfo(index);
 	so->first = true;
+	so->value = PointerGetDatum(NULL);
 	so->probes = probes;
 	so->dimensions = dimensions;
+	so->listCount = 0;
+	IvfflatGetCoarseInfo(index, &so->coarseLists, &so->coarsePage);
+
+	/* Set product quantization */
+	so->pq = IvfflatGetPQ(index);
+	so->pqTable = NULL;
+	so->rerankK = 0;
+	so->rerankItems = NULL;
+	so->rerankLength = 0;
+	so->rerankIndex = 0;
+	if (so->pq != NULL)
+	{
+		so->pqTable = palloc(so->pq->m * IVFFLAT_PQ_CENTROIDS * sizeof(float));
+		so->rerankK = ivfflat_rerank_k;
+		so->rerankItems = palloc(Max(so->rerankK, 1) * sizeof(IvfflatRerankItem));
+	}
 
 	/* Set support functions */
 	so->procinfo = index_getprocinfo(index, 1, IVFFLAT_DISTANCE_PROC);
 	so->normprocinfo = IvfflatOptionalProcInfo(index, IVFFLAT_NORM_PROC);
 	so->collation = index->rd_indcollation[0];
 
-	/* Create tuple description for sorting */
-	so->tupdesc = CreateTemplateTupleDesc(2);
-	TupleDescInitEntry(so->tupdesc, (AttrNumber) 1, "distance", FLOAT8OID, -1, 0);
-	TupleDescInitEntry(so->tupdesc, (AttrNumber) 2, "heaptid", TIDOID, -1, 0);
+	/* Limit lists by distance for adaptive probes */
+	so->probeRatio = ivfflat_probe_ratio;
+	so->centerdistfunc = NULL;
+	if (so->probeRatio > 0)
+	{
+		PGFunction fn = so->procinfo->fn_addr;
+
+		if (so->normprocinfo != NULL)
+			so->centerdistfunc = CosineCenterDistance;
+		else if (fn == vector_l2_squared_distance || fn == halfvec_l2_squared_distance)
+			so->centerdistfunc = L2CenterDistance;
+		else if (fn != vector_negative_inner_product && fn != halfvec_negative_inner_product)
+			so->centerdistfunc = CenterDistance;
+	}
 
-	/* Prep sort */
-	so->sortstate = InitScanSortState(so->tupdesc);
+	/* Compute distances for a page at once for vectors */
+	so->batchdistfunc = NULL;
+	if (so->pq == NULL)
+	{
+		if (so->procinfo->fn_addr == vector_l2_squared_distance)
+			so->batchdistfunc = L2SquaredDistanceBatch;
+		else if (so->procinfo->fn_addr == vector_negative_inner_product)
+			so->batchdistfunc = NegativeInnerProductBatch;
+	}
 
-	so->slot = MakeSingleTupleTableSlot(so->tupdesc, &TTSOpsMinimalTuple);
+	/* Keep enough items to re-rank in a single pass */
+	so->batchSize = Max(ivfflat_batch_size, so->rerankK);
+	so->items = palloc(so->batchSize * sizeof(IvfflatScanItem));
+	so->sortedItems = palloc(so->batchSize * sizeof(IvfflatScanItem *));
+	so->itemsLength = 0;
+	so->itemIndex = 0;
+	so->exhausted = false;
+	so->itemQueue = pairingheap_allocate(CompareItems, scan);
 
 	so->listQueue = pairingheap_allocate(CompareLists, scan);
 
@@ -292,17 +826,14 @@ ivfflatrescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int
 {
 	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
 
-	if (!so->first)
-	{
-#if PG_VERSION_NUM >= 130000
-		tuplesort_reset(so->sortstate);
-#else
-		tuplesort_end(so->sortstate);
-		so->sortstate = InitScanSortState(so->tupdesc);
-#endif
-	}
+	FreeScanValue(scan);
 
 	so->first = true;
+	so->itemsLength = 0;
+	so->itemIndex = 0;
+	so->exhausted = false;
+	so->rerankLength = 0;
+	so->rerankIndex = 0;
 	pairingheap_reset(so->listQueue);
 
 	if (keys && scan->numberOfKeys > 0)
@@ -319,6 +850,7 @@ bool
 ivfflatgettuple(IndexScanDesc scan, ScanDirection dir)
 {
 	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+	IvfflatScanItem *item;
 
 	/*
 	 * Index can be used to scan backward, but Postgres doesn't support
@@ -328,8 +860,6 @@ ivfflatgettuple(IndexScanDesc scan, ScanDirection dir)
 
 	if (so->first)
 	{
-		Datum		value;
-
 		/* Count index scan for stats */
 		pgstat_count_index_scan(scan->indexRelation);
 
@@ -337,30 +867,40 @@ ivfflatgettuple(IndexScanDesc scan, ScanDirection dir)
 		if (scan->orderByData == NULL)
 			elog(ERROR, "cannot scan ivfflat index without order");
 
-		/* Requires MVCC-compliant snapshot as not able to pin during sorting */
+		/* Requires MVCC-compliant snapshot as not able to pin between passes */
 		/* https://www.postgresql.org/docs/current/index-locking.html */
 		if (!IsMVCCSnapshot(scan->xs_snapshot))
 			elog(ERROR, "non-MVCC snapshots are not supported with ivfflat");
 
-		value = GetScanValue(scan);
-		IvfflatBench("GetScanLists", GetScanLists(scan, value));
-		IvfflatBench("GetScanItems", GetScanItems(scan, value));
+		so->value = GetScanValue(scan);
+		IvfflatBench("GetScanLists", GetScanLists(scan, so->value));
+		if (so->centerdistfunc != NULL)
+			LimitScanLists(scan);
+		IvfflatBench("GetScanItems", GetScanItems(scan, so->value, NULL));
+
+		/* Quantized distances are approximate */
+		if (so->rerankK > 0)
+			IvfflatBench("RerankItems", RerankItems(scan, so->value));
+
 		so->first = false;
 
 #if defined(IVFFLAT_MEMORY) && PG_VERSION_NUM >= 130000
 		elog(INFO, "memory: %zu MB", MemoryContextMemAllocated(CurrentMemoryContext, true) / (1024 * 1024));
 #endif
-
-		/* Clean up if we allocated a new value */
-		if (value != scan->orderByData->sk_argument)
-			pfree(DatumGetPointer(value));
 	}
 
-	if (tuplesort_gettupleslot(so->sortstate, true, false, so->slot, NULL))
+	if (so->rerankIndex < so->rerankLength)
 	{
-		ItemPointer heaptid = (ItemPointer) DatumGetPointer(slot_getattr(so->slot, 2, &so->isnull));
+		scan->xs_heaptid = so->rerankItems[so->rerankIndex++].heaptid;
+		scan->xs_recheck = false;
+		scan->xs_recheckorderby = false;
+		return true;
+	}
 
-		scan->xs_heaptid = *heaptid;
+	item = GetNextItem(scan);
+	if (item != NULL)
+	{
+		scan->xs_heaptid = item->heaptid;
 		scan->xs_recheck = false;
 		scan->xs_recheckorderby = false;
 		return true;
@@ -377,11 +917,56 @@ ivfflatendscan(IndexScanDesc scan)
 {
 	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
 
+	FreeScanValue(scan);
 	pairingheap_free(so->listQueue);
-	FreeTupleDesc(so->tupdesc);
-	tuplesort_end(so->sortstate);
-	ExecDropSingleTupleTableSlot(so->slot);
+	pairingheap_free(so->itemQueue);
+	pfree(so->items);
+	pfree(so->sortedItems);
+
+	if (so->pq != NULL)
+	{
+		pfree(so->pqTable);
+		pfree(so->rerankItems);
+	}
 
 	pfree(so);
 	scan->opaque = NULL;
 }
+
+/*
+ * Estimate the size of shared memory for a parallel scan
+ */
+Size
+#if PG_VERSION_NUM >= 170000
+ivfflatestimateparallelscan(int nkeys, int norderbys)
+#else
+ivfflatestimateparallelscan(void)
+#endif
+{
+	return sizeof(IvfflatParallelScanData);
+}
+
+/*
+ * Initialize shared memory for a parallel scan
+ */
+void
+ivfflatinitparallelscan(void *target)
+{
+	IvfflatParallelScan pscan = (IvfflatParallelScan) target;
+
+	SpinLockInit(&pscan->mutex);
+	pscan->nextList = 0;
+}
+
+/*
+ * Reset shared memory before a parallel scan is restarted
+ */
+void
+ivfflatparallelrescan(IndexScanDesc scan)
+{
+	IvfflatParallelScan pscan = (IvfflatParallelScan) OffsetToPointer(scan->parallel_scan, scan->parallel_scan->ps_offset);
+
+	SpinLockAcquire(&pscan->mutex);
+	pscan->nextList = 0;
+	SpinLockRelease(&pscan->mutex);
+}
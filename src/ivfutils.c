@@ -52,6 +52,48 @@ IvfflatGetLists(Relation index)
 	return IVFFLAT_DEFAULT_LISTS;
 }
 
+/*
+ * Get the quantizer
+ */
+int
+IvfflatGetQuantizer(Relation index)
+{
+	IvfflatOptions *opts = (IvfflatOptions *) index->rd_options;
+
+	if (opts && opts->quantizer != 0)
+		return IvfflatParseQuantizer((char *) opts + opts->quantizer);
+
+	return IVFFLAT_QUANTIZER_NONE;
+}
+
+/*
+ * Get the number of subvectors for product quantization
+ */
+int
+IvfflatGetPqM(Relation index)
+{
+	IvfflatOptions *opts = (IvfflatOptions *) index->rd_options;
+
+	if (opts)
+		return opts->pqM;
+
+	return IVFFLAT_DEFAULT_PQ_M;
+}
+
+/*
+ * Get the number of coarse lists in the index
+ */
+int
+IvfflatGetCoarseLists(Relation index)
+{
+	IvfflatOptions *opts = (IvfflatOptions *) index->rd_options;
+
+	if (opts)
+		return opts->coarseLists;
+
+	return IVFFLAT_DEFAULT_COARSE_LISTS;
+}
+
 /*
  * Get proc
  */
@@ -182,6 +224,90 @@ IvfflatGetMetaPageInfo(Relation index, int *lists, int *dimensions)
 	UnlockReleaseBuffer(buf);
 }
 
+/*
+ * Get the coarse list info from the metapage
+ */
+void
+IvfflatGetCoarseInfo(Relation index, int *coarseLists, BlockNumber *coarsePage)
+{
+	Buffer		buf;
+	Page		page;
+	IvfflatMetaPage metap;
+
+	buf = ReadBuffer(index, IVFFLAT_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	metap = IvfflatPageGetMeta(page);
+
+	if (unlikely(metap->magicNumber != IVFFLAT_MAGIC_NUMBER))
+		elog(ERROR, "ivfflat index is not valid");
+
+	/* Zero for indexes created before coarse lists */
+	*coarseLists = metap->coarseLists;
+	*coarsePage = metap->coarseLists > 0 ? metap->coarsePage : InvalidBlockNumber;
+
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Compare coarse item distances
+ */
+static int
+CompareCoarseItems(const void *a, const void *b)
+{
+	if (((const IvfflatCoarseItem *) a)->distance < ((const IvfflatCoarseItem *) b)->distance)
+		return -1;
+
+	if (((const IvfflatCoarseItem *) a)->distance > ((const IvfflatCoarseItem *) b)->distance)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Get the coarse lists sorted by distance to a value
+ */
+IvfflatCoarseItem *
+IvfflatGetCoarseItems(Relation index, int coarseLists, BlockNumber coarsePage, FmgrInfo *procinfo, Oid collation, Datum value)
+{
+	IvfflatCoarseItem *items = palloc(coarseLists * sizeof(IvfflatCoarseItem));
+	BlockNumber nextblkno = coarsePage;
+	int			count = 0;
+
+	while (BlockNumberIsValid(nextblkno))
+	{
+		Buffer		cbuf;
+		Page		cpage;
+		OffsetNumber maxoffno;
+
+		cbuf = ReadBuffer(index, nextblkno);
+		LockBuffer(cbuf, BUFFER_LOCK_SHARE);
+		cpage = BufferGetPage(cbuf);
+		maxoffno = PageGetMaxOffsetNumber(cpage);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno && count < coarseLists; offno = OffsetNumberNext(offno))
+		{
+			IvfflatCoarseList coarse = (IvfflatCoarseList) PageGetItem(cpage, PageGetItemId(cpage, offno));
+			IvfflatCoarseItem *item = &items[count++];
+
+			item->firstList = coarse->firstList;
+			item->listCount = coarse->listCount;
+			item->distance = DatumGetPointer(value) == NULL ? 0.0 : DatumGetFloat8(FunctionCall2Coll(procinfo, collation, value, PointerGetDatum(&coarse->center)));
+		}
+
+		nextblkno = IvfflatPageGetOpaque(cpage)->nextblkno;
+
+		UnlockReleaseBuffer(cbuf);
+	}
+
+	if (count != coarseLists)
+		elog(ERROR, "ivfflat coarse lists not found");
+
+	qsort(items, count, sizeof(IvfflatCoarseItem), CompareCoarseItems);
+
+	return items;
+}
+
 /*
  * Update the start or insert page of a list
  */
@@ -0,0 +1,28 @@
+#include "postgres.h"
+
+#include "storage/bufmgr.h"
+#include "utils/rel.h"
+#include "vacuumutils.h"
+
+/*
+ * Prefetch pages likely to follow a page in a chain
+ *
+ * Pages for a chain (an HNSW element chain or an IVFFlat list) are mostly
+ * added together at the end of the index, so chains are mostly contiguous
+ * and their next page is not known until the page is read
+ */
+void
+VacuumPrefetchNext(Relation index, BlockNumber blkno, BlockNumber nblocks, BlockNumber *prefetched)
+{
+	BlockNumber end = Min(blkno + VacuumPrefetchDistance(), nblocks - 1);
+	BlockNumber start = blkno + 1;
+
+	/* Continue from previous prefetch if page was part of it */
+	if (blkno < *prefetched && *prefetched <= end)
+		start = *prefetched + 1;
+
+	for (BlockNumber i = start; i <= end; i++)
+		PrefetchBuffer(index, MAIN_FORKNUM, i);
+
+	*prefetched = end;
+}
@@ -0,0 +1,15 @@
+#ifndef VACUUMUTILS_H
+#define VACUUMUTILS_H
+
+#include "storage/block.h"
+#include "utils/relcache.h"
+
+#if PG_VERSION_NUM >= 130000
+#define VacuumPrefetchDistance() maintenance_io_concurrency
+#else
+#define VacuumPrefetchDistance() effective_io_concurrency
+#endif
+
+void		VacuumPrefetchNext(Relation index, BlockNumber blkno, BlockNumber nblocks, BlockNumber *prefetched);
+
+#endif
@@ -67,6 +67,97 @@ SELECT * FROM t ORDER BY val <-> '[3,3,3]';
 
 DROP TABLE t;
 
+-- index-only scans
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING hnsw (val vector_l2_ops);
+VACUUM t;
+
+EXPLAIN (COSTS OFF) SELECT val FROM t ORDER BY val <-> '[3,3,3]';
+SELECT val FROM t ORDER BY val <-> '[3,3,3]';
+
+DROP TABLE t;
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]');
+CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (quantizer = 'sq8');
+VACUUM t;
+
+EXPLAIN (COSTS OFF) SELECT val FROM t ORDER BY val <-> '[3,3,3]';
+
+DROP TABLE t;
+
+-- quantizer
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (quantizer = 'sq8');
+INSERT INTO t (val) VALUES ('[1,2,4]');
+
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+
+DROP TABLE t;
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (quantizer = 'bit');
+INSERT INTO t (val) VALUES ('[1,2,4]');
+
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+
+DROP TABLE t;
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[4,4,4]');
+CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (quantizer = 'sq8');
+INSERT INTO t (val) VALUES ('[1,1,1]'), ('[1.001,1,1]'), ('[1,1,1.001]');
+
+SELECT * FROM t ORDER BY val <-> '[1.001,1,1]';
+
+DROP TABLE t;
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[4,4,4]'), ('[1,1,1]'), ('[1.001,1,1]'), ('[1,1,1.001]');
+SET hnsw.quantized_build = on;
+CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (quantizer = 'sq8');
+RESET hnsw.quantized_build;
+
+SELECT * FROM t ORDER BY val <-> '[1.001,1,1]';
+
+DROP TABLE t;
+
+CREATE TABLE t (val vector(3000));
+INSERT INTO t (val) SELECT array_fill(i, '{3000}')::vector FROM generate_series(1, 3) i;
+CREATE INDEX ON t USING hnsw (val vector_l2_ops);
+CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (quantizer = 'sq8');
+INSERT INTO t (val) VALUES (array_fill(4, '{3000}')::vector);
+
+SELECT subvector(val, 1, 1) FROM t ORDER BY val <-> array_fill(2.9, '{3000}')::vector;
+
+DROP TABLE t;
+
+-- compact
+
+CREATE TABLE t (i int4, val vector(3));
+INSERT INTO t (i, val) SELECT i, ARRAY[i, i, i] FROM generate_series(1, 1000) i;
+CREATE INDEX idx ON t USING hnsw (val vector_l2_ops);
+DELETE FROM t WHERE i <= 900;
+VACUUM t;
+
+SELECT hnsw_compact('idx') > 0;
+SET hnsw.ef_search = 1000;
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> '[0,0,0]') t2;
+INSERT INTO t (i, val) SELECT i, ARRAY[i, i, i] FROM generate_series(1, 100) i;
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> '[0,0,0]') t2;
+RESET hnsw.ef_search;
+
+CREATE INDEX idx2 ON t (val);
+SELECT hnsw_compact('idx2');
+SELECT hnsw_compact('t');
+
+DROP TABLE t;
+
 -- options
 
 CREATE TABLE t (val vector(3));
@@ -75,10 +166,16 @@ CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (m = 101);
 CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (ef_construction = 3);
 CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (ef_construction = 1001);
 CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (m = 16, ef_construction = 31);
+CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (quantizer = 'sq2');
 
 SHOW hnsw.ef_search;
 
 SET hnsw.ef_search = 0;
 SET hnsw.ef_search = 1001;
 
+SHOW hnsw.rerank_k;
+
+SET hnsw.rerank_k = -2;
+SET hnsw.rerank_k = 1001;
+
 DROP TABLE t;
@@ -12,6 +12,11 @@ SELECT * FROM t ORDER BY val <-> '[3,3,3]';
 SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> (SELECT NULL::vector)) t2;
 SELECT COUNT(*) FROM t;
 
+SET ivfflat.batch_size = 1;
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> (SELECT NULL::vector)) t2;
+RESET ivfflat.batch_size;
+
 TRUNCATE t;
 SELECT * FROM t ORDER BY val <-> '[3,3,3]';
 
@@ -54,12 +59,96 @@ SELECT * FROM t ORDER BY val <-> '[3,3,3]';
 
 DROP TABLE t;
 
+-- coarse lists
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 3, coarse_lists = 2);
+
+INSERT INTO t (val) VALUES ('[1,2,4]');
+
+SET ivfflat.probes = 3;
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+SET ivfflat.probe_ratio = 1000;
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+RESET ivfflat.probe_ratio;
+RESET ivfflat.probes;
+
+DROP TABLE t;
+
+-- probe ratio
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) SELECT '[0,0,0]' FROM generate_series(1, 10);
+INSERT INTO t (val) SELECT '[100,0,0]' FROM generate_series(1, 10);
+INSERT INTO t (val) SELECT '[0,100,0]' FROM generate_series(1, 10);
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 3);
+
+SET ivfflat.probes = 3;
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> '[1,0,0]') t2;
+SET ivfflat.probe_ratio = 1.5;
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> '[1,0,0]') t2;
+SELECT DISTINCT val FROM (SELECT * FROM t ORDER BY val <-> '[1,0,0]') t2;
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> '[50,1,0]') t2;
+RESET ivfflat.probe_ratio;
+RESET ivfflat.probes;
+
+DROP TABLE t;
+
+-- quantizer
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 1, quantizer = 'pq', pq_m = 3);
+
+INSERT INTO t (val) VALUES ('[1,2,4]');
+
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+
+DROP TABLE t;
+
+-- rebalance
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) SELECT '[0,0,0]' FROM generate_series(1, 10);
+INSERT INTO t (val) SELECT '[100,0,0]' FROM generate_series(1, 10);
+INSERT INTO t (val) SELECT '[0,100,0]' FROM generate_series(1, 10);
+CREATE INDEX idx ON t USING ivfflat (val vector_l2_ops) WITH (lists = 3);
+
+INSERT INTO t (val) SELECT '[0,0,1]' FROM generate_series(1, 500);
+
+SELECT ivfflat_rebalance('idx');
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> '[0,0,1]') t2;
+SET ivfflat.probes = 3;
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> '[0,0,1]') t2;
+RESET ivfflat.probes;
+
+SELECT ivfflat_rebalance('idx');
+
+DROP INDEX idx;
+CREATE INDEX idx ON t USING ivfflat (val vector_l2_ops) WITH (lists = 3, coarse_lists = 2);
+SELECT ivfflat_rebalance('idx');
+
+CREATE INDEX idx2 ON t (val);
+SELECT ivfflat_rebalance('idx2');
+SELECT ivfflat_rebalance('t');
+
+DROP TABLE t;
+
 -- options
 
 CREATE TABLE t (val vector(3));
 CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 0);
 CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 32769);
 
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (quantizer = 'sq8');
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (quantizer = 'pq', pq_m = 2);
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 1, coarse_lists = 1);
+
 SHOW ivfflat.probes;
+SHOW ivfflat.rerank_k;
+SHOW ivfflat.batch_size;
+SHOW ivfflat.coarse_probes;
+SHOW ivfflat.probe_ratio;
 
 DROP TABLE t;
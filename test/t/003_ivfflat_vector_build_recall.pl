@@ -125,6 +125,7 @@ for my $i (0 .. $#operators)
 	));
 	is($ret, 0, $stderr);
 	like($stderr, qr/using \d+ parallel workers/);
+	like($stderr, qr/using \d+ parallel workers for k-means/);
 
 	# Test approximate results
 	if ($operator ne "<#>")
@@ -0,0 +1,132 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+
+sub get_expected
+{
+	@expected = ();
+	foreach (@queries)
+	{
+		my $res = $node->safe_psql("postgres", qq(
+			SET enable_indexscan = off;
+			SELECT i FROM tst ORDER BY v <-> '$_' LIMIT $limit;
+		));
+		push(@expected, $res);
+	}
+}
+
+sub test_recall
+{
+	my ($min, $test_name) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	my $explain = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		EXPLAIN ANALYZE SELECT i FROM tst ORDER BY v <-> '$queries[0]' LIMIT $limit;
+	));
+	like($explain, qr/Index Scan/);
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SELECT i FROM tst ORDER BY v <-> '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+		my %actual_set = map { $_ => 1 } @actual_ids;
+
+		my @expected_ids = split("\n", $expected[$i]);
+
+		foreach (@expected_ids)
+		{
+			if (exists($actual_set{$_}))
+			{
+				$correct++;
+			}
+			$total++;
+		}
+	}
+
+	cmp_ok($correct / $total, ">=", $min, $test_name);
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector(3));");
+$node->safe_psql("postgres", "ALTER TABLE tst SET (autovacuum_enabled = false);");
+
+# Generate queries
+for (1 .. 20)
+{
+	my $r1 = rand();
+	my $r2 = rand();
+	my $r3 = rand();
+	push(@queries, "[$r1,$r2,$r3]");
+}
+
+my @quantizers = ("sq8", "sq4");
+my @mins = (0.99, 0.9);
+
+for my $j (0 .. $#quantizers)
+{
+	my $quantizer = $quantizers[$j];
+	my $min = $mins[$j];
+
+	$node->safe_psql("postgres", "TRUNCATE tst;");
+	$node->safe_psql("postgres",
+		"INSERT INTO tst SELECT i, ARRAY[random(), random(), random()] FROM generate_series(1, 5000) i;"
+	);
+
+	# Add index
+	$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops) WITH (quantizer = '$quantizer');");
+
+	get_expected();
+	test_recall($min, "$quantizer build");
+
+	# Insert data
+	$node->safe_psql("postgres",
+		"INSERT INTO tst SELECT i, ARRAY[random(), random(), random()] FROM generate_series(5001, 10000) i;"
+	);
+
+	get_expected();
+	test_recall($min, "$quantizer insert");
+
+	# Delete data and reuse space
+	$node->safe_psql("postgres", "DELETE FROM tst WHERE i % 2 = 0;");
+	$node->safe_psql("postgres", "VACUUM tst;");
+	$node->safe_psql("postgres",
+		"INSERT INTO tst SELECT i, ARRAY[random(), random(), random()] FROM generate_series(10001, 12500) i;"
+	);
+
+	get_expected();
+	test_recall($min - 0.05, "$quantizer vacuum");
+
+	# Build graph with quantized distances
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+	my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+		SET client_min_messages = DEBUG;
+		SET hnsw.quantized_build = on;
+		CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops) WITH (quantizer = '$quantizer');
+	));
+	is($ret, 0, $stderr);
+	like($stderr, qr/using \d+ samples for quantized build/);
+
+	test_recall($min - 0.05, "$quantizer quantized build");
+
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+}
+
+done_testing();
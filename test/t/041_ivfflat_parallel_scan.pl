@@ -0,0 +1,86 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $dim = 3;
+my $limit = 20;
+
+my $array_sql = join(",", ('random()') x $dim);
+
+# Initialize node
+my $node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table and index
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 100);");
+$node->safe_psql("postgres", "ANALYZE tst;");
+
+my $parallel_sql = qq(
+	SET enable_seqscan = off;
+	SET ivfflat.probes = 10;
+	SET max_parallel_workers_per_gather = 2;
+	SET parallel_setup_cost = 0;
+	SET parallel_tuple_cost = 0;
+	SET min_parallel_table_scan_size = 0;
+	SET min_parallel_index_scan_size = 0;
+);
+
+# Generate queries
+my @queries = ();
+for (1 .. 10)
+{
+	my @r = ();
+	for (1 .. $dim)
+	{
+		push(@r, rand());
+	}
+	push(@queries, "[" . join(",", @r) . "]");
+}
+
+# Test plan
+my $explain = $node->safe_psql("postgres", qq(
+	$parallel_sql
+	EXPLAIN ANALYZE SELECT i FROM tst ORDER BY v <-> '$queries[0]' LIMIT $limit;
+));
+like($explain, qr/Gather Merge/);
+like($explain, qr/Parallel Index Scan using idx/);
+
+# Test results match a serial scan of the same lists
+for my $query (@queries)
+{
+	my $expected = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET ivfflat.probes = 10;
+		SET max_parallel_workers_per_gather = 0;
+		SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit;
+	));
+	my $actual = $node->safe_psql("postgres", qq(
+		$parallel_sql
+		SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit;
+	));
+	is($actual, $expected);
+}
+
+# Test more rows than a batch
+my $expected = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET ivfflat.probes = 10;
+	SET max_parallel_workers_per_gather = 0;
+	SELECT i FROM tst ORDER BY v <-> '$queries[0]' LIMIT 200;
+));
+my $actual = $node->safe_psql("postgres", qq(
+	$parallel_sql
+	SET ivfflat.batch_size = 10;
+	SELECT i FROM tst ORDER BY v <-> '$queries[0]' LIMIT 200;
+));
+is($actual, $expected);
+
+done_testing();
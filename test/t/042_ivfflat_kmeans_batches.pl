@@ -0,0 +1,83 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $dim = 3;
+my $limit = 20;
+
+my $array_sql = join(",", ('random()') x $dim);
+
+# Initialize node
+my $node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 60000) i;"
+);
+
+# Build index with samples that do not fit in maintenance_work_mem
+my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET client_min_messages = DEBUG;
+	SET maintenance_work_mem = '1MB';
+	SET max_parallel_maintenance_workers = 0;
+	CREATE INDEX idx ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 1000);
+));
+is($ret, 0, $stderr);
+like($stderr, qr/using \d+ batches of \d+ samples for k-means/);
+
+# Test all lists are used
+my $count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET ivfflat.probes = 1000;
+	SELECT COUNT(*) FROM (SELECT v FROM tst ORDER BY v <-> '[0,0,0]') t;
+));
+is($count, 60000);
+
+# Generate queries
+my @queries = ();
+for (1 .. 10)
+{
+	my @r = ();
+	for (1 .. $dim)
+	{
+		push(@r, rand());
+	}
+	push(@queries, "[" . join(",", @r) . "]");
+}
+
+# Test approximate results
+my $correct = 0;
+my $total = 0;
+
+for my $query (@queries)
+{
+	my $expected = $node->safe_psql("postgres", qq(
+		SET enable_indexscan = off;
+		SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit;
+	));
+	my $actual = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET ivfflat.probes = 20;
+		SELECT i FROM tst ORDER BY v <-> '$query' LIMIT $limit;
+	));
+
+	my %actual_set = map { $_ => 1 } split("\n", $actual);
+	foreach (split("\n", $expected))
+	{
+		if (exists($actual_set{$_}))
+		{
+			$correct++;
+		}
+		$total++;
+	}
+}
+
+cmp_ok($correct / $total, ">=", 0.9);
+
+done_testing();
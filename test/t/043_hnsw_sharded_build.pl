@@ -0,0 +1,120 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+my $array_sql = join(",", ('random()') x 3);
+
+sub test_recall
+{
+	my ($min, $test_name) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	my $explain = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		EXPLAIN ANALYZE SELECT i FROM tst ORDER BY v <-> '$queries[0]' LIMIT $limit;
+	));
+	like($explain, qr/Index Scan/);
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SELECT i FROM tst ORDER BY v <-> '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+		my %actual_set = map { $_ => 1 } @actual_ids;
+
+		my @expected_ids = split("\n", $expected[$i]);
+
+		foreach (@expected_ids)
+		{
+			if (exists($actual_set{$_}))
+			{
+				$correct++;
+			}
+			$total++;
+		}
+	}
+
+	cmp_ok($correct / $total, ">=", $min, $test_name);
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector(3));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 20000) i;"
+);
+
+# Generate queries
+for (1 .. 20)
+{
+	my $r1 = rand();
+	my $r2 = rand();
+	my $r3 = rand();
+	push(@queries, "[$r1,$r2,$r3]");
+}
+
+# Get exact results
+foreach (@queries)
+{
+	my $res = $node->safe_psql("postgres", "SELECT i FROM tst ORDER BY v <-> '$_' LIMIT $limit;");
+	push(@expected, $res);
+}
+
+# Build index serially in shards
+my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET max_parallel_maintenance_workers = 0;
+	SET maintenance_work_mem = '2MB';
+	SET hnsw.sharded_build = on;
+	CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops);
+));
+is($ret, 0, $stderr);
+like($stderr, qr/hnsw graph no longer fits into maintenance_work_mem/);
+like($stderr, qr/built in shards/);
+
+# Test approximate results
+test_recall(0.95, "serial");
+
+# Test all tuples are reachable
+my $count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET hnsw.ef_search = 1000;
+	SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '$queries[0]' LIMIT 1000) t;
+));
+is($count, 1000);
+
+$node->safe_psql("postgres", "DROP INDEX idx;");
+
+# Build index in parallel in shards
+# Set parallel_workers on table to use workers with low maintenance_work_mem
+($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	ALTER TABLE tst SET (parallel_workers = 2);
+	SET client_min_messages = DEBUG;
+	SET maintenance_work_mem = '4MB';
+	SET hnsw.sharded_build = on;
+	CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops);
+	ALTER TABLE tst RESET (parallel_workers);
+));
+is($ret, 0, $stderr);
+like($stderr, qr/using \d+ parallel workers/);
+like($stderr, qr/built in shards/);
+
+# Test approximate results
+test_recall(0.95, "parallel");
+
+$node->safe_psql("postgres", "DROP INDEX idx;");
+
+done_testing();
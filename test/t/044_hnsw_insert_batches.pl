@@ -0,0 +1,143 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+my $array_sql = join(",", ('random() * random()') x 3);
+
+sub test_recall
+{
+	my ($min, $operator) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	my $explain = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		EXPLAIN ANALYZE SELECT i FROM tst ORDER BY v $operator '$queries[0]' LIMIT $limit;
+	));
+	like($explain, qr/Index Scan/);
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SELECT i FROM tst ORDER BY v $operator '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+		my %actual_set = map { $_ => 1 } @actual_ids;
+
+		my @expected_ids = split("\n", $expected[$i]);
+
+		foreach (@expected_ids)
+		{
+			if (exists($actual_set{$_}))
+			{
+				$correct++;
+			}
+			$total++;
+		}
+	}
+
+	cmp_ok($correct / $total, ">=", $min, $operator);
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table and index
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i serial, v vector(3));");
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops);");
+
+# Generate queries
+for (1 .. 20)
+{
+	my $r1 = rand();
+	my $r2 = rand();
+	my $r3 = rand();
+	push(@queries, "[$r1,$r2,$r3]");
+}
+
+# Use batches with a partial batch at the end of each statement
+$node->safe_psql("postgres", qq(
+	SET hnsw.insert_batch_size = 1000;
+	INSERT INTO tst (v) SELECT ARRAY[$array_sql] FROM generate_series(1, 5500) i;
+	INSERT INTO tst (v) SELECT ARRAY[$array_sql] FROM generate_series(1, 4500) i;
+));
+
+# Use duplicates within a batch
+$node->safe_psql("postgres", qq(
+	SET hnsw.insert_batch_size = 100;
+	INSERT INTO tst (v) SELECT '[0.5,0.5,0.5]' FROM generate_series(1, 150) i;
+));
+
+# Use concurrent inserts
+$node->pgbench(
+	"--no-vacuum --client=5 --transactions=20",
+	0,
+	[qr{actually processed}],
+	[qr{^$}],
+	"concurrent batched INSERTs",
+	{
+		"044_hnsw_insert_batches" => "SET hnsw.insert_batch_size = 50; INSERT INTO tst (v) SELECT ARRAY[$array_sql] FROM generate_series(1, 100) i;"
+	}
+);
+
+# Get exact results
+foreach (@queries)
+{
+	my $res = $node->safe_psql("postgres", qq(
+		SET enable_indexscan = off;
+		SELECT i FROM tst ORDER BY v <-> '$_' LIMIT $limit;
+	));
+	push(@expected, $res);
+}
+
+# Test approximate results
+test_recall(0.99, "<->");
+
+# Test duplicates are found
+my $count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET hnsw.ef_search = 200;
+	SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '[0.5,0.5,0.5]' LIMIT 150) t WHERE v = '[0.5,0.5,0.5]';
+));
+is($count, 150);
+
+# Test triggers at the end of the statement run before the batch is added
+$node->safe_psql("postgres", qq(
+	CREATE TABLE trg (v vector(3));
+	CREATE INDEX ON trg USING hnsw (v vector_l2_ops);
+	CREATE TABLE trg_log (n int);
+	CREATE FUNCTION trg_count() RETURNS trigger AS \$\$
+	BEGIN
+		INSERT INTO trg_log SELECT COUNT(*) FROM (SELECT v FROM trg ORDER BY v <-> '[0,0,0]' LIMIT 10) t;
+		RETURN NULL;
+	END;
+	\$\$ LANGUAGE plpgsql;
+	CREATE TRIGGER trg_count AFTER INSERT ON trg FOR EACH STATEMENT EXECUTE FUNCTION trg_count();
+));
+$node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET hnsw.insert_batch_size = 1000;
+	INSERT INTO trg (v) SELECT ARRAY[$array_sql] FROM generate_series(1, 10) i;
+));
+my $version = $node->safe_psql("postgres", "SHOW server_version_num;");
+$count = $node->safe_psql("postgres", "SELECT n FROM trg_log;");
+is($count, $version >= 170000 ? 0 : 10);
+
+# Test the batch is visible after the statement
+$count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SELECT COUNT(*) FROM (SELECT v FROM trg ORDER BY v <-> '[0,0,0]' LIMIT 10) t;
+));
+is($count, 10);
+
+done_testing();
@@ -0,0 +1,164 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+my $array_sql = join(",", ('random()') x 3);
+
+sub get_expected
+{
+	my @res = ();
+
+	foreach (@queries)
+	{
+		push(@res, $node->safe_psql("postgres", qq(
+			SET enable_indexscan = off;
+			SELECT i FROM tst ORDER BY v <-> '$_' LIMIT $limit;
+		)));
+	}
+
+	return @res;
+}
+
+sub test_recall
+{
+	my ($min, $test_name) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SELECT i FROM tst ORDER BY v <-> '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+		my %actual_set = map { $_ => 1 } @actual_ids;
+
+		my @expected_ids = split("\n", $expected[$i]);
+
+		foreach (@expected_ids)
+		{
+			if (exists($actual_set{$_}))
+			{
+				$correct++;
+			}
+			$total++;
+		}
+	}
+
+	cmp_ok($correct / $total, ">=", $min, $test_name);
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table and index
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector(3));");
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops);");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+
+# Delete most rows inserted first
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i <= 7000;");
+$node->safe_psql("postgres", "VACUUM tst;");
+
+# Generate queries
+for (1 .. 20)
+{
+	my $r1 = rand();
+	my $r2 = rand();
+	my $r3 = rand();
+	push(@queries, "[$r1,$r2,$r3]");
+}
+
+# Get exact results
+@expected = get_expected();
+
+my $size = $node->safe_psql("postgres", "SELECT pg_relation_size('idx');");
+
+# Compact index
+my $removed = $node->safe_psql("postgres", "SELECT hnsw_compact('idx');");
+cmp_ok($removed, ">", 0, "pages removed");
+
+my $new_size = $node->safe_psql("postgres", "SELECT pg_relation_size('idx');");
+cmp_ok($new_size, "<", $size, "index size");
+
+# Test approximate results
+test_recall(0.95, "compact");
+
+# Test all tuples are reachable
+my $count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET hnsw.ef_search = 1000;
+	SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '$queries[0]' LIMIT 1000) t;
+));
+is($count, 1000);
+
+# Test inserts and vacuum after compacting
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 1000) i;"
+);
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i <= 500;");
+$node->safe_psql("postgres", "VACUUM tst;");
+
+$count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET hnsw.ef_search = 1000;
+	SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '$queries[0]' LIMIT 1000) t;
+));
+is($count, 1000);
+
+# Test compacting again
+$removed = $node->safe_psql("postgres", "SELECT hnsw_compact('idx');");
+cmp_ok($removed, ">=", 0, "compact again");
+
+# Test split vectors, which are on separate pages
+$node->safe_psql("postgres", "DROP INDEX idx;");
+$node->safe_psql("postgres", "TRUNCATE tst;");
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops) WITH (split_vectors = 1);");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i <= 7000;");
+$node->safe_psql("postgres", "VACUUM tst;");
+
+@expected = get_expected();
+
+$size = $node->safe_psql("postgres", "SELECT pg_relation_size('idx');");
+
+$removed = $node->safe_psql("postgres", "SELECT hnsw_compact('idx');");
+cmp_ok($removed, ">", 0, "pages removed with split vectors");
+
+$new_size = $node->safe_psql("postgres", "SELECT pg_relation_size('idx');");
+cmp_ok($new_size, "<", $size, "index size with split vectors");
+
+test_recall(0.95, "compact with split vectors");
+
+$count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET hnsw.ef_search = 1000;
+	SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '$queries[0]' LIMIT 1000) t;
+));
+is($count, 1000);
+
+# Test inserts reuse vector tuples after compacting
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 1000) i;"
+);
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i <= 500;");
+$node->safe_psql("postgres", "VACUUM tst;");
+
+@expected = get_expected();
+test_recall(0.95, "inserts after compact with split vectors");
+
+done_testing();
@@ -0,0 +1,132 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+
+sub test_recall
+{
+	my ($min, $test_name) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SELECT i FROM tst ORDER BY v <-> '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+		my %actual_set = map { $_ => 1 } @actual_ids;
+
+		my @expected_ids = split("\n", $expected[$i]);
+
+		foreach (@expected_ids)
+		{
+			if (exists($actual_set{$_}))
+			{
+				$correct++;
+			}
+			$total++;
+		}
+	}
+
+	cmp_ok($correct / $total, ">=", $min, $test_name);
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector(3));");
+$node->safe_psql("postgres", "ALTER TABLE tst SET (autovacuum_enabled = false);");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[random(), random(), random()] FROM generate_series(1, 10000) i;"
+);
+
+# Add index
+$node->safe_psql("postgres", "CREATE INDEX ON tst USING hnsw (v vector_l2_ops) WITH (m = 8);");
+
+# Delete a region so remaining elements near it lose neighbors
+$node->safe_psql("postgres", "DELETE FROM tst WHERE v <-> '[0.5,0.5,0.5]' < 0.3;");
+
+# Generate queries
+for (1 .. 20)
+{
+	my $r1 = rand();
+	my $r2 = rand();
+	my $r3 = rand();
+	push(@queries, "[$r1,$r2,$r3]");
+}
+
+# Get exact results
+foreach (@queries)
+{
+	my $res = $node->safe_psql("postgres", qq(
+		SET enable_indexscan = off;
+		SELECT i FROM tst ORDER BY v <-> '$_' LIMIT $limit;
+	));
+	push(@expected, $res);
+}
+
+# Vacuum serially
+my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET client_min_messages = DEBUG;
+	SET max_parallel_maintenance_workers = 0;
+	VACUUM tst;
+));
+is($ret, 0, $stderr);
+like($stderr, qr/repaired [1-9]\d* hnsw elements through deleted neighbors/);
+
+test_recall(0.95, "after local repair");
+
+# Test all tuples are reachable
+my $count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET hnsw.ef_search = 1000;
+	SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '[0.5,0.5,0.5]' LIMIT 1000) t;
+));
+is($count, 1000);
+
+# Delete most rows so remaining elements are repaired with a search, which
+# must skip the element itself and not use product quantization
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i % 10 != 0;");
+
+@expected = ();
+foreach (@queries)
+{
+	my $res = $node->safe_psql("postgres", qq(
+		SET enable_indexscan = off;
+		SELECT i FROM tst ORDER BY v <-> '$_' LIMIT $limit;
+	));
+	push(@expected, $res);
+}
+
+($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET client_min_messages = DEBUG;
+	SET max_parallel_maintenance_workers = 0;
+	VACUUM tst;
+));
+is($ret, 0, $stderr);
+like($stderr, qr/and [1-9]\d* with search/);
+
+test_recall(0.95, "after search repair");
+
+# Test all remaining tuples are reachable
+my $total = $node->safe_psql("postgres", "SELECT COUNT(*) FROM tst;");
+$count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET hnsw.ef_search = 1000;
+	SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '[0.5,0.5,0.5]' LIMIT 1000) t;
+));
+is($count, $total);
+
+done_testing();
@@ -0,0 +1,171 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+# Product quantization reads the codebook path from this file
+my $pq_config = "/root/pqfile.pth";
+
+if (!-w "/root")
+{
+	plan skip_all => "$pq_config is not writable";
+}
+
+my $node;
+my @queries = ();
+my @expected;
+my $limit = 20;
+my $array_sql = join(",", ('random()') x 4);
+
+sub get_expected
+{
+	@expected = ();
+
+	foreach (@queries)
+	{
+		my $res = $node->safe_psql("postgres", qq(
+			SET enable_indexscan = off;
+			SELECT i FROM tst ORDER BY v <-> '$_' LIMIT $limit;
+		));
+		push(@expected, $res);
+	}
+}
+
+sub test_recall
+{
+	my ($min, $test_name) = @_;
+	my $correct = 0;
+	my $total = 0;
+
+	my $explain = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		EXPLAIN ANALYZE SELECT i FROM tst ORDER BY v <-> '$queries[0]' LIMIT $limit;
+	));
+	like($explain, qr/Index Scan/);
+
+	for my $i (0 .. $#queries)
+	{
+		my $actual = $node->safe_psql("postgres", qq(
+			SET enable_seqscan = off;
+			SET hnsw.ef_search = 100;
+			SELECT i FROM tst ORDER BY v <-> '$queries[$i]' LIMIT $limit;
+		));
+		my @actual_ids = split("\n", $actual);
+		my %actual_set = map { $_ => 1 } @actual_ids;
+
+		my @expected_ids = split("\n", $expected[$i]);
+
+		foreach (@expected_ids)
+		{
+			if (exists($actual_set{$_}))
+			{
+				$correct++;
+			}
+			$total++;
+		}
+	}
+
+	cmp_ok($correct / $total, ">=", $min, $test_name);
+}
+
+# Write a codebook with 2 subspaces of 2 dimensions and 16 centroids each,
+# placed on a grid over the unit square
+my $codebook = PostgreSQL::Test::Utils::tempdir() . "/codebook";
+my @centroids = ();
+for my $j (0 .. 1)
+{
+	for my $k (0 .. 15)
+	{
+		push(@centroids, (($k % 4) + 0.5) / 4, (int($k / 4) + 0.5) / 4);
+	}
+}
+open(my $fh, '>:raw', $codebook) or die "could not open $codebook: $!";
+print $fh pack("l4", 0, 4, 2, 4) . pack("f*", @centroids);
+close($fh);
+
+# Point the config file to the codebook, restoring it at the end
+my $old_config;
+if (-e $pq_config)
+{
+	$old_config = slurp_file($pq_config);
+}
+open($fh, '>', $pq_config) or die "could not open $pq_config: $!";
+print $fh $codebook;
+close($fh);
+
+END
+{
+	if (defined($old_config))
+	{
+		if (open(my $out, '>', $pq_config))
+		{
+			print $out $old_config;
+			close($out);
+		}
+	}
+	elsif (defined($codebook))
+	{
+		unlink($pq_config);
+	}
+}
+
+# Initialize node
+$node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table and index
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector(4));");
+$node->safe_psql("postgres", "ALTER TABLE tst SET (autovacuum_enabled = false);");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 5000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops) WITH (use_pq = 1, pq_m = 2, nbits = 4);");
+
+# Generate queries
+for (1 .. 20)
+{
+	my $r1 = rand();
+	my $r2 = rand();
+	my $r3 = rand();
+	my $r4 = rand();
+	push(@queries, "[$r1,$r2,$r3,$r4]");
+}
+
+get_expected();
+test_recall(0.9, "build");
+
+# Insert in a new session, before any scan loads the codebook
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(5001, 10000) i;"
+);
+
+get_expected();
+test_recall(0.9, "insert");
+
+# Test inserted elements are reachable
+my $count = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET hnsw.ef_search = 1000;
+	SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY v <-> '$queries[0]' LIMIT 1000) t WHERE i > 5000;
+));
+cmp_ok($count, ">", 400);
+
+# Repair the graph with product quantization codes on vacuum
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i % 2 = 0;");
+$node->safe_psql("postgres", "VACUUM tst;");
+
+get_expected();
+test_recall(0.85, "vacuum");
+
+# Test inserts after vacuum
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(10001, 12500) i;"
+);
+
+get_expected();
+test_recall(0.85, "insert after vacuum");
+
+done_testing();